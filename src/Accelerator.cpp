@@ -0,0 +1,113 @@
+#include "Accelerator.h"
+#include "KDTree.h"
+#include "BVH4.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+namespace
+{
+	/**
+	 * Smaller scenes build fast with either structure, they get the kd-tree
+	 * */
+	const int minProbedSpheres = 1 << 14;
+	const int probeSpheres = 1 << 16;
+	const int probeRays = 1 << 12;
+	const int probeRuns = 3;
+
+	/**
+	 * Best of a few runs, on the calling thread only so the pool load does not interfere
+	 * */
+	double probeSeconds(const Accelerator& accelerator, const vector<Ray>& rays)
+	{
+		vector<IntersectionData> results(rays.size());
+		double best = std::numeric_limits<double>::max();
+		for(int run = 0; run < probeRuns; ++run)
+		{
+			steady_clock::time_point start = steady_clock::now();
+			accelerator.intersectRays(rays.data(), rays.size(), results.data());
+			best = std::min(best, duration<double>(steady_clock::now() - start).count());
+		}
+		return best;
+	}
+}
+
+AcceleratorType chooseAccelerator(const SpheresView& spheres, ThreadPool& pool)
+{
+	if(spheres.count < minProbedSpheres)
+	{
+		return ACCELERATOR_KDTREE;
+	}
+
+	// the spheres in a box around one of them keep the local density and radiuses of the
+	// scene, a box of the scene holding probeSpheres of them if they were spread evenly
+	BoundingBox sceneBox;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		sceneBox.vmin[axis] = std::numeric_limits<float>::max();
+		sceneBox.vmax[axis] = std::numeric_limits<float>::lowest();
+	}
+	for(int i = 0; i < spheres.count; ++i)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			sceneBox.vmin[axis] = std::min(sceneBox.vmin[axis], spheres.centerCoords[axis][i]);
+			sceneBox.vmax[axis] = std::max(sceneBox.vmax[axis], spheres.centerCoords[axis][i]);
+		}
+	}
+
+	float fraction = std::cbrt(static_cast<float>(probeSpheres) / spheres.count);
+	int centerSphere = spheres.count / 2;
+	BoundingBox cropBox;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float halfSide = 0.5f * fraction * (sceneBox.vmax[axis] - sceneBox.vmin[axis]);
+		cropBox.vmin[axis] = spheres.centerCoords[axis][centerSphere] - halfSide;
+		cropBox.vmax[axis] = spheres.centerCoords[axis][centerSphere] + halfSide;
+	}
+
+	Spheres sample;
+	for(int i = 0; i < spheres.count; ++i)
+	{
+		bool inside = true;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			inside = inside && cropBox.inBoundingBox(spheres.centerCoords[axis][i], static_cast<Axis>(axis));
+		}
+		if(inside)
+		{
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				sample.centerCoords[axis].push_back(spheres.centerCoords[axis][i]);
+			}
+			sample.radiuses.push_back(spheres.radiuses[i]);
+		}
+	}
+	sample.count = sample.radiuses.size();
+
+	KDTree kdTree;
+	kdTree.build(SpheresView(sample), pool);
+	BVH4 bvh;
+	bvh.build(SpheresView(sample), pool);
+
+	// incoherent rays from inside the scene
+	const BoundingBox& box = cropBox;
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	std::normal_distribution<float> normal(0.f, 1.f);
+	vector<Ray> rays(probeRays);
+	for(Ray& ray : rays)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			ray.origin[axis] = box.vmin[axis] + (box.vmax[axis] - box.vmin[axis]) * unit(generator);
+			ray.direction[axis] = normal(generator);
+		}
+	}
+
+	return probeSeconds(bvh, rays) < probeSeconds(kdTree, rays) ? ACCELERATOR_BVH4 : ACCELERATOR_KDTREE;
+}
@@ -0,0 +1,122 @@
+#ifndef ACCELERATOR_H_
+#define ACCELERATOR_H_
+
+#include "Common.h"
+#include "Vec3.h"
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+enum Axis
+{
+	AXIS_X = 0,
+	AXIS_Y = 1,
+	AXIS_Z = 2,
+	AXIS_NONE,
+};
+
+struct BoundingBox
+{
+	BoundingBox()
+	{
+		float min = std::numeric_limits<float>::lowest();
+		float max = std::numeric_limits<float>::max();
+		vmin = Vec3(min, min, min);
+		vmax = Vec3(max, max, max);
+	}
+
+	void split(Axis axis, float where, BoundingBox& left, BoundingBox& right) const
+	{
+		left = *this;
+		right = *this;
+		left.vmax[axis] = where;
+		right.vmin[axis] = where;
+
+	}
+
+	bool inBoundingBox(float coord, Axis axis) const
+	{
+		return vmin[axis] <= coord && vmax[axis] >= coord;
+	}
+
+	Vec3 vmin;
+	Vec3 vmax;
+};
+
+/**
+ * Per ray data computed once before the traversal. The direction is normalized,
+ * bit axis of the octant is set when the direction along axis is negative.
+ * */
+struct RayData
+{
+	RayData() : octant(0) {}
+	explicit RayData(const Ray& ray);
+
+	Ray ray;
+	Vec3 invDirection;
+	int octant;
+};
+
+class ThreadPool;
+
+enum AcceleratorType
+{
+	ACCELERATOR_AUTO,
+	ACCELERATOR_KDTREE,
+	ACCELERATOR_BVH4,
+};
+
+/**
+ * Changes to the spheres since the last build or update. Moved spheres have their new
+ * center and radius in the arrays passed to the update, inserted ones are indices not
+ * in the structure, removed ones are not hit anymore and may be inserted again later.
+ * Insertions apply first and removals last.
+ * */
+struct SphereUpdate
+{
+	std::vector<int> moved;
+	std::vector<int> inserted;
+	std::vector<int> removed;
+};
+
+/**
+ * Queries shared by the acceleration structures over spheres, see KDTree for
+ * their exact meaning. SphereScene builds one of them and forwards to it.
+ * */
+class Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+
+	virtual IntersectionData intersectRay(const Ray& ray) const = 0;
+	virtual void intersectRay(const Ray& ray, HitRecord& hit) const = 0;
+	virtual bool isOccluded(const Ray& ray, float maxDistance) const = 0;
+	virtual int countHits(const Ray& ray) const = 0;
+	virtual void intersectRays(const Ray* rays, int count, IntersectionData* results) const = 0;
+	virtual void occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const = 0;
+
+	/**
+	 * Applies the changes, spheres replaces the spheres the structure was built over.
+	 * Must not run concurrently with queries.
+	 * */
+	virtual void update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool) = 0;
+
+	virtual int getSize() const = 0;
+	virtual int getLeaves() const = 0;
+	virtual int getDepth() const = 0;
+	virtual const BoundingBox& getBoundingBox() const = 0;
+	virtual size_t getMemoryUsage() const = 0;
+	virtual size_t getBuildMemoryPeak() const = 0;
+	virtual const char* getName() const = 0;
+};
+
+/**
+ * Builds both structures over the spheres in a box around one of them, sized to hold
+ * a fixed number of them at the average density, so the sample keeps the local density and
+ * radiuses, and picks the one that traces a set of incoherent probe rays from inside
+ * the box faster. Scenes too small to be worth it get the kd-tree.
+ * */
+AcceleratorType chooseAccelerator(const SpheresView& spheres, ThreadPool& pool);
+
+#endif /* ACCELERATOR_H_ */
@@ -0,0 +1,1096 @@
+#include "BVH4.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+#include "Utils.h"
+#include "RayPacket.h"
+#include "Stats.h"
+
+using std::min;
+using std::max;
+using std::numeric_limits;
+
+namespace
+{
+	/**
+	 * Cost of testing the four boxes of a node and of testing one block of spheres
+	 * in a leaf, the kernel tests a whole block at once
+	 * */
+	const float traversalCost = 1.f;
+	const float blockCost = 1.f;
+
+	BoundingBox emptyBox()
+	{
+		BoundingBox box;
+		box.vmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+		box.vmax = Vec3(numeric_limits<float>::lowest(), numeric_limits<float>::lowest(),
+				numeric_limits<float>::lowest());
+		return box;
+	}
+
+	void growBox(BoundingBox& box, const SpheresView& spheres, int sphereIdx)
+	{
+		float radius = spheres.radiuses[sphereIdx];
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			float center = spheres.centerCoords[axis][sphereIdx];
+			box.vmin[axis] = min(box.vmin[axis], center - radius);
+			box.vmax[axis] = max(box.vmax[axis], center + radius);
+		}
+	}
+
+	void growBox(BoundingBox& box, const BoundingBox& other)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			box.vmin[axis] = min(box.vmin[axis], other.vmin[axis]);
+			box.vmax[axis] = max(box.vmax[axis], other.vmax[axis]);
+		}
+	}
+
+	/**
+	 * Zero for the inverted boxes of empty leaves
+	 * */
+	float halfArea(const BoundingBox& box)
+	{
+		if(box.vmin.x > box.vmax.x)
+		{
+			return 0.f;
+		}
+		float dx = box.vmax.x - box.vmin.x, dy = box.vmax.y - box.vmin.y, dz = box.vmax.z - box.vmin.z;
+		return dx * dy + dy * dz + dz * dx;
+	}
+
+	BoundingBox rangeBox(const SpheresView& spheres, const int* ids, int count)
+	{
+		BoundingBox box = emptyBox();
+		for(int i = 0; i < count; ++i)
+		{
+			growBox(box, spheres, ids[i]);
+		}
+		return box;
+	}
+
+	BVH4Node emptyNode(int emptySlot)
+	{
+		BVH4Node node;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			for(int child = 0; child < 4; ++child)
+			{
+				node.bounds[0][axis][child] = numeric_limits<float>::max();
+				node.bounds[1][axis][child] = numeric_limits<float>::lowest();
+			}
+		}
+		std::fill(node.children, node.children + 4, emptySlot);
+		return node;
+	}
+}
+
+const int BVH4::emptySlot;
+
+struct BVH4::BuildContext
+{
+	BuildContext(const SpheresView& spheres, ThreadPool& pool) : spheres(spheres), pool(pool), maxLeafSpheres(0) {}
+
+	const SpheresView& spheres;
+	ThreadPool& pool;
+	/**
+	 * Sphere indices, every range of the build owns a disjoint part
+	 * */
+	vector<int> ids;
+	int maxLeafSpheres;
+};
+
+struct BVH4::BuildRange
+{
+	int first;
+	int count;
+	BoundingBox box;
+	/**
+	 * Set when the range becomes a leaf
+	 * */
+	bool final;
+};
+
+struct BVH4::Subtree
+{
+	Subtree() : depth(0) {}
+
+	vector<BVH4Node> nodes;
+	/**
+	 * firstBlock holds the first index of the leaf in BuildContext::ids until the leaves are packed
+	 * */
+	vector<BVH4Leaf> leaves;
+	int depth;
+};
+
+bool BVH4::splitRange(BuildContext& context, const BuildRange& range, BuildRange& left,
+		BuildRange& right) const
+{
+	const SpheresView& spheres = context.spheres;
+	int* ids = context.ids.data() + range.first;
+
+	// the bins split the bounds of the centers
+	float centerMin[3], centerMax[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		centerMin[axis] = numeric_limits<float>::max();
+		centerMax[axis] = numeric_limits<float>::lowest();
+		for(int i = 0; i < range.count; ++i)
+		{
+			float center = spheres.centerCoords[axis][ids[i]];
+			centerMin[axis] = min(centerMin[axis], center);
+			centerMax[axis] = max(centerMax[axis], center);
+		}
+	}
+
+	float scale[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float extent = centerMax[axis] - centerMin[axis];
+		scale[axis] = extent > 0.f ? sahBins / extent : 0.f;
+	}
+	auto blocksOf = [&context](int count)
+	{
+		return static_cast<float>((count + context.maxLeafSpheres - 1) / context.maxLeafSpheres);
+	};
+	auto binOf = [&](int sphereIdx, int axis)
+	{
+		int bin = static_cast<int>((spheres.centerCoords[axis][sphereIdx] - centerMin[axis]) * scale[axis]);
+		return min(bin, sahBins - 1);
+	};
+
+	BoundingBox binBoxes[3][sahBins];
+	int binCounts[3][sahBins] = {};
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		std::fill(binBoxes[axis], binBoxes[axis] + sahBins, emptyBox());
+	}
+	for(int i = 0; i < range.count; ++i)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			if(scale[axis] > 0.f)
+			{
+				int bin = binOf(ids[i], axis);
+				++binCounts[axis][bin];
+				growBox(binBoxes[axis][bin], spheres, ids[i]);
+			}
+		}
+	}
+
+	float bestCost = numeric_limits<float>::max();
+	int bestAxis = -1, bestBin = 0;
+	BoundingBox bestLeft, bestRight;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if(scale[axis] == 0.f)
+		{
+			continue;
+		}
+
+		BoundingBox rightBoxes[sahBins];
+		int rightCounts[sahBins];
+		BoundingBox box = emptyBox();
+		int count = 0;
+		for(int bin = sahBins - 1; bin > 0; --bin)
+		{
+			growBox(box, binBoxes[axis][bin]);
+			count += binCounts[axis][bin];
+			rightBoxes[bin] = box;
+			rightCounts[bin] = count;
+		}
+
+		box = emptyBox();
+		count = 0;
+		for(int bin = 0; bin < sahBins - 1; ++bin)
+		{
+			growBox(box, binBoxes[axis][bin]);
+			count += binCounts[axis][bin];
+			if(count == 0 || rightCounts[bin + 1] == 0)
+			{
+				continue;
+			}
+
+			float cost = halfArea(box) * blocksOf(count) + halfArea(rightBoxes[bin + 1]) * blocksOf(rightCounts[bin + 1]);
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = bin;
+				bestLeft = box;
+				bestRight = rightBoxes[bin + 1];
+			}
+		}
+	}
+
+	int leftCount;
+	if(bestAxis < 0)
+	{
+		// all centers coincide, halving keeps the depth logarithmic
+		if(range.count <= context.maxLeafSpheres)
+		{
+			return false;
+		}
+		leftCount = range.count / 2;
+		bestLeft = rangeBox(spheres, ids, leftCount);
+		bestRight = rangeBox(spheres, ids + leftCount, range.count - leftCount);
+	}
+	else
+	{
+		float parentArea = halfArea(range.box);
+		float leafCost = blockCost * blocksOf(range.count);
+		float splitCost = traversalCost + blockCost * (parentArea > 0.f ? bestCost / parentArea : blocksOf(range.count));
+		if(range.count <= context.maxLeafSpheres && splitCost >= leafCost)
+		{
+			return false;
+		}
+		leftCount = std::partition(ids, ids + range.count, [&](int sphereIdx)
+		{
+			return binOf(sphereIdx, bestAxis) <= bestBin;
+		}) - ids;
+	}
+
+	left.first = range.first;
+	left.count = leftCount;
+	left.box = bestLeft;
+	right.first = range.first + leftCount;
+	right.count = range.count - leftCount;
+	right.box = bestRight;
+	left.final = left.count <= minLeafSpheres;
+	right.final = right.count <= minLeafSpheres;
+	return true;
+}
+
+int BVH4::buildChild(BuildContext& context, const BuildRange& range, int nodeDepth, Subtree& subtree) const
+{
+	// split the largest range that is not a leaf until there are four
+	BuildRange children[4];
+	children[0] = range;
+	int childrenCount = 1;
+	while(childrenCount < 4 && nodeDepth < maxTreeDepth)
+	{
+		int largest = -1;
+		for(int child = 0; child < childrenCount; ++child)
+		{
+			if(!children[child].final && (largest < 0 || children[child].count > children[largest].count))
+			{
+				largest = child;
+			}
+		}
+		if(largest < 0)
+		{
+			break;
+		}
+
+		BuildRange left, right;
+		if(!splitRange(context, children[largest], left, right))
+		{
+			children[largest].final = true;
+			continue;
+		}
+		children[largest] = left;
+		children[childrenCount++] = right;
+	}
+
+	if(childrenCount == 1)
+	{
+		BVH4Leaf leaf = { static_cast<unsigned>(range.first), static_cast<unsigned>(range.count), 0 };
+		subtree.leaves.push_back(leaf);
+		return ~static_cast<int>(subtree.leaves.size() - 1);
+	}
+
+	int nodeIdx = subtree.nodes.size();
+	subtree.nodes.push_back(emptyNode(emptySlot));
+	subtree.depth = max(subtree.depth, nodeDepth + 1);
+
+	struct PendingChild
+	{
+		int slot;
+		BuildRange range;
+		Subtree subtree;
+		int ref;
+	};
+	vector<unique_ptr<PendingChild>> pending;
+	TaskGroup group(context.pool);
+
+	for(int child = 0; child < childrenCount; ++child)
+	{
+		const BuildRange& childRange = children[child];
+		int ref = 0;
+		if(childRange.final)
+		{
+			BVH4Leaf leaf = { static_cast<unsigned>(childRange.first), static_cast<unsigned>(childRange.count), 0 };
+			subtree.leaves.push_back(leaf);
+			ref = ~static_cast<int>(subtree.leaves.size() - 1);
+		}
+		else if(childRange.count >= parallelBuildThreshold && context.pool.size() > 1)
+		{
+			PendingChild* task = new PendingChild();
+			task->slot = child;
+			task->range = childRange;
+			pending.push_back(unique_ptr<PendingChild>(task));
+			group.run([this, &context, task, nodeDepth]()
+			{
+				task->ref = buildChild(context, task->range, nodeDepth + 1, task->subtree);
+			});
+		}
+		else
+		{
+			ref = buildChild(context, childRange, nodeDepth + 1, subtree);
+		}
+
+		// the recursion may have moved the nodes
+		BVH4Node& node = subtree.nodes[nodeIdx];
+		node.children[child] = ref;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			node.bounds[0][axis][child] = childRange.box.vmin[axis];
+			node.bounds[1][axis][child] = childRange.box.vmax[axis];
+		}
+	}
+
+	group.wait();
+	for(auto& task : pending)
+	{
+		int nodeOffset = subtree.nodes.size();
+		int leafOffset = subtree.leaves.size();
+		auto relocate = [nodeOffset, leafOffset](int ref)
+		{
+			return ref >= 0 ? ref + nodeOffset : ~(~ref + leafOffset);
+		};
+
+		for(BVH4Node& node : task->subtree.nodes)
+		{
+			for(int& ref : node.children)
+			{
+				if(ref != emptySlot)
+				{
+					ref = relocate(ref);
+				}
+			}
+		}
+		subtree.nodes.insert(subtree.nodes.end(), task->subtree.nodes.begin(), task->subtree.nodes.end());
+		subtree.leaves.insert(subtree.leaves.end(), task->subtree.leaves.begin(), task->subtree.leaves.end());
+		subtree.nodes[nodeIdx].children[task->slot] = relocate(task->ref);
+		subtree.depth = max(subtree.depth, task->subtree.depth);
+	}
+	return nodeIdx;
+}
+
+void BVH4::packLeaves(const BuildContext& context, Subtree& tree)
+{
+	const int blockSize = 4 * leafBlockWidth;
+
+	// the leaves go after the blocks already in use
+	int leavesCount = tree.leaves.size();
+	vector<unsigned> firstBlock(leavesCount + 1, leafData.size() / blockSize);
+	for(int i = 0; i < leavesCount; ++i)
+	{
+		firstBlock[i + 1] = firstBlock[i] + (tree.leaves[i].spheresCount + leafBlockWidth - 1) / leafBlockWidth;
+	}
+
+	leafData.resize(static_cast<size_t>(firstBlock.back()) * blockSize, numeric_limits<float>::quiet_NaN());
+	leafSphereIds.resize(static_cast<size_t>(firstBlock.back()) * leafBlockWidth, -1);
+
+	context.pool.parallelFor(leavesCount, 1024, [&](int from, int to)
+	{
+		for(int leaf = from; leaf < to; ++leaf)
+		{
+			const int* sphereIndices = context.ids.data() + tree.leaves[leaf].firstBlock;
+			float* blocks = leafData.data() + static_cast<size_t>(firstBlock[leaf]) * blockSize;
+			int* ids = leafSphereIds.data() + static_cast<size_t>(firstBlock[leaf]) * leafBlockWidth;
+
+			for(unsigned i = 0; i < tree.leaves[leaf].spheresCount; ++i)
+			{
+				int idx = sphereIndices[i];
+				float* block = blocks + (i / leafBlockWidth) * blockSize;
+				int lane = i % leafBlockWidth;
+
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					block[axis * leafBlockWidth + lane] = spheres.centerCoords[axis][idx];
+				}
+				block[3 * leafBlockWidth + lane] = spheres.radiuses[idx];
+				ids[i] = idx;
+			}
+			tree.leaves[leaf].firstBlock = firstBlock[leaf];
+			tree.leaves[leaf].blocksCount = firstBlock[leaf + 1] - firstBlock[leaf];
+		}
+	});
+}
+
+void BVH4::appendSubtree(BuildContext& context, const BoundingBox& box, int parentRef, int nodeDepth)
+{
+	BuildRange range;
+	range.first = 0;
+	range.count = context.ids.size();
+	range.box = box;
+	range.final = range.count <= minLeafSpheres;
+
+	Subtree tree;
+	int ref = buildChild(context, range, nodeDepth, tree);
+	buildMemoryPeak = max(buildMemoryPeak, context.ids.capacity() * sizeof(int) +
+			tree.nodes.capacity() * sizeof(BVH4Node) + tree.leaves.capacity() * sizeof(BVH4Leaf));
+	depth = max(depth, tree.depth);
+	packLeaves(context, tree);
+
+	int nodeOffset = nodes.size();
+	int leafOffset = leaves.size();
+	auto relocate = [nodeOffset, leafOffset](int ref)
+	{
+		return ref >= 0 ? ref + nodeOffset : ~(~ref + leafOffset);
+	};
+	for(BVH4Node& node : tree.nodes)
+	{
+		for(int& child : node.children)
+		{
+			if(child != emptySlot)
+			{
+				child = relocate(child);
+			}
+		}
+	}
+	nodes.insert(nodes.end(), tree.nodes.begin(), tree.nodes.end());
+	leaves.insert(leaves.end(), tree.leaves.begin(), tree.leaves.end());
+
+	nodeParents.resize(nodes.size());
+	nodeDepths.resize(nodes.size());
+	nodeBuildAreas.resize(nodes.size());
+	leafParents.resize(leaves.size());
+	linkSubtree(relocate(ref), parentRef, nodeDepth);
+}
+
+void BVH4::linkSubtree(int ref, int parentRef, int nodeDepth)
+{
+	if(parentRef < 0)
+	{
+		root = ref;
+	}
+	else
+	{
+		nodes[parentRef / 4].children[parentRef % 4] = ref;
+	}
+
+	struct Link
+	{
+		int ref;
+		int parentRef;
+		int nodeDepth;
+	};
+	vector<Link> stack(1, Link{ ref, parentRef, nodeDepth });
+	while(!stack.empty())
+	{
+		Link link = stack.back();
+		stack.pop_back();
+		if(link.ref < 0)
+		{
+			int leafIdx = ~link.ref;
+			leafParents[leafIdx] = link.parentRef;
+			const int* ids = leafSphereIds.data() + static_cast<size_t>(leaves[leafIdx].firstBlock) * leafBlockWidth;
+			for(unsigned i = 0; i < leaves[leafIdx].spheresCount; ++i)
+			{
+				sphereLeaves[ids[i]] = leafIdx;
+			}
+			continue;
+		}
+
+		nodeParents[link.ref] = link.parentRef;
+		nodeDepths[link.ref] = link.nodeDepth;
+		nodeBuildAreas[link.ref] = halfArea(nodeBox(link.ref));
+		for(int child = 0; child < 4; ++child)
+		{
+			if(nodes[link.ref].children[child] != emptySlot)
+			{
+				stack.push_back(Link{ nodes[link.ref].children[child], link.ref * 4 + child, link.nodeDepth + 1 });
+			}
+		}
+	}
+}
+
+void BVH4::buildSpheres(vector<int>&& ids, ThreadPool& pool)
+{
+	nodes.clear();
+	leaves.clear();
+	leafData.clear();
+	leafSphereIds.clear();
+	nodeParents.clear();
+	nodeDepths.clear();
+	nodeBuildAreas.clear();
+	leafParents.clear();
+	sphereLeaves.assign(spheres.count, -1);
+	garbageNodes = 0;
+	garbageBlocks = 0;
+	root = 0;
+	depth = 0;
+	buildMemoryPeak = 0;
+	leafBlockWidth = Intersection::leafKernelWidth();
+
+	BuildContext context(spheres, pool);
+	context.maxLeafSpheres = leafBlockWidth;
+	context.ids = std::move(ids);
+
+	std::mutex boxMutex;
+	sceneBBox = emptyBox();
+	pool.parallelFor(context.ids.size(), 1 << 16, [&](int from, int to)
+	{
+		BoundingBox box = rangeBox(spheres, context.ids.data() + from, to - from);
+		std::lock_guard<std::mutex> lock(boxMutex);
+		growBox(sceneBBox, box);
+	});
+
+	if(!context.ids.empty())
+	{
+		appendSubtree(context, sceneBBox, -1, 0);
+	}
+}
+
+void BVH4::build(Spheres&& spheres, ThreadPool& pool)
+{
+	unique_ptr<Spheres> owned(new Spheres(std::move(spheres)));
+	build(SpheresView(*owned), pool);
+	ownedSpheres = std::move(owned);
+}
+
+void BVH4::build(const SpheresView& spheres, ThreadPool& pool)
+{
+	ownedSpheres.reset();
+	this->spheres = spheres;
+
+	vector<int> ids(spheres.count);
+	std::iota(ids.begin(), ids.end(), 0);
+	buildSpheres(std::move(ids), pool);
+}
+
+BoundingBox BVH4::nodeBox(int nodeIdx) const
+{
+	// unused slots hold inverted boxes that leave the union unchanged
+	const BVH4Node& node = nodes[nodeIdx];
+	BoundingBox box = emptyBox();
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		for(int child = 0; child < 4; ++child)
+		{
+			box.vmin[axis] = min(box.vmin[axis], node.bounds[0][axis][child]);
+			box.vmax[axis] = max(box.vmax[axis], node.bounds[1][axis][child]);
+		}
+	}
+	return box;
+}
+
+BoundingBox BVH4::leafBox(int leafIdx) const
+{
+	BoundingBox box = emptyBox();
+	const float* blocks = leafBlocks(leafIdx);
+	for(unsigned i = 0; i < leaves[leafIdx].spheresCount; ++i)
+	{
+		const float* block = blocks + (i / leafBlockWidth) * 4 * leafBlockWidth;
+		int lane = i % leafBlockWidth;
+		float radius = block[3 * leafBlockWidth + lane];
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			float center = block[axis * leafBlockWidth + lane];
+			box.vmin[axis] = min(box.vmin[axis], center - radius);
+			box.vmax[axis] = max(box.vmax[axis], center + radius);
+		}
+	}
+	return box;
+}
+
+void BVH4::setChildBox(int parentRef, const BoundingBox& box)
+{
+	BVH4Node& node = nodes[parentRef / 4];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		node.bounds[0][axis][parentRef % 4] = box.vmin[axis];
+		node.bounds[1][axis][parentRef % 4] = box.vmax[axis];
+	}
+}
+
+void BVH4::writeLane(int leafIdx, int lane, int sphereIdx)
+{
+	size_t firstBlock = leaves[leafIdx].firstBlock;
+	float* block = leafData.data() + (firstBlock + lane / leafBlockWidth) * 4 * leafBlockWidth;
+	int slot = lane % leafBlockWidth;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		block[axis * leafBlockWidth + slot] = spheres.centerCoords[axis][sphereIdx];
+	}
+	block[3 * leafBlockWidth + slot] = spheres.radiuses[sphereIdx];
+	leafSphereIds[firstBlock * leafBlockWidth + lane] = sphereIdx;
+}
+
+void BVH4::removeFromLeaf(int leafIdx, int sphereIdx)
+{
+	BVH4Leaf& leaf = leaves[leafIdx];
+	int* ids = leafSphereIds.data() + static_cast<size_t>(leaf.firstBlock) * leafBlockWidth;
+	float* blocks = leafData.data() + static_cast<size_t>(leaf.firstBlock) * 4 * leafBlockWidth;
+	auto laneValue = [this, blocks](int lane, int component) -> float&
+	{
+		return blocks[(lane / leafBlockWidth) * 4 * leafBlockWidth + component * leafBlockWidth + lane % leafBlockWidth];
+	};
+
+	// the last sphere of the leaf fills the hole so the spheres stay in the first lanes
+	int last = leaf.spheresCount - 1;
+	int lane = std::find(ids, ids + last, sphereIdx) - ids;
+	for(int component = 0; component < 4; ++component)
+	{
+		laneValue(lane, component) = laneValue(last, component);
+		laneValue(last, component) = numeric_limits<float>::quiet_NaN();
+	}
+	ids[lane] = ids[last];
+	ids[last] = -1;
+	--leaf.spheresCount;
+	sphereLeaves[sphereIdx] = -1;
+}
+
+void BVH4::appendToLeaf(int leafIdx, int sphereIdx)
+{
+	BVH4Leaf& leaf = leaves[leafIdx];
+	if(leaf.spheresCount == leaf.blocksCount * leafBlockWidth)
+	{
+		// a full leaf moves to the end with one more block, its old blocks become garbage
+		size_t blockSize = 4 * leafBlockWidth;
+		size_t firstBlock = leafData.size() / blockSize;
+		leafData.resize(leafData.size() + (leaf.blocksCount + 1) * blockSize, numeric_limits<float>::quiet_NaN());
+		leafSphereIds.resize(leafSphereIds.size() + (leaf.blocksCount + 1) * leafBlockWidth, -1);
+		std::copy_n(leafData.data() + leaf.firstBlock * blockSize, leaf.blocksCount * blockSize,
+				leafData.data() + firstBlock * blockSize);
+		std::copy_n(leafSphereIds.data() + static_cast<size_t>(leaf.firstBlock) * leafBlockWidth,
+				leaf.blocksCount * leafBlockWidth, leafSphereIds.data() + firstBlock * leafBlockWidth);
+
+		garbageBlocks += leaf.blocksCount;
+		leaf.firstBlock = firstBlock;
+		++leaf.blocksCount;
+	}
+
+	writeLane(leafIdx, leaf.spheresCount, sphereIdx);
+	++leaf.spheresCount;
+	sphereLeaves[sphereIdx] = leafIdx;
+}
+
+int BVH4::chooseLeaf(int sphereIdx) const
+{
+	BoundingBox sphereBox = emptyBox();
+	growBox(sphereBox, spheres, sphereIdx);
+
+	// descend into the child whose box grows least, the smaller box breaks ties
+	int ref = root;
+	while(ref >= 0)
+	{
+		const BVH4Node& node = nodes[ref];
+		int best = -1;
+		float bestGrowth = 0.f, bestArea = 0.f;
+		for(int child = 0; child < 4; ++child)
+		{
+			if(node.children[child] == emptySlot)
+			{
+				continue;
+			}
+
+			BoundingBox box;
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				box.vmin[axis] = node.bounds[0][axis][child];
+				box.vmax[axis] = node.bounds[1][axis][child];
+			}
+			float area = halfArea(box);
+			growBox(box, sphereBox);
+			float growth = halfArea(box) - area;
+			if(best < 0 || growth < bestGrowth || (growth == bestGrowth && area < bestArea))
+			{
+				best = child;
+				bestGrowth = growth;
+				bestArea = area;
+			}
+		}
+		ref = node.children[best];
+	}
+	return ~ref;
+}
+
+void BVH4::collectSpheres(int ref, vector<int>& ids)
+{
+	// the nodes and leaves of the subtree are left behind as garbage
+	vector<int> stack(1, ref);
+	while(!stack.empty())
+	{
+		ref = stack.back();
+		stack.pop_back();
+		if(ref < 0)
+		{
+			BVH4Leaf& leaf = leaves[~ref];
+			const int* leafIds = leafSphereIds.data() + static_cast<size_t>(leaf.firstBlock) * leafBlockWidth;
+			ids.insert(ids.end(), leafIds, leafIds + leaf.spheresCount);
+			garbageBlocks += leaf.blocksCount;
+			leaf.spheresCount = 0;
+			leaf.blocksCount = 0;
+			continue;
+		}
+
+		++garbageNodes;
+		for(int child : nodes[ref].children)
+		{
+			if(child != emptySlot)
+			{
+				stack.push_back(child);
+			}
+		}
+	}
+}
+
+void BVH4::rebuildSubtree(int nodeIdx, ThreadPool& pool)
+{
+	BuildContext context(spheres, pool);
+	context.maxLeafSpheres = leafBlockWidth;
+	collectSpheres(nodeIdx, context.ids);
+
+	// the refitted box is exact, the boxes above stay as they are
+	appendSubtree(context, nodeBox(nodeIdx), nodeParents[nodeIdx], nodeDepths[nodeIdx]);
+}
+
+void BVH4::update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool)
+{
+	if(ownedSpheres && spheres.radiuses != ownedSpheres->radiuses.data())
+	{
+		ownedSpheres.reset();
+	}
+	this->spheres = spheres;
+	sphereLeaves.resize(max(static_cast<int>(sphereLeaves.size()), spheres.count), -1);
+	auto contains = [this](int sphereIdx)
+	{
+		return sphereIdx >= 0 && sphereIdx < static_cast<int>(sphereLeaves.size()) && sphereLeaves[sphereIdx] >= 0;
+	};
+
+	if(leaves.empty())
+	{
+		vector<int> ids;
+		for(int sphereIdx : changes.inserted)
+		{
+			if(sphereIdx >= 0 && sphereIdx < spheres.count)
+			{
+				ids.push_back(sphereIdx);
+			}
+		}
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		for(int sphereIdx : changes.removed)
+		{
+			auto found = std::lower_bound(ids.begin(), ids.end(), sphereIdx);
+			if(found != ids.end() && *found == sphereIdx)
+			{
+				ids.erase(found);
+			}
+		}
+		buildSpheres(std::move(ids), pool);
+		return;
+	}
+
+	vector<int> changedLeaves;
+	for(int sphereIdx : changes.inserted)
+	{
+		if(sphereIdx >= 0 && sphereIdx < spheres.count && !contains(sphereIdx))
+		{
+			int leafIdx = chooseLeaf(sphereIdx);
+			appendToLeaf(leafIdx, sphereIdx);
+			changedLeaves.push_back(leafIdx);
+		}
+	}
+	for(int sphereIdx : changes.moved)
+	{
+		if(contains(sphereIdx))
+		{
+			int leafIdx = sphereLeaves[sphereIdx];
+			const int* ids = leafSphereIds.data() + static_cast<size_t>(leaves[leafIdx].firstBlock) * leafBlockWidth;
+			writeLane(leafIdx, std::find(ids, ids + leaves[leafIdx].spheresCount, sphereIdx) - ids, sphereIdx);
+			changedLeaves.push_back(leafIdx);
+		}
+	}
+	for(int sphereIdx : changes.removed)
+	{
+		if(contains(sphereIdx))
+		{
+			changedLeaves.push_back(sphereLeaves[sphereIdx]);
+			removeFromLeaf(sphereLeaves[sphereIdx], sphereIdx);
+		}
+	}
+	std::sort(changedLeaves.begin(), changedLeaves.end());
+	changedLeaves.erase(std::unique(changedLeaves.begin(), changedLeaves.end()), changedLeaves.end());
+
+	// refit the nodes above the changed leaves level by level, deepest first, so every
+	// node is refitted once after all its children
+	bool rebuildAll = false;
+	vector<int> rebuilds;
+	vector<vector<int>> levels(depth + 1);
+	for(int leafIdx : changedLeaves)
+	{
+		int parentRef = leafParents[leafIdx];
+		bool overfull = leaves[leafIdx].spheresCount > 2u * leafBlockWidth;
+		if(parentRef < 0)
+		{
+			rebuildAll = rebuildAll || overfull;
+			continue;
+		}
+		setChildBox(parentRef, leafBox(leafIdx));
+		levels[nodeDepths[parentRef / 4]].push_back(parentRef / 4);
+		if(overfull)
+		{
+			rebuilds.push_back(parentRef / 4);
+		}
+	}
+	for(int level = depth; level >= 0; --level)
+	{
+		vector<int>& levelNodes = levels[level];
+		std::sort(levelNodes.begin(), levelNodes.end());
+		levelNodes.erase(std::unique(levelNodes.begin(), levelNodes.end()), levelNodes.end());
+		for(int nodeIdx : levelNodes)
+		{
+			BoundingBox box = nodeBox(nodeIdx);
+			if(halfArea(box) > rebuildAreaRatio * nodeBuildAreas[nodeIdx])
+			{
+				rebuilds.push_back(nodeIdx);
+			}
+			int parentRef = nodeParents[nodeIdx];
+			if(parentRef >= 0)
+			{
+				setChildBox(parentRef, box);
+				levels[level - 1].push_back(parentRef / 4);
+			}
+		}
+	}
+
+	// only the topmost subtrees are rebuilt, they cover the candidates below them
+	std::sort(rebuilds.begin(), rebuilds.end());
+	rebuilds.erase(std::unique(rebuilds.begin(), rebuilds.end()), rebuilds.end());
+	vector<int> topmost;
+	for(int nodeIdx : rebuilds)
+	{
+		bool covered = false;
+		for(int parentRef = nodeParents[nodeIdx]; parentRef >= 0 && !covered; parentRef = nodeParents[parentRef / 4])
+		{
+			covered = std::binary_search(rebuilds.begin(), rebuilds.end(), parentRef / 4);
+		}
+		if(!covered)
+		{
+			rebuildAll = rebuildAll || nodeParents[nodeIdx] < 0;
+			topmost.push_back(nodeIdx);
+		}
+	}
+	if(!rebuildAll)
+	{
+		for(int nodeIdx : topmost)
+		{
+			rebuildSubtree(nodeIdx, pool);
+		}
+		// every local rebuild leaves garbage behind, compact once it outweighs the hierarchy
+		size_t blocksCount = leafData.size() / (4 * leafBlockWidth);
+		rebuildAll = 2 * garbageNodes > nodes.size() || 2 * garbageBlocks > blocksCount;
+	}
+
+	if(rebuildAll)
+	{
+		vector<int> ids;
+		for(int sphereIdx = 0; sphereIdx < spheres.count; ++sphereIdx)
+		{
+			if(sphereLeaves[sphereIdx] >= 0)
+			{
+				ids.push_back(sphereIdx);
+			}
+		}
+		buildSpheres(std::move(ids), pool);
+		return;
+	}
+	sceneBBox = root >= 0 ? nodeBox(root) : leafBox(~root);
+}
+
+size_t BVH4::getMemoryUsage() const
+{
+	size_t bytes = nodes.size() * sizeof(BVH4Node) + leaves.size() * sizeof(BVH4Leaf) +
+			leafData.size() * sizeof(float) + leafSphereIds.size() * sizeof(int);
+	if(ownedSpheres)
+	{
+		bytes += 4 * ownedSpheres->radiuses.capacity() * sizeof(float);
+	}
+	return bytes;
+}
+
+template<QueryType query>
+int BVH4::traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const
+{
+	typedef SimdVector<4>::FloatN Float4;
+	typedef SimdVector<4>::MaskN Mask4;
+
+	closest.intersection = false;
+	closest.sphereIndex = -1;
+	if(leaves.empty())
+	{
+		return 0;
+	}
+
+	// tmax of the copy shrinks to the closest hit found so far
+	Ray ray = rayData.ray;
+	Float4 origin[3], invDirection[3];
+	int nearPlanes[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float o = ray.origin[axis], inv = rayData.invDirection[axis];
+		origin[axis] = Float4{ o, o, o, o };
+		invDirection[axis] = Float4{ inv, inv, inv, inv };
+		// rays going in the negative direction along the axis enter the boxes at the max plane
+		nearPlanes[axis] = (rayData.octant >> axis) & 1;
+	}
+
+	struct StackEntry
+	{
+		int ref;
+		float tnear;
+	};
+	// a node leaves at most three of its children on the stack
+	assert(depth <= maxTreeDepth);
+	StackEntry st[3 * maxTreeDepth + 4];
+	int stackSize = 0;
+	st[stackSize++] = StackEntry{ root, ray.tmin };
+
+	int hits = 0;
+	int hitLeaf = -1, hitSlot = -1;
+	while(stackSize > 0)
+	{
+		StackEntry entry = st[--stackSize];
+		if(entry.tnear > ray.tmax)
+		{
+			continue;
+		}
+
+		if(entry.ref >= 0)
+		{
+			STATS_ADD(INNER_NODES, 1);
+			const BVH4Node& node = nodes[entry.ref];
+			Float4 tnear = Float4{ ray.tmin, ray.tmin, ray.tmin, ray.tmin };
+			Float4 tfar = Float4{ ray.tmax, ray.tmax, ray.tmax, ray.tmax };
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				Float4 nearPlane, farPlane;
+				memcpy(&nearPlane, node.bounds[nearPlanes[axis]][axis], sizeof(Float4));
+				memcpy(&farPlane, node.bounds[1 - nearPlanes[axis]][axis], sizeof(Float4));
+				// the plane distance comes first so a NaN from 0 * inf leaves the interval unchanged
+				tnear = maxLanes((nearPlane - origin[axis]) * invDirection[axis], tnear);
+				tfar = minLanes((farPlane - origin[axis]) * invDirection[axis], tfar);
+			}
+			Mask4 entered = tnear <= tfar;
+
+			// the nearest child ends on top of the stack
+			int first = stackSize;
+			for(int child = 0; child < 4; ++child)
+			{
+				if(!entered[child])
+				{
+					continue;
+				}
+				int slot = stackSize++;
+				while(slot > first && st[slot - 1].tnear < tnear[child])
+				{
+					st[slot] = st[slot - 1];
+					--slot;
+				}
+				st[slot] = StackEntry{ node.children[child], tnear[child] };
+			}
+			STATS_MAX(STACK_DEPTH, stackSize);
+			continue;
+		}
+
+		int leafIdx = ~entry.ref;
+		int spheresCount = leaves[leafIdx].spheresCount;
+		const float* blocks = leafBlocks(leafIdx);
+		STATS_ADD(LEAVES, 1);
+		STATS_ADD(SPHERES_TESTED, spheresCount);
+		STATS_ADD(WASTED_LANES, (leafBlockWidth - spheresCount % leafBlockWidth) % leafBlockWidth);
+
+		if(query == QUERY_ANY)
+		{
+			if(Intersection::occludedRaySpheres(ray, blocks, spheresCount))
+			{
+				return 1;
+			}
+		}
+		else if(query == QUERY_COUNT)
+		{
+			// every sphere is in one leaf only
+			hits += Intersection::countRaySpheres(ray, blocks, spheresCount, ray.tmin);
+		}
+		else
+		{
+			IntersectionData leafHit = Intersection::intersectRaySpheres(ray, blocks, spheresCount);
+			if(leafHit.intersection)
+			{
+				closest = leafHit;
+				hits = 1;
+				hitLeaf = leafIdx;
+				hitSlot = leafHit.sphereIndex;
+				ray.tmax = leafHit.tIntersection;
+			}
+		}
+	}
+
+	if(query == QUERY_CLOSEST && hits)
+	{
+		if(record)
+		{
+			record->tIntersection = closest.tIntersection;
+			record->sphereIndex = hitSlot;
+			Intersection::hitGeometry(ray, leafBlocks(hitLeaf), *record);
+		}
+		closest.sphereIndex = leafSphereIds[static_cast<size_t>(leaves[hitLeaf].firstBlock) * leafBlockWidth + hitSlot];
+	}
+	return hits;
+}
+
+IntersectionData BVH4::intersectRay(const Ray& ray) const
+{
+	IntersectionData data;
+	traverse<QUERY_CLOSEST>(RayData(ray), data, nullptr);
+	return data;
+}
+
+void BVH4::intersectRay(const Ray& ray, HitRecord& hit) const
+{
+	traverse<QUERY_CLOSEST>(RayData(ray), hit, &hit);
+}
+
+bool BVH4::isOccluded(const Ray& ray, float maxDistance) const
+{
+	RayData rayData(ray);
+	rayData.ray.tmax = min(ray.tmax, maxDistance);
+
+	IntersectionData unused;
+	return traverse<QUERY_ANY>(rayData, unused, nullptr);
+}
+
+int BVH4::countHits(const Ray& ray) const
+{
+	IntersectionData unused;
+	return traverse<QUERY_COUNT>(RayData(ray), unused, nullptr);
+}
+
+void BVH4::intersectRays(const Ray* rays, int count, IntersectionData* results) const
+{
+	for(int i = 0; i < count; ++i)
+	{
+		STATS_BEGIN_RAY();
+		traverse<QUERY_CLOSEST>(RayData(rays[i]), results[i], nullptr);
+		STATS_END_RAY();
+	}
+}
+
+void BVH4::occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const
+{
+	for(int i = 0; i < count; ++i)
+	{
+		STATS_BEGIN_RAY();
+		bool hit = isOccluded(rays[i], maxDistance);
+		STATS_END_RAY();
+		occluded[i / 64] |= static_cast<uint64_t>(hit) << (i % 64);
+	}
+}
@@ -0,0 +1,182 @@
+#ifndef BVH4_H_
+#define BVH4_H_
+
+#include "Common.h"
+#include "Accelerator.h"
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include <memory>
+#include <cstdint>
+
+using std::vector;
+using std::unique_ptr;
+
+/**
+ * Four children per node. The child boxes are stored per plane in SIMD lanes,
+ * so a ray is tested against all four with one vector operation per plane.
+ * */
+struct BVH4Node
+{
+	/**
+	 * bounds[0] are the min and bounds[1] the max planes, bounds[m][axis][child].
+	 * Unused child slots have inverted boxes that no ray enters.
+	 * */
+	float bounds[2][3][4];
+	/**
+	 * Index of an inner node, or ~leaf index for a leaf
+	 * */
+	int children[4];
+};
+
+struct BVH4Leaf
+{
+	unsigned firstBlock;
+	unsigned spheresCount;
+	/**
+	 * Blocks reserved for the leaf, updates fill them before the leaf moves
+	 * */
+	unsigned blocksCount;
+};
+
+/**
+ * Bounding volume hierarchy over spheres with four children per node. Unlike the
+ * kd-tree every sphere lies in exactly one leaf, which suits scenes where some
+ * spheres are much larger than the others. Leaves use the same SIMD sphere blocks
+ * as the kd-tree leaves.
+ *
+ * Updates refit the boxes above the changed leaves only, so their cost follows
+ * the number of changes. Inserted spheres go to the leaf whose box grows least.
+ * A subtree whose box grew by more than rebuildAreaRatio since it was built, or
+ * holding an overfull leaf, is rebuilt with the SAH in place.
+ * */
+class BVH4 : public Accelerator
+{
+public:
+	BVH4() : root(0), leafBlockWidth(0), depth(0), buildMemoryPeak(0), garbageNodes(0), garbageBlocks(0) {}
+
+	BVH4(const BVH4&) = delete;
+	BVH4& operator=(const BVH4&) = delete;
+	BVH4(BVH4&&) = default;
+	BVH4& operator=(BVH4&&) = default;
+
+	/**
+	 * Keeps a view of the spheres, they must outlive the hierarchy.
+	 * Pass the spheres by rvalue to let the hierarchy own them.
+	 * */
+	void build(const SpheresView& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+	void build(Spheres&& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+
+	IntersectionData intersectRay(const Ray& ray) const override;
+	void intersectRay(const Ray& ray, HitRecord& hit) const override;
+	bool isOccluded(const Ray& ray, float maxDistance) const override;
+	int countHits(const Ray& ray) const override;
+	void intersectRays(const Ray* rays, int count, IntersectionData* results) const override;
+	void occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const override;
+	void update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool) override;
+
+	int getSize() const override { return nodes.size(); }
+	int getLeaves() const override { return leaves.size(); }
+	int getDepth() const override { return depth; }
+	const BoundingBox& getBoundingBox() const override { return sceneBBox; }
+	size_t getMemoryUsage() const override;
+	size_t getBuildMemoryPeak() const override { return buildMemoryPeak; }
+	const char* getName() const override { return "bvh4"; }
+
+private:
+	struct BuildContext;
+	struct BuildRange;
+	struct Subtree;
+
+	static const int sahBins = 16;
+	/**
+	 * Ranges with at most minLeafSpheres spheres always become leaves, ranges with at
+	 * most the leaf kernel width become leaves when the SAH finds no cheaper split
+	 * */
+	static const int minLeafSpheres = 2;
+	static const int parallelBuildThreshold = 4096;
+	/**
+	 * Inner nodes on any path, ranges reaching it become leaves. Sizes the traversal stacks.
+	 * */
+	static const int maxTreeDepth = 64;
+	/**
+	 * Children slots of nodes with less than four children
+	 * */
+	static const int emptySlot = std::numeric_limits<int>::min();
+	static constexpr float rebuildAreaRatio = 2.f;
+
+	bool splitRange(BuildContext& context, const BuildRange& range, BuildRange& left,
+			BuildRange& right) const;
+	int buildChild(BuildContext& context, const BuildRange& range, int nodeDepth, Subtree& subtree) const;
+	void packLeaves(const BuildContext& context, Subtree& tree);
+
+	/**
+	 * Replaces the whole hierarchy by one over the given spheres
+	 * */
+	void buildSpheres(vector<int>&& ids, ThreadPool& pool);
+	/**
+	 * Builds a subtree over the sphere indices of the context, appends it to the arrays
+	 * and links it in place of parentRef, which is parent node * 4 + slot or -1 for the root
+	 * */
+	void appendSubtree(BuildContext& context, const BoundingBox& box, int parentRef, int nodeDepth);
+	void linkSubtree(int ref, int parentRef, int nodeDepth);
+	void rebuildSubtree(int nodeIdx, ThreadPool& pool);
+	void collectSpheres(int ref, vector<int>& ids);
+
+	BoundingBox nodeBox(int nodeIdx) const;
+	BoundingBox leafBox(int leafIdx) const;
+	void setChildBox(int parentRef, const BoundingBox& box);
+	void writeLane(int leafIdx, int lane, int sphereIdx);
+	void removeFromLeaf(int leafIdx, int sphereIdx);
+	void appendToLeaf(int leafIdx, int sphereIdx);
+	int chooseLeaf(int sphereIdx) const;
+
+	/**
+	 * Returns whether a hit was found, or the number of hits for QUERY_COUNT.
+	 * The closest hit gets its global sphere index, record its point and normal when not null.
+	 * */
+	template<QueryType query>
+	int traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const;
+
+	inline const float* leafBlocks(int leafIdx) const
+	{
+		return leafData.data() + static_cast<size_t>(leaves[leafIdx].firstBlock) * 4 * leafBlockWidth;
+	}
+
+	vector<BVH4Node> nodes;
+	vector<BVH4Leaf> leaves;
+	/**
+	 * Spheres of the leaves in blocks of leafBlockWidth, laid out as in the kd-tree
+	 * */
+	AlignedVector<float> leafData;
+	vector<int> leafSphereIds;
+	/**
+	 * Reference of the root, an inner node index or ~leaf index
+	 * */
+	int root;
+	int leafBlockWidth;
+	unique_ptr<Spheres> ownedSpheres;
+	SpheresView spheres;
+	BoundingBox sceneBBox;
+	/**
+	 * Inner nodes on the longest path, never more than maxTreeDepth
+	 * */
+	int depth;
+	size_t buildMemoryPeak;
+
+	/**
+	 * Links for the updates. Parents are parent node * 4 + slot, -1 for the root.
+	 * sphereLeaves is the leaf of every sphere, -1 when it is not in the hierarchy.
+	 * */
+	vector<int> nodeParents;
+	vector<int> nodeDepths;
+	vector<float> nodeBuildAreas;
+	vector<int> leafParents;
+	vector<int> sphereLeaves;
+	/**
+	 * Nodes and leaf blocks left behind by subtree rebuilds and moved leaves
+	 * */
+	size_t garbageNodes;
+	size_t garbageBlocks;
+};
+
+#endif /* BVH4_H_ */
@@ -2,18 +2,27 @@
 #define COMMON_H_
 
 #include <vector>
+#include <limits>
 #include "Vec3.h"
 
+/**
+ * Hits are searched in (tmin, tmax), distances along the normalized direction
+ * */
 struct Ray
 {
-	Ray(){}
-	Ray(const Vec3& origin, const Vec3& direction)
+	Ray() : tmin(0.f), tmax(std::numeric_limits<float>::max()) {}
+	Ray(const Vec3& origin, const Vec3& direction,
+			float tmin = 0.f, float tmax = std::numeric_limits<float>::max())
 	{
 		this->origin = origin;
 		this->direction = direction;
+		this->tmin = tmin;
+		this->tmax = tmax;
 	}
 	Vec3 origin;
 	Vec3 direction;
+	float tmin;
+	float tmax;
 };
 
 struct Sphere
@@ -34,10 +43,53 @@ struct Spheres
 	int count;
 };
 
+/**
+ * Non-owning view of sphere arrays, the caller keeps them alive
+ * */
+struct SpheresView
+{
+	SpheresView() : radiuses(nullptr), count(0)
+	{
+		centerCoords[0] = centerCoords[1] = centerCoords[2] = nullptr;
+	}
+
+	SpheresView(const Spheres& spheres) : radiuses(spheres.radiuses.data()), count(spheres.count)
+	{
+		for(int i = 0; i < 3; ++i)
+		{
+			centerCoords[i] = spheres.centerCoords[i].data();
+		}
+	}
+
+	const float* centerCoords[3];
+	const float* radiuses;
+	int count;
+};
+
 struct IntersectionData
 {
 	bool intersection;
 	float tIntersection;
+	/**
+	 * Index of the hit sphere in Spheres, -1 without intersection
+	 * */
+	int sphereIndex;
+};
+
+struct HitRecord : IntersectionData
+{
+	Vec3 point;
+	Vec3 normal;
+};
+
+/**
+ * What a traversal looks for: the closest hit, any hit or the number of spheres hit
+ * */
+enum QueryType
+{
+	QUERY_CLOSEST = 0,
+	QUERY_ANY = 1,
+	QUERY_COUNT = 2,
 };
 
 #endif /* COMMON_H_ */
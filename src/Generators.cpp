@@ -0,0 +1,204 @@
+#include "Generators.h"
+#include "Utils.h"
+#include <random>
+#include <cmath>
+#include <limits>
+
+using std::mt19937;
+using std::uniform_real_distribution;
+using std::normal_distribution;
+using std::numeric_limits;
+
+namespace Generators
+{
+	namespace
+	{
+		const int chunkSize = 1 << 16;
+		const int clustersCount = 64;
+		const float mixedHugeFraction = 0.02f;
+
+		Vec3 randomDirection(mt19937& generator)
+		{
+			normal_distribution<float> normal(0.f, 1.f);
+			Vec3 direction;
+			do
+			{
+				direction = Vec3(normal(generator), normal(generator), normal(generator));
+			} while(direction.length() < 1e-6f);
+			return normalize(direction);
+		}
+	}
+
+	Spheres generateSpheres(SceneType type, int count, unsigned seed, ThreadPool& pool)
+	{
+		Spheres spheres;
+		spheres.count = count;
+		for(int j = 0; j < 3; ++j)
+		{
+			spheres.centerCoords[j].resize(count);
+		}
+		spheres.radiuses.resize(count);
+
+		// mean distance between neighbouring centers of a uniform scene
+		float spacing = sceneSize / std::cbrt(static_cast<float>(count));
+
+		Vec3 clusterCenters[clustersCount];
+		mt19937 clustersGenerator(seed);
+		uniform_real_distribution<float> inScene(0.f, sceneSize);
+		for(int i = 0; i < clustersCount; ++i)
+		{
+			clusterCenters[i] = Vec3(inScene(clustersGenerator), inScene(clustersGenerator), inScene(clustersGenerator));
+		}
+
+		// every chunk has its own generator so the scene does not depend on the threads count
+		pool.parallelFor(count, chunkSize, [&](int from, int to)
+		{
+			mt19937 generator(seed + 1 + from / chunkSize);
+			uniform_real_distribution<float> coord(0.f, sceneSize);
+			uniform_real_distribution<float> unit(0.f, 1.f);
+			normal_distribution<float> clusterOffset(0.f, sceneSize * 0.02f);
+
+			for(int i = from; i < to; ++i)
+			{
+				Vec3 center(coord(generator), coord(generator), coord(generator));
+				float radius = spacing * (0.05f + 0.15f * unit(generator));
+
+				if(type == SCENE_CLUSTERED)
+				{
+					const Vec3& cluster = clusterCenters[generator() % clustersCount];
+					center = cluster + Vec3(clusterOffset(generator), clusterOffset(generator), clusterOffset(generator));
+					radius *= 0.25f;
+				}
+				else if(type == SCENE_MIXED_RADIUSES)
+				{
+					bool huge = unit(generator) < mixedHugeFraction;
+					radius = huge ? sceneSize * (0.005f + 0.045f * unit(generator)) : radius * 0.2f;
+				}
+
+				for(int j = 0; j < 3; ++j)
+				{
+					spheres.centerCoords[j][i] = center[j];
+				}
+				spheres.radiuses[i] = radius;
+			}
+		});
+
+		return spheres;
+	}
+
+	std::vector<Instance> generateInstances(int count, int assembliesCount, unsigned seed)
+	{
+		std::vector<Instance> instances(count);
+		mt19937 generator(seed);
+		uniform_real_distribution<float> unit(0.f, 1.f);
+		normal_distribution<float> normal(0.f, 1.f);
+		float baseScale = 1.f / std::cbrt(static_cast<float>(count));
+		Vec3 assemblyCenter(sceneSize * 0.5f, sceneSize * 0.5f, sceneSize * 0.5f);
+
+		for(int i = 0; i < count; ++i)
+		{
+			Instance& instance = instances[i];
+			instance.assembly = generator() % assembliesCount;
+			instance.scale = baseScale * (0.75f + 0.5f * unit(generator));
+
+			// a uniformly random unit quaternion gives a uniformly random rotation
+			float q[4];
+			float length = 0.f;
+			do
+			{
+				length = 0.f;
+				for(int j = 0; j < 4; ++j)
+				{
+					q[j] = normal(generator);
+					length += q[j] * q[j];
+				}
+			} while(length < 1e-6f);
+			length = std::sqrt(length);
+			float w = q[0] / length, x = q[1] / length, y = q[2] / length, z = q[3] / length;
+			float rotation[3][3] = {
+				{ 1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w) },
+				{ 2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w) },
+				{ 2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y) },
+			};
+
+			// the center of the assembly lands anywhere in the scene
+			Vec3 position(unit(generator) * sceneSize, unit(generator) * sceneSize, unit(generator) * sceneSize);
+			for(int row = 0; row < 3; ++row)
+			{
+				float rotated = 0.f;
+				for(int j = 0; j < 3; ++j)
+				{
+					instance.rotation[row][j] = rotation[row][j];
+					rotated += rotation[row][j] * assemblyCenter[j];
+				}
+				instance.translation[row] = position[row] - instance.scale * rotated;
+			}
+		}
+		return instances;
+	}
+
+	Rays generateRays(RaysType type, int count, unsigned seed, ThreadPool& pool)
+	{
+		Rays rays;
+		rays.rays.resize(count);
+
+		int width = static_cast<int>(std::sqrt(static_cast<float>(count)));
+		width = width > 0 ? width : 1;
+		Vec3 eye(sceneSize * 0.5f, sceneSize * 0.5f, -sceneSize * 0.5f);
+
+		pool.parallelFor(count, chunkSize, [&](int from, int to)
+		{
+			mt19937 generator(seed + 1 + from / chunkSize);
+			uniform_real_distribution<float> coord(0.f, sceneSize);
+			uniform_real_distribution<float> segment(0.01f * sceneSize, 0.05f * sceneSize);
+
+			for(int i = from; i < to; ++i)
+			{
+				if(type == RAYS_CAMERA)
+				{
+					// row by row, consecutive rays are neighbouring pixels
+					float x = sceneSize * (i % width) / width;
+					float y = sceneSize * (i / width) / width;
+					rays.rays[i] = Ray(eye, normalize(Vec3(x, y, 0.f) - eye));
+				}
+				else if(type == RAYS_RANDOM)
+				{
+					Vec3 origin(coord(generator), coord(generator), coord(generator));
+					rays.rays[i] = Ray(origin, randomDirection(generator));
+				}
+				else
+				{
+					Vec3 origin(coord(generator), coord(generator), coord(generator));
+					rays.rays[i] = Ray(origin, randomDirection(generator), 0.f, segment(generator));
+				}
+			}
+		});
+
+		return rays;
+	}
+
+	IntersectionData bruteForceIntersect(const Ray& ray, const SpheresView& spheres)
+	{
+		Ray normalized(ray.origin, normalize(ray.direction), ray.tmin, ray.tmax);
+
+		IntersectionData result;
+		result.intersection = false;
+		result.tIntersection = numeric_limits<float>::max();
+		result.sphereIndex = -1;
+
+		for(int i = 0; i < spheres.count; ++i)
+		{
+			Sphere sphere;
+			sphere.center = Vec3(spheres.centerCoords[0][i], spheres.centerCoords[1][i], spheres.centerCoords[2][i]);
+			sphere.radius = spheres.radiuses[i];
+
+			IntersectionData data = Intersection::intersectSingleSphere(normalized, sphere);
+			if(data.intersection && data.tIntersection < result.tIntersection)
+			{
+				result = data;
+				result.sphereIndex = i;
+			}
+		}
+		return result;
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef GENERATORS_H_
+#define GENERATORS_H_
+
+#include "Common.h"
+#include "ThreadPool.h"
+#include "InstanceTree.h"
+
+/**
+ * Deterministic scenes and ray sets for benchmarking. Scenes fill a cube
+ * of sceneSize, radiuses shrink with the number of spheres so that the
+ * density stays comparable from 1K to 50M spheres.
+ * */
+namespace Generators
+{
+	const float sceneSize = 100.f;
+
+	enum SceneType
+	{
+		SCENE_UNIFORM,
+		SCENE_CLUSTERED,
+		SCENE_MIXED_RADIUSES,
+	};
+
+	enum RaysType
+	{
+		RAYS_CAMERA,
+		RAYS_RANDOM,
+		RAYS_SHADOW,
+	};
+
+	Spheres generateSpheres(SceneType type, int count, unsigned seed, ThreadPool& pool);
+
+	/**
+	 * Instances of assemblies generated as scenes of their own, turned randomly and spread
+	 * over the scene cube. They are scaled so that count of them fill the cube about as
+	 * densely as one assembly fills it.
+	 * */
+	std::vector<Instance> generateInstances(int count, int assembliesCount, unsigned seed);
+
+	/**
+	 * Shadow rays are short segments, their tmax is the length of the segment
+	 * */
+	Rays generateRays(RaysType type, int count, unsigned seed, ThreadPool& pool);
+
+	/**
+	 * Reference closest hit, tests every sphere
+	 * */
+	IntersectionData bruteForceIntersect(const Ray& ray, const SpheresView& spheres);
+}
+
+#endif /* GENERATORS_H_ */
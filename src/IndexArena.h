@@ -0,0 +1,101 @@
+#ifndef INDEXARENA_H_
+#define INDEXARENA_H_
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+/**
+ * Bytes held by all arenas of a build and the most they held at once
+ * */
+struct BuildMemory
+{
+	BuildMemory() : current(0), peak(0) {}
+
+	void add(size_t bytes)
+	{
+		size_t now = current += bytes;
+		size_t highest = peak;
+		while(now > highest && !peak.compare_exchange_weak(highest, now))
+		{
+		}
+	}
+
+	void remove(size_t bytes)
+	{
+		current -= bytes;
+	}
+
+	std::atomic<size_t> current;
+	std::atomic<size_t> peak;
+};
+
+/**
+ * Bump allocator for the sphere index lists of the kd-tree builder.
+ * Lists are released in LIFO order by resetting the top. Allocations are
+ * offsets, the storage moves when the arena grows.
+ * */
+class IndexArena
+{
+public:
+	IndexArena(size_t capacity, BuildMemory& memory) : storage(new int[capacity]), capacity(capacity), used(0),
+			memory(memory)
+	{
+		memory.add(capacity * sizeof(int));
+	}
+
+	~IndexArena()
+	{
+		memory.remove(capacity * sizeof(int));
+	}
+
+	IndexArena(const IndexArena&) = delete;
+	IndexArena& operator=(const IndexArena&) = delete;
+
+	size_t allocate(size_t count)
+	{
+		if(used + count > capacity)
+		{
+			grow(used + count);
+		}
+		size_t offset = used;
+		used += count;
+		return offset;
+	}
+
+	void release(size_t top)
+	{
+		used = top;
+	}
+
+	size_t top() const
+	{
+		return used;
+	}
+
+	int* data(size_t offset)
+	{
+		return storage.get() + offset;
+	}
+
+private:
+	void grow(size_t required)
+	{
+		size_t newCapacity = std::max(required, capacity + capacity / 2);
+		std::unique_ptr<int[]> newStorage(new int[newCapacity]);
+		std::copy(storage.get(), storage.get() + used, newStorage.get());
+		storage = std::move(newStorage);
+
+		memory.add(newCapacity * sizeof(int));
+		memory.remove(capacity * sizeof(int));
+		capacity = newCapacity;
+	}
+
+	std::unique_ptr<int[]> storage;
+	size_t capacity;
+	size_t used;
+	BuildMemory& memory;
+};
+
+#endif /* INDEXARENA_H_ */
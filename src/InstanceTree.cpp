@@ -0,0 +1,490 @@
+#include "InstanceTree.h"
+#include <algorithm>
+#include <numeric>
+#include "Stats.h"
+
+using std::min;
+using std::max;
+using std::numeric_limits;
+
+namespace
+{
+	BoundingBox emptyBox()
+	{
+		BoundingBox box;
+		box.vmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+		box.vmax = Vec3(numeric_limits<float>::lowest(), numeric_limits<float>::lowest(),
+				numeric_limits<float>::lowest());
+		return box;
+	}
+
+	void growBox(BoundingBox& box, const BoundingBox& other)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			box.vmin[axis] = min(box.vmin[axis], other.vmin[axis]);
+			box.vmax[axis] = max(box.vmax[axis], other.vmax[axis]);
+		}
+	}
+
+	Vec3 toWorld(const Instance& instance, const Vec3& local)
+	{
+		Vec3 world;
+		for(int i = 0; i < 3; ++i)
+		{
+			float rotated = 0.f;
+			for(int j = 0; j < 3; ++j)
+			{
+				rotated += instance.rotation[i][j] * local[j];
+			}
+			world[i] = instance.scale * rotated + instance.translation[i];
+		}
+		return world;
+	}
+
+	/**
+	 * The transposed rotation undoes the rotation
+	 * */
+	Vec3 unrotate(const Instance& instance, const Vec3& world)
+	{
+		Vec3 local;
+		for(int j = 0; j < 3; ++j)
+		{
+			local[j] = instance.rotation[0][j] * world[0] + instance.rotation[1][j] * world[1] +
+					instance.rotation[2][j] * world[2];
+		}
+		return local;
+	}
+
+	/**
+	 * Part of the ray in the box before tmax, tnear is where it enters
+	 * */
+	bool enterBox(const BoundingBox& box, const RayData& rayData, float tmax, float& tnear)
+	{
+		tnear = rayData.ray.tmin;
+		float tfar = tmax;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			float t1 = (box.vmin[axis] - rayData.ray.origin[axis]) * rayData.invDirection[axis];
+			float t2 = (box.vmax[axis] - rayData.ray.origin[axis]) * rayData.invDirection[axis];
+			tnear = max(tnear, min(t1, t2));
+			tfar = min(tfar, max(t1, t2));
+		}
+		return tnear <= tfar;
+	}
+}
+
+bool InstanceTree::build(vector<Spheres>&& assemblies, const vector<Instance>& instances, ThreadPool& pool)
+{
+	this->assemblies = std::move(assemblies);
+	assemblyTrees.clear();
+	assembliesDepth = 0;
+	size_t assembliesPeak = 0;
+	for(const Spheres& assembly : this->assemblies)
+	{
+		// the trees keep views of the assemblies, which stay in place until the next build
+		KDTree* tree = new KDTree(sahParams);
+		assemblyTrees.push_back(unique_ptr<KDTree>(tree));
+		tree->build(SpheresView(assembly), pool);
+		assembliesDepth = max(assembliesDepth, tree->getDepth());
+		assembliesPeak = max(assembliesPeak, tree->getBuildMemoryPeak());
+	}
+
+	bool built = setInstances(instances, pool);
+	buildMemoryPeak = max(buildMemoryPeak, assembliesPeak);
+	return built;
+}
+
+bool InstanceTree::setInstances(const vector<Instance>& instances, ThreadPool& pool)
+{
+	int count = instances.size();
+	long long spheres = 0;
+	for(const Instance& instance : instances)
+	{
+		if(instance.assembly < 0 || instance.assembly >= static_cast<int>(assemblies.size()) ||
+				!(instance.scale > 0.f))
+		{
+			return false;
+		}
+		spheres += assemblies[instance.assembly].count;
+	}
+	// the hits name the spheres by int
+	if(spheres > numeric_limits<int>::max())
+	{
+		return false;
+	}
+
+	this->instances = instances;
+	spheresCount = spheres;
+	instanceFirstSphere.resize(count);
+	for(int i = 0, first = 0; i < count; ++i)
+	{
+		instanceFirstSphere[i] = first;
+		first += assemblies[instances[i].assembly].count;
+	}
+
+	vector<BoundingBox> boxes(count);
+	pool.parallelFor(count, 1 << 12, [&](int from, int to)
+	{
+		for(int i = from; i < to; ++i)
+		{
+			boxes[i] = instanceBox(instances[i]);
+		}
+	});
+
+	nodes.clear();
+	leafInstances.resize(count);
+	std::iota(leafInstances.begin(), leafInstances.end(), 0);
+	depth = 0;
+	sceneBBox = emptyBox();
+	if(count > 0)
+	{
+		struct BuildRange
+		{
+			int nodeIdx;
+			int first;
+			int count;
+			int depth;
+		};
+		vector<BuildRange> st;
+		nodes.push_back(InstanceNode());
+		st.push_back(BuildRange{ 0, 0, count, 0 });
+
+		// median splits along the widest axis of the box centers
+		while(!st.empty())
+		{
+			BuildRange range = st.back();
+			st.pop_back();
+			depth = max(depth, range.depth);
+
+			InstanceNode& node = nodes[range.nodeIdx];
+			node.bbox = emptyBox();
+			BoundingBox centers = emptyBox();
+			for(int i = range.first; i < range.first + range.count; ++i)
+			{
+				const BoundingBox& box = boxes[leafInstances[i]];
+				growBox(node.bbox, box);
+				BoundingBox center;
+				center.vmin = center.vmax = (box.vmin + box.vmax) * 0.5f;
+				growBox(centers, center);
+			}
+
+			if(range.count <= leafInstancesCount)
+			{
+				node.first = range.first;
+				node.count = range.count;
+				continue;
+			}
+
+			int axis = 0;
+			for(int i = 1; i < 3; ++i)
+			{
+				if(centers.vmax[i] - centers.vmin[i] > centers.vmax[axis] - centers.vmin[axis])
+				{
+					axis = i;
+				}
+			}
+			int* first = leafInstances.data() + range.first;
+			int half = range.count / 2;
+			std::nth_element(first, first + half, first + range.count, [&boxes, axis](int a, int b)
+			{
+				return boxes[a].vmin[axis] + boxes[a].vmax[axis] < boxes[b].vmin[axis] + boxes[b].vmax[axis];
+			});
+
+			int childIdx = nodes.size();
+			node.first = childIdx;
+			node.count = 0;
+			// node is not used past here, the push may move it
+			nodes.push_back(InstanceNode());
+			nodes.push_back(InstanceNode());
+			st.push_back(BuildRange{ childIdx + 1, range.first + half, range.count - half, range.depth + 1 });
+			st.push_back(BuildRange{ childIdx, range.first, half, range.depth + 1 });
+		}
+		sceneBBox = nodes[0].bbox;
+	}
+
+	buildMemoryPeak = boxes.capacity() * sizeof(BoundingBox) + nodes.capacity() * sizeof(InstanceNode) +
+			leafInstances.capacity() * sizeof(int);
+	return true;
+}
+
+BoundingBox InstanceTree::instanceBox(const Instance& instance) const
+{
+	// the corners of the assembly box bound the rotated spheres
+	const BoundingBox& local = assemblyTrees[instance.assembly]->getBoundingBox();
+	BoundingBox box = emptyBox();
+	for(int corner = 0; corner < 8; ++corner)
+	{
+		Vec3 point(corner & 1 ? local.vmax.x : local.vmin.x, corner & 2 ? local.vmax.y : local.vmin.y,
+				corner & 4 ? local.vmax.z : local.vmin.z);
+		BoundingBox cornerBox;
+		cornerBox.vmin = cornerBox.vmax = toWorld(instance, point);
+		growBox(box, cornerBox);
+	}
+	return box;
+}
+
+void InstanceTree::expandSpheres(const vector<Spheres>& assemblies, const vector<Instance>& instances,
+		Spheres& spheres, ThreadPool& pool)
+{
+	int count = instances.size();
+	vector<int> firstSphere(count + 1, 0);
+	for(int i = 0; i < count; ++i)
+	{
+		firstSphere[i + 1] = firstSphere[i] + assemblies[instances[i].assembly].count;
+	}
+
+	spheres.count = firstSphere[count];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		spheres.centerCoords[axis].resize(spheres.count);
+	}
+	spheres.radiuses.resize(spheres.count);
+
+	pool.parallelFor(count, 64, [&](int from, int to)
+	{
+		for(int i = from; i < to; ++i)
+		{
+			const Instance& instance = instances[i];
+			const Spheres& assembly = assemblies[instance.assembly];
+			for(int sphereIdx = 0; sphereIdx < assembly.count; ++sphereIdx)
+			{
+				Vec3 center = toWorld(instance, Vec3(assembly.centerCoords[0][sphereIdx],
+						assembly.centerCoords[1][sphereIdx], assembly.centerCoords[2][sphereIdx]));
+				int globalIdx = firstSphere[i] + sphereIdx;
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					spheres.centerCoords[axis][globalIdx] = center[axis];
+				}
+				spheres.radiuses[globalIdx] = instance.scale * assembly.radiuses[sphereIdx];
+			}
+		}
+	});
+}
+
+Ray InstanceTree::instanceRay(const Instance& instance, const Ray& ray, float tmax) const
+{
+	// points at t on the ray are at t / scale on the instance ray
+	float invScale = 1.f / instance.scale;
+	Ray local;
+	local.origin = unrotate(instance, ray.origin - instance.translation) * invScale;
+	local.direction = unrotate(instance, ray.direction);
+	local.tmin = ray.tmin * invScale;
+	local.tmax = tmax * invScale;
+	return local;
+}
+
+template<QueryType query>
+int InstanceTree::traverse(const RayData& rayData, IntersectionData& closest, int& hitInstance) const
+{
+	closest.intersection = false;
+	closest.sphereIndex = -1;
+	hitInstance = -1;
+
+	// tmax shrinks to the closest hit found so far
+	float tmax = rayData.ray.tmax;
+	struct StackEntry
+	{
+		int nodeIdx;
+		float tnear;
+	};
+	StackEntry st[2 * maxDepth + 2];
+	int stackSize = 0;
+	int hits = 0;
+
+	float tnear;
+	if(nodes.empty() || !enterBox(nodes[0].bbox, rayData, tmax, tnear))
+	{
+		return 0;
+	}
+	st[stackSize++] = StackEntry{ 0, tnear };
+
+	while(stackSize > 0)
+	{
+		StackEntry entry = st[--stackSize];
+		if(query == QUERY_CLOSEST && entry.tnear > tmax)
+		{
+			continue;
+		}
+
+		const InstanceNode& node = nodes[entry.nodeIdx];
+		if(node.count == 0)
+		{
+			STATS_ADD(INNER_NODES, 1);
+			// the nearer child goes on top of the stack
+			float tnearLeft, tnearRight;
+			bool left = enterBox(nodes[node.first].bbox, rayData, tmax, tnearLeft);
+			bool right = enterBox(nodes[node.first + 1].bbox, rayData, tmax, tnearRight);
+			if(left && right && tnearLeft < tnearRight)
+			{
+				st[stackSize++] = StackEntry{ node.first + 1, tnearRight };
+				st[stackSize++] = StackEntry{ node.first, tnearLeft };
+			}
+			else if(left && right)
+			{
+				st[stackSize++] = StackEntry{ node.first, tnearLeft };
+				st[stackSize++] = StackEntry{ node.first + 1, tnearRight };
+			}
+			else if(left)
+			{
+				st[stackSize++] = StackEntry{ node.first, tnearLeft };
+			}
+			else if(right)
+			{
+				st[stackSize++] = StackEntry{ node.first + 1, tnearRight };
+			}
+			STATS_MAX(STACK_DEPTH, stackSize);
+			continue;
+		}
+
+		for(int i = node.first; i < node.first + node.count; ++i)
+		{
+			int instanceIdx = leafInstances[i];
+			const Instance& instance = instances[instanceIdx];
+			const KDTree& tree = *assemblyTrees[instance.assembly];
+			Ray local = instanceRay(instance, rayData.ray, tmax);
+
+			if(query == QUERY_ANY)
+			{
+				if(tree.isOccluded(local, local.tmax))
+				{
+					return 1;
+				}
+			}
+			else if(query == QUERY_COUNT)
+			{
+				// every instance is in one leaf, its spheres are counted once
+				hits += tree.countHits(local);
+			}
+			else
+			{
+				IntersectionData hit = tree.intersectRay(local);
+				float t = hit.tIntersection * instance.scale;
+				// the scaling may round a hit past one found closer before
+				if(hit.intersection && (!hits || t < tmax))
+				{
+					closest.intersection = true;
+					closest.tIntersection = t;
+					closest.sphereIndex = instanceFirstSphere[instanceIdx] + hit.sphereIndex;
+					hitInstance = instanceIdx;
+					hits = 1;
+					tmax = t;
+				}
+			}
+		}
+	}
+	return hits;
+}
+
+IntersectionData InstanceTree::intersectRay(const Ray& ray) const
+{
+	IntersectionData data;
+	int hitInstance;
+	traverse<QUERY_CLOSEST>(RayData(ray), data, hitInstance);
+	return data;
+}
+
+void InstanceTree::intersectRay(const Ray& ray, HitRecord& hit) const
+{
+	RayData rayData(ray);
+	int hitInstance;
+	IntersectionData data;
+	traverse<QUERY_CLOSEST>(rayData, data, hitInstance);
+	hit.intersection = data.intersection;
+	hit.tIntersection = data.tIntersection;
+	hit.sphereIndex = data.sphereIndex;
+	if(!data.intersection)
+	{
+		return;
+	}
+
+	// the sphere in world space gives the normal
+	const Instance& instance = instances[hitInstance];
+	const Spheres& assembly = assemblies[instance.assembly];
+	int sphereIdx = data.sphereIndex - instanceFirstSphere[hitInstance];
+	Vec3 center = toWorld(instance, Vec3(assembly.centerCoords[0][sphereIdx], assembly.centerCoords[1][sphereIdx],
+			assembly.centerCoords[2][sphereIdx]));
+	hit.point = rayData.ray.origin + rayData.ray.direction * data.tIntersection;
+	hit.normal = (hit.point - center) * (1.f / (instance.scale * assembly.radiuses[sphereIdx]));
+}
+
+bool InstanceTree::isOccluded(const Ray& ray, float maxDistance) const
+{
+	RayData rayData(ray);
+	rayData.ray.tmax = min(ray.tmax, maxDistance);
+
+	IntersectionData unused;
+	int hitInstance;
+	return traverse<QUERY_ANY>(rayData, unused, hitInstance);
+}
+
+int InstanceTree::countHits(const Ray& ray) const
+{
+	IntersectionData unused;
+	int hitInstance;
+	return traverse<QUERY_COUNT>(RayData(ray), unused, hitInstance);
+}
+
+void InstanceTree::intersectRays(const Ray* rays, int count, IntersectionData* results) const
+{
+	for(int i = 0; i < count; ++i)
+	{
+		STATS_BEGIN_RAY();
+		results[i] = intersectRay(rays[i]);
+		STATS_END_RAY();
+	}
+}
+
+void InstanceTree::occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const
+{
+	for(int i = 0; i < count; ++i)
+	{
+		STATS_BEGIN_RAY();
+		bool hit = isOccluded(rays[i], maxDistance);
+		STATS_END_RAY();
+		occluded[i / 64] |= static_cast<uint64_t>(hit) << (i % 64);
+	}
+}
+
+void InstanceTree::update(const SpheresView&, const SphereUpdate&, ThreadPool&)
+{
+}
+
+int InstanceTree::getSize() const
+{
+	int size = nodes.size();
+	for(auto& tree : assemblyTrees)
+	{
+		size += tree->getSize();
+	}
+	return size;
+}
+
+int InstanceTree::getLeaves() const
+{
+	int leaves = 0;
+	for(auto& node : nodes)
+	{
+		leaves += node.count > 0;
+	}
+	for(auto& tree : assemblyTrees)
+	{
+		leaves += tree->getLeaves();
+	}
+	return leaves;
+}
+
+size_t InstanceTree::getMemoryUsage() const
+{
+	size_t bytes = nodes.size() * sizeof(InstanceNode) + leafInstances.size() * sizeof(int) +
+			instances.size() * (sizeof(Instance) + sizeof(int));
+	for(auto& assembly : assemblies)
+	{
+		bytes += 4 * assembly.radiuses.capacity() * sizeof(float);
+	}
+	for(auto& tree : assemblyTrees)
+	{
+		bytes += tree->getMemoryUsage();
+	}
+	return bytes;
+}
@@ -0,0 +1,151 @@
+#ifndef INSTANCETREE_H_
+#define INSTANCETREE_H_
+
+#include "Common.h"
+#include "Accelerator.h"
+#include "KDTree.h"
+#include "ThreadPool.h"
+#include <memory>
+
+using std::vector;
+using std::unique_ptr;
+
+/**
+ * Copy of an assembly placed in the scene, world = scale * rotation * local + translation.
+ * Only rotations and uniform scales keep the spheres spheres, rotation must be orthonormal.
+ * */
+struct Instance
+{
+	Instance() : assembly(0), scale(1.f)
+	{
+		for(int i = 0; i < 3; ++i)
+		{
+			for(int j = 0; j < 3; ++j)
+			{
+				rotation[i][j] = i == j ? 1.f : 0.f;
+			}
+		}
+	}
+
+	int assembly;
+	float rotation[3][3];
+	float scale;
+	Vec3 translation;
+};
+
+struct InstanceNode
+{
+	BoundingBox bbox;
+	/**
+	 * Inner nodes have their children at first and first + 1 and count 0,
+	 * leaves own the instances leafInstances[first, first + count)
+	 * */
+	int first;
+	int count;
+};
+
+/**
+ * Two level structure for scenes made of transformed copies of a few sphere assemblies.
+ * Every assembly gets its own kd-tree in assembly space, a tree over the world boxes of
+ * the instances sits on top of them. Rays reaching an instance are transformed into its
+ * space and traced through the kd-tree of its assembly, so memory and build time follow
+ * the unique assemblies and the number of instances, not the spheres of all copies.
+ *
+ * Sphere indices of the hits count the spheres of the instances one after another in
+ * instance order, as expandSpheres lays them out.
+ * */
+class InstanceTree : public Accelerator
+{
+public:
+	explicit InstanceTree(const SAHParams& params = SAHParams()) : sahParams(params), spheresCount(0), depth(0),
+			assembliesDepth(0), buildMemoryPeak(0) {}
+
+	InstanceTree(const InstanceTree&) = delete;
+	InstanceTree& operator=(const InstanceTree&) = delete;
+	InstanceTree(InstanceTree&&) = default;
+	InstanceTree& operator=(InstanceTree&&) = default;
+
+	/**
+	 * Takes the assemblies and builds their kd-trees, then the tree over the instances.
+	 * Returns false when an instance names a missing assembly or has no positive scale.
+	 * */
+	bool build(vector<Spheres>&& assemblies, const vector<Instance>& instances,
+			ThreadPool& pool = ThreadPool::defaultPool());
+
+	/**
+	 * Replaces the instances and builds only the tree over them again
+	 * */
+	bool setInstances(const vector<Instance>& instances, ThreadPool& pool = ThreadPool::defaultPool());
+
+	/**
+	 * Spheres of all instances in world space, in the order of the sphere indices of the hits.
+	 * The instances must name existing assemblies.
+	 * */
+	static void expandSpheres(const vector<Spheres>& assemblies, const vector<Instance>& instances,
+			Spheres& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+
+	IntersectionData intersectRay(const Ray& ray) const override;
+	void intersectRay(const Ray& ray, HitRecord& hit) const override;
+	bool isOccluded(const Ray& ray, float maxDistance) const override;
+	int countHits(const Ray& ray) const override;
+	void intersectRays(const Ray* rays, int count, IntersectionData* results) const override;
+	void occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const override;
+
+	/**
+	 * The spheres live in the assemblies, sphere updates do not apply and leave the
+	 * structure as it is. Instances move with setInstances.
+	 * */
+	void update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool) override;
+
+	/**
+	 * Size, leaves and memory cover both levels, the depth is the deepest path through both
+	 * */
+	int getSize() const override;
+	int getLeaves() const override;
+	int getDepth() const override { return depth + assembliesDepth; }
+	const BoundingBox& getBoundingBox() const override { return sceneBBox; }
+	size_t getMemoryUsage() const override;
+	size_t getBuildMemoryPeak() const override { return buildMemoryPeak; }
+	const char* getName() const override { return "instances"; }
+
+	int getSpheresCount() const { return spheresCount; }
+	int getInstancesCount() const { return instances.size(); }
+
+private:
+	static const int leafInstancesCount = 2;
+	/**
+	 * Median splits halve the instances, no tree over ints gets deeper
+	 * */
+	static const int maxDepth = 32;
+
+	/**
+	 * Returns whether a hit was found, or the number of hits for QUERY_COUNT.
+	 * The closest hit gets its global sphere index and its instance.
+	 * */
+	template<QueryType query>
+	int traverse(const RayData& rayData, IntersectionData& closest, int& hitInstance) const;
+
+	/**
+	 * The ray in the space of the instance, distances shrink by its scale
+	 * */
+	Ray instanceRay(const Instance& instance, const Ray& ray, float tmax) const;
+	BoundingBox instanceBox(const Instance& instance) const;
+
+	SAHParams sahParams;
+	vector<Spheres> assemblies;
+	vector<unique_ptr<KDTree>> assemblyTrees;
+	vector<Instance> instances;
+	/**
+	 * Global index of the first sphere of every instance
+	 * */
+	vector<int> instanceFirstSphere;
+	vector<InstanceNode> nodes;
+	vector<int> leafInstances;
+	BoundingBox sceneBBox;
+	int spheresCount;
+	int depth;
+	int assembliesDepth;
+	size_t buildMemoryPeak;
+};
+
+#endif /* INSTANCETREE_H_ */
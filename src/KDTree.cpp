@@ -3,10 +3,16 @@
 #include <thread>
 #include <algorithm>
 #include <numeric>
+#include <cmath>
+#include <mutex>
+#include <cassert>
 #include "Utils.h"
+#include "RayPacket.h"
+#include "Stats.h"
 
 using std::stack;
-using std::thread;
+using std::mutex;
+using std::lock_guard;
 using std::iota;
 using std::min;
 using std::max;
@@ -21,12 +27,12 @@ unsigned KDTree::rightChild(const unsigned nodeIdx) const
 	return leftChild(nodeIdx) + 1;
 }
 
-void KDTree::findMinMax(const Spheres& spheres, Axis axis, float& min, float& max) const
+void KDTree::findMinMax(const SpheresView& spheres, Axis axis, int from, int to, float& min, float& max) const
 {
-	min = spheres.centerCoords[axis][0] - spheres.radiuses[0];
-	max = spheres.centerCoords[axis][0] + spheres.radiuses[0];
+	min = numeric_limits<float>::max();
+	max = numeric_limits<float>::lowest();
 
-	for(int i = 1; i < spheres.count; ++i)
+	for(int i = from; i < to; ++i)
 	{
 		if(spheres.centerCoords[axis][i] - spheres.radiuses[i] < min)
 		{
@@ -40,22 +46,29 @@ void KDTree::findMinMax(const Spheres& spheres, Axis axis, float& min, float& ma
 	}
 }
 
-BoundingBox KDTree::createBoundingBox(const Spheres& spheres) const
+BoundingBox KDTree::createBoundingBox(const SpheresView& spheres, ThreadPool& pool) const
 {
+	STATS_TIMER(PHASE_BOUNDING_BOX);
 	BoundingBox bbox;
-	float minCoords[3], maxCoords[3];
-	thread xValues(&KDTree::findMinMax, this, std::cref(spheres),
-			AXIS_X, std::ref(minCoords[0]), std::ref(maxCoords[0]));
-	thread yValues(&KDTree::findMinMax, this, std::cref(spheres),
-			AXIS_Y, std::ref(minCoords[1]), std::ref(maxCoords[1]));
+	bbox.vmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+	bbox.vmax = Vec3(numeric_limits<float>::lowest(), numeric_limits<float>::lowest(), numeric_limits<float>::lowest());
 
-	findMinMax(spheres, AXIS_Z, minCoords[2], maxCoords[2]);
-
-	xValues.join();
-	yValues.join();
+	mutex bboxMutex;
+	pool.parallelFor(spheres.count, parallelSplitThreshold, [&](int from, int to)
+	{
+		float minCoords[3], maxCoords[3];
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			findMinMax(spheres, static_cast<Axis>(axis), from, to, minCoords[axis], maxCoords[axis]);
+		}
 
-	bbox.vmin = Vec3(minCoords[0], minCoords[1], minCoords[2]);
-	bbox.vmax = Vec3(maxCoords[0], maxCoords[1], maxCoords[2]);
+		lock_guard<mutex> lock(bboxMutex);
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			bbox.vmin[axis] = min(bbox.vmin[axis], minCoords[axis]);
+			bbox.vmax[axis] = max(bbox.vmax[axis], maxCoords[axis]);
+		}
+	});
 
 	return bbox;
 }
@@ -82,96 +95,315 @@ float KDTree::surfaceAreaHeuristic(const BoundingBox& bbox, Axis axis, float spl
 	float costLeft = spheresLeft * (surfaceLeft / surfaceWhole);
 	float costRight = spheresRight * (surfaceRight / surfaceWhole);
 
-	return costLeft + costRight;
+	return sahParams.traversalCost + sahParams.intersectionCost * (costLeft + costRight);
 }
 
-void KDTree::spheresCount(const Spheres& spheres, Axis axis, const float from, const float to, unsigned& count) const
+void KDTree::binSpheres(const SpheresView& spheres, const StackNode& node, const int* indices, int from, int to,
+		SAHBins& bins) const
 {
-	count = 0;
-	for(auto i = 0; i < spheres.count; ++i)
+	for(int axis = 0; axis < 3; ++axis)
 	{
-		float radius = spheres.radiuses[i];
-		if(spheres.centerCoords[axis][i] -  radius >= from && spheres.centerCoords[axis][i] + radius <= to)
+		float leftLimit = node.bbox.vmin[axis];
+		float rightLimit = node.bbox.vmax[axis];
+		float extent = rightLimit - leftLimit;
+		if(extent <= 0.f)
 		{
-			++count;
+			continue;
 		}
-	}
 
+		float scale = sahBins / extent;
+		const float* centers = spheres.centerCoords[axis];
+		float lower = bins.lower[axis];
+		float upper = bins.upper[axis];
+		for(int i = from; i < to; ++i)
+		{
+			int idx = indices[i];
+			float start = centers[idx] - spheres.radiuses[idx];
+			float end = centers[idx] + spheres.radiuses[idx];
+			int startBin = static_cast<int>((start - leftLimit) * scale);
+			int endBin = static_cast<int>((end - leftLimit) * scale);
+			++bins.starts[axis][min(max(startBin, 0), sahBins - 1)];
+			++bins.ends[axis][min(max(endBin, 0), sahBins - 1)];
+			lower = min(lower, max(start, leftLimit));
+			upper = max(upper, min(end, rightLimit));
+		}
+		bins.lower[axis] = lower;
+		bins.upper[axis] = upper;
+	}
 }
 
-void KDTree::minSAHCost(const Spheres& spheres, const BoundingBox& bbox, Axis axis, SAHCost& sahCost) const
+void KDTree::minSAHCost(const StackNode& node, Axis axis, const SAHBins& bins, SAHCost& sahCost) const
 {
-	thread t;
-	for(auto i = 0; i < spheres.count; ++i)
+	float leftLimit = node.bbox.vmin[axis];
+	float extent = node.bbox.vmax[axis] - leftLimit;
+	if(extent <= 0.f)
 	{
-		float leftPlane = spheres.centerCoords[axis][i] - spheres.radiuses[i];
-		float rightPlane = spheres.centerCoords[axis][i] + spheres.radiuses[i];
-		if(!bbox.inBoundingBox(leftPlane, axis))
-		{
-			continue;
-		}
-
-		BoundingBox left, right;
-		bbox.split(axis, leftPlane, left, right);
+		return;
+	}
 
-		unsigned spheresLeft = 0, spheresRight = 0;
-		t = thread(&KDTree::spheresCount, this, spheres, axis, bbox.vmin[axis],
-				leftPlane, std::ref(spheresLeft));
-		spheresCount(spheres, axis, leftPlane, bbox.vmax[axis], spheresRight);
-		t.join();
+	// every bin boundary is a candidate plane, spheres starting left of it
+	// go left and spheres not ending left of it go right
+	unsigned spheresLeft = 0;
+	unsigned spheresEnded = 0;
+	unsigned spheresTotal = node.count;
+	for(int i = 1; i < sahBins; ++i)
+	{
+		spheresLeft += bins.starts[axis][i - 1];
+		spheresEnded += bins.ends[axis][i - 1];
+		float splitPos = leftLimit + i * (extent / sahBins);
 
-		float sah = surfaceAreaHeuristic(bbox, axis, leftPlane, spheresLeft, spheresRight);
+		float sah = surfaceAreaHeuristic(node.bbox, axis, splitPos, spheresLeft, spheresTotal - spheresEnded);
 		if(sah < sahCost.cost)
 		{
 			sahCost.cost = sah;
 			sahCost.splitAxis = axis;
-			sahCost.splitPos = leftPlane;
+			sahCost.splitPos = splitPos;
 		}
+	}
+}
 
-		if(!bbox.inBoundingBox(rightPlane, axis))
+BoundingBox KDTree::clippedBounds(const SpheresView& spheres, const StackNode& node, const int* indices,
+		float padding) const
+{
+	BoundingBox bounds;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float lower = numeric_limits<float>::max();
+		float upper = numeric_limits<float>::lowest();
+		const float* centers = spheres.centerCoords[axis];
+		for(unsigned i = 0; i < node.count; ++i)
 		{
-			continue;
+			int idx = indices[i];
+			lower = min(lower, centers[idx] - spheres.radiuses[idx]);
+			upper = max(upper, centers[idx] + spheres.radiuses[idx]);
 		}
+		bounds.vmin[axis] = max(lower, node.bbox.vmin[axis]) - padding;
+		bounds.vmax[axis] = min(upper, node.bbox.vmax[axis]) + padding;
+	}
+	return bounds;
+}
 
-		bbox.split(axis, rightPlane, left, right);
-		t = thread(&KDTree::spheresCount, this, spheres, axis, bbox.vmin[axis],
-				rightPlane, std::ref(spheresLeft));
-		spheresCount(spheres, axis, rightPlane, bbox.vmax[axis], spheresRight);
-		t.join();
+BoundingBox KDTree::emptyBounds()
+{
+	BoundingBox box;
+	std::swap(box.vmin, box.vmax);
+	return box;
+}
 
-		sah = surfaceAreaHeuristic(bbox, axis, rightPlane, spheresLeft, spheresRight);
-		if(sah < sahCost.cost)
-		{
-			sahCost.cost = sah;
-			sahCost.splitAxis = axis;
-			sahCost.splitPos = rightPlane;
-		}
+/**
+ * Squared distance from the point to the box along all axes
+ * */
+static float squaredDistance(const BoundingBox& box, const float (&point)[3])
+{
+	float distance = 0.f;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		float d = point[axis] - min(max(point[axis], box.vmin[axis]), box.vmax[axis]);
+		distance += d * d;
+	}
+	return distance;
+}
+
+SpherePosition KDTree::classifySphere(const SpheresView& spheres, int sphereIdx, Axis axis, float splitPos,
+		const StackNode& left, const StackNode& right) const
+{
+	float center = spheres.centerCoords[axis][sphereIdx];
+	float radius = spheres.radiuses[sphereIdx];
+	if(center + radius <= splitPos)
+	{
+		return LEFT;
+	}
+	if(center - radius >= splitPos)
+	{
+		return RIGHT;
+	}
+
+	// the bounds straddle the plane, keep only the children the sphere itself overlaps
+	float point[3] = { spheres.centerCoords[0][sphereIdx], spheres.centerCoords[1][sphereIdx],
+			spheres.centerCoords[2][sphereIdx] };
+	bool inLeft = squaredDistance(left.bbox, point) <= radius * radius;
+	bool inRight = squaredDistance(right.bbox, point) <= radius * radius;
+	if(inLeft == inRight)
+	{
+		return INTERSECT;
 	}
+	return inLeft ? LEFT : RIGHT;
 }
 
-SAHCost KDTree::chooseSplittingAxis(const Spheres& spheres, const BoundingBox& bbox) const
+struct KDTree::BuildContext
 {
-	SAHCost sahCosts[3];
-	for(int i = 0; i < 3; ++i)
+	BuildContext(const SpheresView& spheres, ThreadPool* pool) : spheres(spheres), pool(pool), maxDepth(0),
+			lazyDepth(0), boundsPadding(0.f), nodesCount(0) {}
+
+	SpheresView spheres;
+	/**
+	 * nullptr builds on the calling thread alone
+	 * */
+	ThreadPool* pool;
+	int maxDepth;
+	/**
+	 * Nodes from this depth on are left to the queries when they have many spheres
+	 * */
+	int lazyDepth;
+	/**
+	 * Leaf bounds grow by it, so rays grazing a sphere at its bounds still reach the leaf
+	 * */
+	float boundsPadding;
+	std::atomic<int> nodesCount;
+	BuildMemory memory;
+};
+
+SAHCost KDTree::chooseSplittingAxis(BuildContext& context, const StackNode& node, const int* indices) const
+{
+	STATS_TIMER(PHASE_BINNING);
+	SAHBins bins = SAHBins();
+	int spheresCount = node.count;
+
+	if(spheresCount < parallelSplitThreshold || !context.pool)
 	{
-		sahCosts[i].cost = numeric_limits<float>::max();
+		binSpheres(context.spheres, node, indices, 0, spheresCount, bins);
 	}
+	else
+	{
+		mutex binsMutex;
+		context.pool->parallelFor(spheresCount, parallelSplitThreshold / 4, [&](int from, int to)
+		{
+			SAHBins localBins = SAHBins();
+			binSpheres(context.spheres, node, indices, from, to, localBins);
 
-	thread xCost(&KDTree::minSAHCost, this, std::cref(spheres), std::cref(bbox), AXIS_X, std::ref(sahCosts[0]));
-	thread yCost(&KDTree::minSAHCost, this, std::cref(spheres), std::cref(bbox), AXIS_Y, std::ref(sahCosts[1]));
-	minSAHCost(spheres, bbox, AXIS_Z, sahCosts[2]);
+			lock_guard<mutex> lock(binsMutex);
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				for(int i = 0; i < sahBins; ++i)
+				{
+					bins.starts[axis][i] += localBins.starts[axis][i];
+					bins.ends[axis][i] += localBins.ends[axis][i];
+				}
+				bins.lower[axis] = min(bins.lower[axis], localBins.lower[axis]);
+				bins.upper[axis] = max(bins.upper[axis], localBins.upper[axis]);
+			}
+		});
+	}
 
-	xCost.join();
-	yCost.join();
+	SAHCost res;
+	res.cost = numeric_limits<float>::max();
+	res.splitAxis = AXIS_NONE;
+	res.splitPos = 0.f;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		res.bounds.vmin[axis] = bins.lower[axis];
+		res.bounds.vmax[axis] = bins.upper[axis];
+	}
 
-	SAHCost res = sahCosts[0];
-	if(res.cost < sahCosts[1].cost) res = sahCosts[1];
-	if(res.cost < sahCosts[2].cost) res = sahCosts[2];
+	minSAHCost(node, AXIS_X, bins, res);
+	minSAHCost(node, AXIS_Y, bins, res);
+	minSAHCost(node, AXIS_Z, bins, res);
 
 	return res;
 }
 
-void KDTree::initInnerNode(unsigned nodeIdx, Axis axis, float splitPos, unsigned firstChildIdx)
+void KDTree::partitionSpheres(BuildContext& context, IndexArena& arena, const StackNode& node, Axis axis,
+		float splitPos, StackNode& left, StackNode& right) const
+{
+	STATS_TIMER(PHASE_PARTITION);
+	int spheresCount = node.count;
+	int* indices = arena.data(node.first);
+	unsigned leftOnly = 0, straddling = 0;
+
+	if(spheresCount < parallelSplitThreshold || !context.pool)
+	{
+		// three way partition, [0, low) left only, [low, mid) straddling, [high, count) right only
+		int low = 0, mid = 0, high = spheresCount;
+		while(mid < high)
+		{
+			SpherePosition position = classifySphere(context.spheres, indices[mid], axis, splitPos, left, right);
+			if(position == LEFT)
+			{
+				std::swap(indices[low++], indices[mid++]);
+			}
+			else if(position == INTERSECT)
+			{
+				++mid;
+			}
+			else
+			{
+				std::swap(indices[mid], indices[--high]);
+			}
+		}
+		leftOnly = low;
+		straddling = high - low;
+	}
+	else
+	{
+		// classify fixed chunks in parallel, then scatter them in order through scratch space
+		const int grain = parallelSplitThreshold / 4;
+		int chunks = (spheresCount + grain - 1) / grain;
+		vector<unsigned char> positions(spheresCount);
+		vector<unsigned> chunkCounts(3 * chunks, 0);
+		context.pool->parallelFor(spheresCount, grain, [&](int from, int to)
+		{
+			unsigned* counts = &chunkCounts[3 * (from / grain)];
+			for(int i = from; i < to; ++i)
+			{
+				positions[i] = classifySphere(context.spheres, indices[i], axis, splitPos, left, right);
+				++counts[positions[i]];
+			}
+		});
+
+		// LEFT, INTERSECT and RIGHT groups one after another, chunks in order inside a group
+		unsigned offset = 0;
+		const SpherePosition order[3] = { LEFT, INTERSECT, RIGHT };
+		for(SpherePosition position : order)
+		{
+			for(int chunk = 0; chunk < chunks; ++chunk)
+			{
+				unsigned count = chunkCounts[3 * chunk + position];
+				chunkCounts[3 * chunk + position] = offset;
+				offset += count;
+			}
+			if(position == LEFT)
+			{
+				leftOnly = offset;
+			}
+			else if(position == INTERSECT)
+			{
+				straddling = offset - leftOnly;
+			}
+		}
+
+		size_t scratchOffset = arena.allocate(spheresCount);
+		int* scratch = arena.data(scratchOffset);
+		indices = arena.data(node.first);
+		context.pool->parallelFor(spheresCount, grain, [&](int from, int to)
+		{
+			unsigned* offsets = &chunkCounts[3 * (from / grain)];
+			for(int i = from; i < to; ++i)
+			{
+				scratch[offsets[positions[i]]++] = indices[i];
+			}
+		});
+		std::copy(scratch, scratch + spheresCount, indices);
+		arena.release(scratchOffset);
+	}
+
+	left.first = node.first;
+	left.count = leftOnly + straddling;
+	right.count = spheresCount - leftOnly;
+	if(straddling == 0)
+	{
+		right.first = node.first + leftOnly;
+	}
+	else
+	{
+		right.first = arena.allocate(right.count);
+		indices = arena.data(node.first);
+		std::copy(indices + leftOnly, indices + spheresCount, arena.data(right.first));
+	}
+	left.arenaTop = right.arenaTop = arena.top();
+}
+
+void KDTree::initInnerNode(vector<KDNode>& nodes, unsigned nodeIdx, Axis axis, float splitPos,
+		unsigned firstChildIdx)
 {
 	nodes[nodeIdx].inner.flagDimAndOffset = 0;
 	nodes[nodeIdx].inner.flagDimAndOffset |= (firstChildIdx - nodeIdx) * sizeof(KDNode);
@@ -179,163 +411,1354 @@ void KDTree::initInnerNode(unsigned nodeIdx, Axis axis, float splitPos, unsigned
 	nodes[nodeIdx].inner.splitCoord = splitPos;
 }
 
-void KDTree::initLeafNode(unsigned nodeIdx, unsigned dataIdx)
+void KDTree::initLeafNode(vector<KDNode>& nodes, unsigned nodeIdx, unsigned dataIdx, unsigned spheresCount)
 {
 	nodes[nodeIdx].leaf.flagAndOffset = 0;
 	nodes[nodeIdx].leaf.flagAndOffset |= static_cast<unsigned>(1 << 31);
 	nodes[nodeIdx].leaf.flagAndOffset |= dataIdx;
+	nodes[nodeIdx].leaf.spheresCount = spheresCount;
 }
 
-void KDTree::build(const Spheres& spheres)
+void KDTree::spliceSubtree(KDSubtree& parent, unsigned slotIdx, KDSubtree& child)
 {
-	leaves = 0;
-	this->spheres = spheres;
-	sceneBBox = createBoundingBox(spheres);
+	const unsigned leafFlag = static_cast<unsigned>(1 << 31);
+	unsigned nodesBase = parent.nodes.size();
+	unsigned leavesBase = parent.leaves;
+	unsigned indicesBase = parent.leafIndices.size();
+	unsigned lazyBase = parent.lazyBoxes.size();
+	unsigned lazyIndicesBase = parent.lazyIndices.size();
+
+	// child offsets are relative, only leaf and lazy node indices and the root offset change
+	for(auto& node : child.nodes)
+	{
+		if(node.leaf.flagAndOffset & leafFlag)
+		{
+			node.leaf.flagAndOffset += node.leaf.spheresCount == lazyLeafCount ? lazyBase : leavesBase;
+		}
+	}
+
+	KDNode root = child.nodes[0];
+	if(!(root.leaf.flagAndOffset & leafFlag))
+	{
+		// the root of the child lands in slotIdx, its children pair at nodesBase
+		initInnerNode(parent.nodes, slotIdx, static_cast<Axis>(root.inner.flagDimAndOffset & 0x3),
+				root.inner.splitCoord, nodesBase);
+	}
+	else
+	{
+		parent.nodes[slotIdx] = root;
+	}
 
-	int axis = static_cast<int>(AXIS_X);
+	parent.nodes.insert(parent.nodes.end(), child.nodes.begin() + 1, child.nodes.end());
+	parent.leafIndices.insert(parent.leafIndices.end(), child.leafIndices.begin(), child.leafIndices.end());
+	for(unsigned i = 1; i < child.leafStarts.size(); ++i)
+	{
+		parent.leafStarts.push_back(indicesBase + child.leafStarts[i]);
+	}
+	parent.leafBounds.insert(parent.leafBounds.end(), child.leafBounds.begin(), child.leafBounds.end());
+	parent.lazyIndices.insert(parent.lazyIndices.end(), child.lazyIndices.begin(), child.lazyIndices.end());
+	for(unsigned i = 1; i < child.lazyStarts.size(); ++i)
+	{
+		parent.lazyStarts.push_back(lazyIndicesBase + child.lazyStarts[i]);
+	}
+	parent.lazyBoxes.insert(parent.lazyBoxes.end(), child.lazyBoxes.begin(), child.lazyBoxes.end());
+	parent.lazyDepths.insert(parent.lazyDepths.end(), child.lazyDepths.begin(), child.lazyDepths.end());
+	parent.leaves += child.leaves;
+	parent.depth = max(parent.depth, child.depth);
+
+	child.nodes = vector<KDNode>();
+	child.leafIndices = vector<int>();
+	child.leafStarts = vector<unsigned>();
+	child.leafBounds = vector<BoundingBox>();
+	child.lazyIndices = vector<int>();
+	child.lazyStarts = vector<unsigned>();
+	child.lazyBoxes = vector<BoundingBox>();
+	child.lazyDepths = vector<int>();
+}
+
+void KDTree::buildSubtree(BuildContext& context, IndexArena& arena, const StackNode& root, KDSubtree& subtree) const
+{
+	struct PendingSubtree
+	{
+		PendingSubtree(size_t count, BuildMemory& memory) : arena(2 * count, memory) {}
 
-	KDNode root;
-	nodes.push_back(root);
+		unsigned slotIdx;
+		StackNode root;
+		IndexArena arena;
+		KDSubtree subtree;
+	};
+	vector<unique_ptr<PendingSubtree>> pending;
+	unique_ptr<TaskGroup> group(context.pool ? new TaskGroup(*context.pool) : nullptr);
 
-	StackNode stackNode;
-	stackNode.bbox = sceneBBox;
-	stackNode.nodeIdx = nodes.size() - 1;
-	stackNode.sphereIndices.resize(spheres.count);
-	iota(stackNode.sphereIndices.begin(), stackNode.sphereIndices.end(), 0);
+	StackNode rootCopy = root;
+	rootCopy.nodeIdx = subtree.nodes.size();
+	subtree.nodes.push_back(KDNode());
+	++context.nodesCount;
 
+	// the right child waits on the stack with its indices above everything the left subtree allocates
 	stack<StackNode> st;
-	st.push(stackNode);
+	st.push(rootCopy);
 
 	while(!st.empty())
 	{
 		StackNode stackNode = st.top();
 		st.pop();
+		arena.release(stackNode.arenaTop);
+		const int* indices = arena.data(stackNode.first);
+
+		// the spheres of a lazy leaf wait for the first ray reaching it
+		if(stackNode.depth >= context.lazyDepth && stackNode.count > lazyMinSpheres)
+		{
+			subtree.lazyIndices.insert(subtree.lazyIndices.end(), indices, indices + stackNode.count);
+			subtree.lazyStarts.push_back(subtree.lazyIndices.size());
+			subtree.lazyBoxes.push_back(stackNode.bbox);
+			subtree.lazyDepths.push_back(stackNode.depth);
+			initLeafNode(subtree.nodes, stackNode.nodeIdx, subtree.lazyBoxes.size() - 1, lazyLeafCount);
+			subtree.depth = max(subtree.depth, stackNode.depth);
+			continue;
+		}
+
+		SAHCost sahCost;
+		sahCost.splitAxis = AXIS_NONE;
+		if(stackNode.depth < context.maxDepth && stackNode.count > 1 && context.nodesCount < maxNodes)
+		{
+			sahCost = chooseSplittingAxis(context, stackNode, indices);
+		}
 
-		if(stackNode.sphereIndices.size() <= maxSpheresInLeaf || nodes.size() >= maxNodes)
+		// split only when it is cheaper than intersecting all spheres in a leaf
+		float leafCost = sahParams.intersectionCost * stackNode.count;
+		if(sahCost.splitAxis == AXIS_NONE || sahCost.cost >= leafCost)
 		{
-			leavesChildren.push_back(stackNode.sphereIndices);
-			initLeafNode(stackNode.nodeIdx, leavesChildren.size() - 1);
-			++leaves;
+			subtree.leafIndices.insert(subtree.leafIndices.end(), indices, indices + stackNode.count);
+			subtree.leafStarts.push_back(subtree.leafIndices.size());
+			subtree.leafBounds.push_back(clippedBounds(context.spheres, stackNode, indices, context.boundsPadding));
+			initLeafNode(subtree.nodes, stackNode.nodeIdx, subtree.leaves, stackNode.count);
+			++subtree.leaves;
+			subtree.depth = max(subtree.depth, stackNode.depth);
 			continue;
 		}
 
-		axis = axis % 3;
-		float leftLimit = stackNode.bbox.vmin[axis];
-		float rightLimit = stackNode.bbox.vmax[axis];
+		// cut the empty slabs off with empty leaves, the rest is binned again inside its smaller box
+		StackNode rest = stackNode;
+		const BoundingBox& bounds = sahCost.bounds;
+		while(rest.depth < context.maxDepth && context.nodesCount < maxNodes)
+		{
+			int cutAxis = AXIS_NONE;
+			bool cutBelow = false;
+			float widest = emptyCutRatio;
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				float extent = rest.bbox.vmax[axis] - rest.bbox.vmin[axis];
+				if(extent <= 0.f || bounds.vmin[axis] > bounds.vmax[axis])
+				{
+					continue;
+				}
+				float below = (bounds.vmin[axis] - rest.bbox.vmin[axis]) / extent;
+				float above = (rest.bbox.vmax[axis] - bounds.vmax[axis]) / extent;
+				if(below >= widest)
+				{
+					widest = below;
+					cutAxis = axis;
+					cutBelow = true;
+				}
+				if(above >= widest)
+				{
+					widest = above;
+					cutAxis = axis;
+					cutBelow = false;
+				}
+			}
+			if(cutAxis == AXIS_NONE)
+			{
+				break;
+			}
+
+			// every sphere starts at or after a cut below it and ends at or before a cut above it,
+			// so all of them stay in the other child
+			Axis axis = static_cast<Axis>(cutAxis);
+			float cutPos = cutBelow ? bounds.vmin[axis] : bounds.vmax[axis];
+			unsigned firstChildIdx = subtree.nodes.size();
+			subtree.nodes.resize(firstChildIdx + 2);
+			context.nodesCount += 2;
+			initInnerNode(subtree.nodes, rest.nodeIdx, axis, cutPos, firstChildIdx);
+
+			subtree.leafStarts.push_back(subtree.leafIndices.size());
+			subtree.leafBounds.push_back(emptyBounds());
+			initLeafNode(subtree.nodes, firstChildIdx + (cutBelow ? 0 : 1), subtree.leaves, 0);
+			++subtree.leaves;
+
+			BoundingBox left, right;
+			rest.bbox.split(axis, cutPos, left, right);
+			rest.bbox = cutBelow ? right : left;
+			rest.nodeIdx = firstChildIdx + (cutBelow ? 1 : 0);
+			++rest.depth;
+			subtree.depth = max(subtree.depth, rest.depth);
+		}
+		if(rest.nodeIdx != stackNode.nodeIdx)
+		{
+			st.push(rest);
+			continue;
+		}
 
-		float splitPos = (leftLimit + rightLimit) * 0.5f; // TODO use SAH
+		Axis splitAxis = sahCost.splitAxis;
+		float splitPos = sahCost.splitPos;
 
-		Axis splitAxis = static_cast<Axis>(axis);
+		StackNode children[2];
+		subtree.nodes.push_back(KDNode());
+		children[0].nodeIdx = subtree.nodes.size() - 1;
+		subtree.nodes.push_back(KDNode());
+		children[1].nodeIdx = subtree.nodes.size() - 1;
+		context.nodesCount += 2;
+		children[0].depth = children[1].depth = stackNode.depth + 1;
 
-		StackNode child1StackNode, child2StackNode;
-		nodes.push_back(KDNode());
-		child1StackNode.nodeIdx = nodes.size() - 1;
-		nodes.push_back(KDNode());
-		child2StackNode.nodeIdx = nodes.size() - 1;
+		stackNode.bbox.split(splitAxis, splitPos, children[0].bbox, children[1].bbox);
+		partitionSpheres(context, arena, stackNode, splitAxis, splitPos, children[0], children[1]);
 
-		stackNode.bbox.split(splitAxis, splitPos, child1StackNode.bbox, child2StackNode.bbox);
+		initInnerNode(subtree.nodes, stackNode.nodeIdx, splitAxis, splitPos, children[0].nodeIdx);
 
-		for(int i = 0; i < stackNode.sphereIndices.size(); ++i)
+		for(int i = 1; i >= 0; --i)
 		{
-			if(spheres.centerCoords[axis][stackNode.sphereIndices[i]] < splitPos)
+			if(children[i].count < parallelBuildThreshold || !context.pool || context.pool->size() == 1)
 			{
-				child1StackNode.sphereIndices.push_back(stackNode.sphereIndices[i]);
+				st.push(children[i]);
+				continue;
 			}
-			else
+
+			// the task copies its indices into its own arena, this one keeps allocating meanwhile
+			PendingSubtree* task = new PendingSubtree(children[i].count, context.memory);
+			task->slotIdx = children[i].nodeIdx;
+			task->root = children[i];
+			task->root.first = task->arena.allocate(children[i].count);
+			task->root.arenaTop = task->arena.top();
+			const int* childIndices = arena.data(children[i].first);
+			std::copy(childIndices, childIndices + children[i].count, task->arena.data(task->root.first));
+			pending.push_back(unique_ptr<PendingSubtree>(task));
+			group->run([this, &context, task]()
 			{
-				child2StackNode.sphereIndices.push_back(stackNode.sphereIndices[i]);
-			}
+				buildSubtree(context, task->arena, task->root, task->subtree);
+			});
 		}
-		initInnerNode(stackNode.nodeIdx, splitAxis, splitPos, child1StackNode.nodeIdx);
-		st.push(child2StackNode);
-		st.push(child1StackNode);
+	}
 
-		axis += 1;
+	if(group)
+	{
+		group->wait();
+	}
+	for(auto& task : pending)
+	{
+		spliceSubtree(subtree, task->slotIdx, task->subtree);
 	}
 }
 
+void KDTree::build(Spheres&& spheres, ThreadPool& pool)
+{
+	unique_ptr<Spheres> owned(new Spheres(std::move(spheres)));
+	build(SpheresView(*owned), pool);
+	ownedSpheres = std::move(owned);
+}
+
+void KDTree::build(const SpheresView& spheres, ThreadPool& pool)
+{
+	ownedSpheres.reset();
+	mappedFile.reset();
+	this->spheres = spheres;
+	removedSpheres.assign(spheres.count, 0);
+	buildSpheres(nullptr, spheres.count, createBoundingBox(spheres, pool), &pool);
+}
 
-void BoundingBox::intersectRay(const Ray& ray, float& tnear, float& tfar) const
+void KDTree::update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool)
 {
-	Vec3 invDir;
-	invDir.vec = 1.f / ray.direction.vec;
-	// TODO write it SIMD
-	float t1 = (vmin.x - ray.origin.x) * invDir.x;
-	float t2 = (vmax.x - ray.origin.x) * invDir.x;
-	float t3 = (vmin.y - ray.origin.y) * invDir.y;
-	float t4 = (vmax.y - ray.origin.y) * invDir.y;
-	float t5 = (vmin.z - ray.origin.z) * invDir.z;
-	float t6 = (vmax.z - ray.origin.z) * invDir.z;
+	// a loaded tree keeps its mapping while the spheres or the nodes are still read from it
+	bool mappedNodes = nodes.data() != nodesStorage.data();
+	if(spheres.radiuses != this->spheres.radiuses)
+	{
+		ownedSpheres.reset();
+		if(!mappedNodes)
+		{
+			mappedFile.reset();
+		}
+	}
+	this->spheres = spheres;
+
+	// spheres past the old ones are not in the tree until they are inserted
+	removedSpheres.resize(spheres.count, 1);
+	for(int sphereIdx : changes.inserted)
+	{
+		if(sphereIdx >= 0 && sphereIdx < spheres.count)
+		{
+			removedSpheres[sphereIdx] = 0;
+		}
+	}
+	for(int sphereIdx : changes.removed)
+	{
+		if(sphereIdx >= 0 && sphereIdx < spheres.count)
+		{
+			removedSpheres[sphereIdx] = 1;
+		}
+	}
+
+	if(!mappedNodes && rebuildChanged(changes, pool))
+	{
+		return;
+	}
 
-	tnear = max(max(min(t1, t2), min(t3, t4)), min(t5, t6));
-	tfar = min(min(max(t1, t2), max(t3, t4)), max(t6, t6));
+	// the tree is built again over the spheres that are left
+	mappedFile.reset();
+	vector<int> ids;
+	BoundingBox bbox;
+	bbox.vmin = Vec3(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
+	bbox.vmax = Vec3(numeric_limits<float>::lowest(), numeric_limits<float>::lowest(), numeric_limits<float>::lowest());
+	for(int sphereIdx = 0; sphereIdx < spheres.count; ++sphereIdx)
+	{
+		if(!removedSpheres[sphereIdx])
+		{
+			ids.push_back(sphereIdx);
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				bbox.vmin[axis] = min(bbox.vmin[axis], spheres.centerCoords[axis][sphereIdx] - spheres.radiuses[sphereIdx]);
+				bbox.vmax[axis] = max(bbox.vmax[axis], spheres.centerCoords[axis][sphereIdx] + spheres.radiuses[sphereIdx]);
+			}
+		}
+	}
+	buildSpheres(ids.data(), ids.size(), bbox, &pool);
 }
 
-IntersectionData KDTree::intersectRay(const Ray& ray) const
+void KDTree::buildSpheres(const int* ids, int count, const BoundingBox& bbox, ThreadPool* pool)
 {
-	IntersectionData data;
-	Ray rayCpy = ray;
-	rayCpy.direction = normalize(rayCpy.direction);
+	sceneBBox = bbox;
+	resetUpdateLinks();
 
-	TraversalNode node;
-	node.tnear = 0.f;
-	node.tfar = std::numeric_limits<float>::max();
+	BuildContext context(spheres, pool);
+	initBuildContext(context, count);
 
-	sceneBBox.intersectRay(rayCpy, node.tnear, node.tfar);
+	KDSubtree tree;
+	{
+		// room for the right children copied along the deepest path before the arena grows
+		IndexArena arena(2 * static_cast<size_t>(count), context.memory);
 
-	if(node.tnear > node.tfar)
+		StackNode root;
+		root.bbox = sceneBBox;
+		root.nodeIdx = 0;
+		root.depth = 0;
+		root.count = count;
+		root.first = arena.allocate(count);
+		root.arenaTop = arena.top();
+		if(ids)
+		{
+			std::copy(ids, ids + count, arena.data(root.first));
+		}
+		else
+		{
+			iota(arena.data(root.first), arena.data(root.first) + count, 0);
+		}
+
+		buildSubtree(context, arena, root, tree);
+	}
+	buildMemoryPeak = context.memory.peak + tree.nodes.capacity() * sizeof(KDNode) +
+			tree.leafIndices.capacity() * sizeof(int) + tree.leafStarts.capacity() * sizeof(unsigned) +
+			tree.leafBounds.capacity() * sizeof(BoundingBox) + tree.lazyIndices.capacity() * sizeof(int);
+
+	lazyNodes.clear();
+	for(size_t i = 0; i < tree.lazyBoxes.size(); ++i)
 	{
-		data.intersection = false;
-		return data;
+		LazyNode* lazy = new LazyNode();
+		lazy->bbox = tree.lazyBoxes[i];
+		lazy->depth = tree.lazyDepths[i];
+		lazy->sphereIds.assign(tree.lazyIndices.begin() + tree.lazyStarts[i], tree.lazyIndices.begin() + tree.lazyStarts[i + 1]);
+		lazyNodes.push_back(unique_ptr<LazyNode>(lazy));
 	}
+	tree.lazyIndices = vector<int>();
 
-	data.intersection = false;
-	stack<TraversalNode> st;
+	leafDataStorage.clear();
+	leafSphereIdsStorage.clear();
+	leafBoundsStorage.clear();
+	compactLeaves(tree, pool);
+	nodesStorage = std::move(tree.nodes);
+	leaves = tree.leaves;
+	depth = tree.depth;
+	useStorage();
+}
 
-	float invRayDir[3] = { 1.f / ray.direction[0], 1.f / ray.direction[1], 1.f / ray.direction[3] };
+void KDTree::initBuildContext(BuildContext& context, int count) const
+{
+	context.maxDepth = sahParams.maxDepth;
+	if(context.maxDepth <= 0)
+	{
+		context.maxDepth = static_cast<int>(8 + 1.3f * std::log2(max(count, 1)));
+	}
+	context.maxDepth = min(context.maxDepth, static_cast<int>(maxTreeDepth));
+	context.lazyDepth = sahParams.lazyLevels > 0 ? sahParams.lazyLevels : numeric_limits<int>::max();
+	// a few ulps of the largest coordinate in the scene
+	float scale = 0.f;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		scale = max(scale, max(std::abs(sceneBBox.vmin[axis]), std::abs(sceneBBox.vmax[axis])));
+	}
+	context.boundsPadding = 1e-5f * scale;
+}
 
-	node.nodeIdx = 0; // root
-	while(1)
+bool KDTree::rebuildChanged(const SphereUpdate& changes, ThreadPool& pool)
+{
+	if(!lazyNodes.empty())
 	{
-		while(!isLeaf(node.nodeIdx))
+		return false;
+	}
+
+	vector<int> changed;
+	for(const vector<int>* list : { &changes.moved, &changes.inserted, &changes.removed })
+	{
+		for(int sphereIdx : *list)
 		{
-			Axis axis = static_cast<Axis>(splittingAxis(node.nodeIdx));
-			float tsplit = (nodes[node.nodeIdx].inner.splitCoord - ray.origin[axis]) * invRayDir[axis];
-			if(tsplit <= node.tnear)
+			if(sphereIdx >= 0 && sphereIdx < spheres.count)
 			{
-				node.nodeIdx = rightChild(node.nodeIdx);
+				changed.push_back(sphereIdx);
 			}
-			else if(tsplit >= node.tfar)
-			{
-				node.nodeIdx = leftChild(node.nodeIdx);
-			}
-			else
-			{
-				TraversalNode traversalNode;
-				traversalNode.nodeIdx = rightChild(node.nodeIdx);
-				traversalNode.tnear = tsplit;
-				traversalNode.tfar = node.tfar;
-				st.push(traversalNode);
+		}
+	}
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+	// past a quarter of the spheres a full build is cheaper
+	if(4 * changed.size() > static_cast<size_t>(spheres.count))
+	{
+		return false;
+	}
+	if(nodeParents.empty())
+	{
+		linkNodes();
+	}
+	sphereBounds.resize(max(static_cast<int>(sphereBounds.size()), spheres.count), emptyBounds());
+
+	// every leaf reached by the old or the new bounds of a changed sphere is built again,
+	// the new bounds list the leaves the sphere goes to. The scene box only grows, so the
+	// regions of the leaves keep holding their spheres.
+	vector<unsigned> changedLeaves;
+	vector<std::pair<unsigned, int>> additions;
+	vector<unsigned> reached;
+	for(int sphereIdx : changed)
+	{
+		BoundingBox& bounds = sphereBounds[sphereIdx];
+		if(bounds.vmin[0] <= bounds.vmax[0])
+		{
+			findLeaves(bounds, changedLeaves);
+		}
+		bounds = emptyBounds();
+		if(removedSpheres[sphereIdx])
+		{
+			continue;
+		}
+
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			bounds.vmin[axis] = spheres.centerCoords[axis][sphereIdx] - spheres.radiuses[sphereIdx];
+			bounds.vmax[axis] = spheres.centerCoords[axis][sphereIdx] + spheres.radiuses[sphereIdx];
+			sceneBBox.vmin[axis] = min(sceneBBox.vmin[axis], bounds.vmin[axis]);
+			sceneBBox.vmax[axis] = max(sceneBBox.vmax[axis], bounds.vmax[axis]);
+		}
+		reached.clear();
+		findLeaves(bounds, reached);
+		for(unsigned leafIdx : reached)
+		{
+			additions.push_back(std::make_pair(leafIdx, sphereIdx));
+			changedLeaves.push_back(leafIdx);
+		}
+	}
+	std::sort(changedLeaves.begin(), changedLeaves.end());
+	changedLeaves.erase(std::unique(changedLeaves.begin(), changedLeaves.end()), changedLeaves.end());
+	std::sort(additions.begin(), additions.end());
 
-				node.nodeIdx = leftChild(node.nodeIdx);
+	// a leaf keeps the spheres that did not change and gets the changed ones reaching it
+	vector<vector<int>> leafIds(changedLeaves.size());
+	auto added = additions.begin();
+	for(size_t i = 0; i < changedLeaves.size(); ++i)
+	{
+		unsigned leafIdx = changedLeaves[i];
+		int count = leafSpheresCount(leafIdx);
+		const int* ids = leafSpheres(leafIdx);
+		for(int j = 0; j < count; ++j)
+		{
+			if(!std::binary_search(changed.begin(), changed.end(), ids[j]))
+			{
+				leafIds[i].push_back(ids[j]);
 			}
 		}
+		for(; added != additions.end() && added->first == leafIdx; ++added)
+		{
+			leafIds[i].push_back(added->second);
+		}
+		garbageBlocks += (count + leafBlockWidth - 1) / leafBlockWidth;
+		--leaves;
+	}
 
-		unsigned idx = leafChildrenIdx(node.nodeIdx);
-		data = Intersection::intersectRaySpheres(ray, leavesChildren[idx], spheres);
-		if(data.intersection)
+	BuildContext context(spheres, &pool);
+	initBuildContext(context, spheres.count);
+	context.nodesCount = nodes.size();
+	vector<KDSubtree> rebuilt(changedLeaves.size());
+	pool.parallelFor(changedLeaves.size(), 64, [&](int from, int to)
+	{
+		for(int i = from; i < to; ++i)
 		{
-			return data;
+			const vector<int>& ids = leafIds[i];
+			IndexArena arena(2 * ids.size(), context.memory);
+			StackNode root;
+			root.bbox = nodeBox(changedLeaves[i]);
+			root.nodeIdx = 0;
+			root.depth = nodeDepths[changedLeaves[i]];
+			root.count = ids.size();
+			root.first = arena.allocate(ids.size());
+			root.arenaTop = arena.top();
+			std::copy(ids.begin(), ids.end(), arena.data(root.first));
+			buildSubtree(context, arena, root, rebuilt[i]);
 		}
+	});
+
+	// the leaves turn into the roots of their new subtrees, the other nodes and the leaf
+	// blocks are appended the way the builder splices its subtrees
+	KDSubtree tree;
+	tree.nodes = std::move(nodesStorage);
+	tree.depth = depth;
+	for(size_t i = 0; i < rebuilt.size(); ++i)
+	{
+		// the leaf nodes point at their blocks already, splicing must not offset them
+		compactLeaves(rebuilt[i], &pool);
+		leaves += rebuilt[i].leaves;
+		rebuilt[i].leaves = 0;
+		spliceSubtree(tree, changedLeaves[i], rebuilt[i]);
+	}
+	nodesStorage = std::move(tree.nodes);
+	depth = tree.depth;
+	useStorage();
+	for(unsigned leafIdx : changedLeaves)
+	{
+		linkSubtree(leafIdx);
+	}
 
-		if(st.empty())
+	// dropped leaf blocks and leaves split by the rebuilds pile up, build again once
+	// they outweigh the tree
+	size_t blocksCount = leafBounds.size();
+	return 2 * garbageBlocks <= blocksCount && nodes.size() <= 2 * linkedNodes;
+}
+
+void KDTree::resetUpdateLinks()
+{
+	nodeParents = vector<unsigned>();
+	nodeDepths = vector<int>();
+	sphereBounds = vector<BoundingBox>();
+	linkedNodes = 0;
+	garbageBlocks = 0;
+}
+
+void KDTree::linkNodes()
+{
+	nodeParents.assign(nodes.size(), 0);
+	nodeDepths.assign(nodes.size(), 0);
+	linkedNodes = nodes.size();
+	linkSubtree(0);
+
+	// the leaf blocks hold the spheres as they were placed
+	sphereBounds.assign(spheres.count, emptyBounds());
+	for(unsigned nodeIdx = 0; nodeIdx < nodes.size(); ++nodeIdx)
+	{
+		if(!isLeaf(nodeIdx))
 		{
-			data.intersection = false;
-			return data;
+			continue;
+		}
+		const float* blocks = leafBlocks(nodeIdx);
+		const int* ids = leafSpheres(nodeIdx);
+		for(int i = 0; i < leafSpheresCount(nodeIdx); ++i)
+		{
+			const float* block = blocks + (i / leafBlockWidth) * 4 * leafBlockWidth;
+			int lane = i % leafBlockWidth;
+			float radius = block[3 * leafBlockWidth + lane];
+			BoundingBox& bounds = sphereBounds[ids[i]];
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				bounds.vmin[axis] = block[axis * leafBlockWidth + lane] - radius;
+				bounds.vmax[axis] = block[axis * leafBlockWidth + lane] + radius;
+			}
 		}
+	}
+}
 
-		node = st.top();
+void KDTree::linkSubtree(unsigned nodeIdx)
+{
+	nodeParents.resize(nodes.size());
+	nodeDepths.resize(nodes.size());
+	stack<unsigned> st;
+	st.push(nodeIdx);
+	while(!st.empty())
+	{
+		unsigned parentIdx = st.top();
 		st.pop();
+		if(isLeaf(parentIdx))
+		{
+			continue;
+		}
+		for(unsigned childIdx : { leftChild(parentIdx), rightChild(parentIdx) })
+		{
+			nodeParents[childIdx] = parentIdx;
+			nodeDepths[childIdx] = nodeDepths[parentIdx] + 1;
+			st.push(childIdx);
+		}
+	}
+}
+
+void KDTree::findLeaves(const BoundingBox& bounds, vector<unsigned>& leavesFound) const
+{
+	// inclusive at the planes, a superset of the children the builder puts the spheres in
+	stack<unsigned> st;
+	st.push(0);
+	while(!st.empty())
+	{
+		unsigned nodeIdx = st.top();
+		st.pop();
+		if(isLeaf(nodeIdx))
+		{
+			leavesFound.push_back(nodeIdx);
+			continue;
+		}
+		Axis axis = static_cast<Axis>(nodes[nodeIdx].inner.flagDimAndOffset & 0x3);
+		float splitPos = nodes[nodeIdx].inner.splitCoord;
+		if(bounds.vmin[axis] <= splitPos)
+		{
+			st.push(leftChild(nodeIdx));
+		}
+		if(bounds.vmax[axis] >= splitPos)
+		{
+			st.push(rightChild(nodeIdx));
+		}
+	}
+}
+
+BoundingBox KDTree::nodeBox(unsigned nodeIdx) const
+{
+	unsigned path[maxTreeDepth + 1];
+	int pathLength = 0;
+	for(unsigned idx = nodeIdx; idx != 0; idx = nodeParents[idx])
+	{
+		path[pathLength++] = idx;
+	}
+
+	BoundingBox box = sceneBBox;
+	unsigned parentIdx = 0;
+	while(pathLength > 0)
+	{
+		unsigned childIdx = path[--pathLength];
+		Axis axis = static_cast<Axis>(nodes[parentIdx].inner.flagDimAndOffset & 0x3);
+		BoundingBox left, right;
+		box.split(axis, nodes[parentIdx].inner.splitCoord, left, right);
+		box = childIdx == leftChild(parentIdx) ? left : right;
+		parentIdx = childIdx;
+	}
+	return box;
+}
+
+const KDTree& KDTree::lazySubtree(unsigned leafIdx) const
+{
+	LazyNode& lazy = *lazyNodes[leafChildrenIdx(leafIdx)];
+	const KDTree* tree = lazy.tree.load(std::memory_order_acquire);
+	if(tree)
+	{
+		return *tree;
+	}
+
+	lock_guard<mutex> lock(lazy.mutex);
+	tree = lazy.tree.load(std::memory_order_relaxed);
+	if(!tree)
+	{
+		// built on the querying thread alone, the threads of the pool may be waiting here
+		lazy.ownedTree.reset(new KDTree(sahParams));
+		lazy.ownedTree->spheres = spheres;
+		lazy.ownedTree->buildSpheres(lazy.sphereIds.data(), lazy.sphereIds.size(), lazy.bbox, nullptr);
+		tree = lazy.ownedTree.get();
+		lazy.tree.store(tree, std::memory_order_release);
+	}
+	return *tree;
+}
+
+void KDTree::useStorage()
+{
+	nodes = ArrayView<KDNode>(nodesStorage.data(), nodesStorage.size());
+	leafData = ArrayView<float>(leafDataStorage.data(), leafDataStorage.size());
+	leafSphereIds = ArrayView<int>(leafSphereIdsStorage.data(), leafSphereIdsStorage.size());
+	leafBounds = ArrayView<BoundingBox>(leafBoundsStorage.data(), leafBoundsStorage.size());
+}
+
+size_t KDTree::getMemoryUsage() const
+{
+	size_t bytes = nodes.size() * sizeof(KDNode) + leafData.size() * sizeof(float) +
+			leafSphereIds.size() * sizeof(int) + leafBounds.size() * sizeof(BoundingBox);
+	if(ownedSpheres)
+	{
+		bytes += 4 * ownedSpheres->radiuses.capacity() * sizeof(float);
+	}
+	bytes += nodeParents.capacity() * sizeof(unsigned) + nodeDepths.capacity() * sizeof(int) +
+			sphereBounds.capacity() * sizeof(BoundingBox);
+	for(auto& lazy : lazyNodes)
+	{
+		bytes += lazy->sphereIds.capacity() * sizeof(int);
+		const KDTree* tree = lazy->tree.load(std::memory_order_acquire);
+		if(tree)
+		{
+			bytes += tree->getMemoryUsage();
+		}
+	}
+	return bytes;
+}
+
+int KDTree::getSize() const
+{
+	int size = nodes.size();
+	for(auto& lazy : lazyNodes)
+	{
+		const KDTree* tree = lazy->tree.load(std::memory_order_acquire);
+		if(tree)
+		{
+			size += tree->getSize();
+		}
+	}
+	return size;
+}
+
+int KDTree::getLeaves() const
+{
+	int leavesCount = leaves;
+	for(auto& lazy : lazyNodes)
+	{
+		const KDTree* tree = lazy->tree.load(std::memory_order_acquire);
+		if(tree)
+		{
+			leavesCount += tree->getLeaves();
+		}
+	}
+	return leavesCount;
+}
+
+int KDTree::getDepth() const
+{
+	int deepest = depth;
+	for(auto& lazy : lazyNodes)
+	{
+		const KDTree* tree = lazy->tree.load(std::memory_order_acquire);
+		if(tree)
+		{
+			deepest = max(deepest, lazy->depth + tree->getDepth());
+		}
+	}
+	return deepest;
+}
+
+void KDTree::compactLeaves(KDSubtree& tree, ThreadPool* pool)
+{
+	STATS_TIMER(PHASE_COMPACTION);
+	leafBlockWidth = Intersection::leafKernelWidth();
+	const int blockSize = 4 * leafBlockWidth;
+
+	// the blocks go after the ones already stored
+	const vector<unsigned>& leafStarts = tree.leafStarts;
+	int leavesCount = tree.leaves;
+	vector<unsigned> firstBlock(leavesCount + 1, leafBoundsStorage.size());
+	for(int i = 0; i < leavesCount; ++i)
+	{
+		unsigned blocks = (leafStarts[i + 1] - leafStarts[i] + leafBlockWidth - 1) / leafBlockWidth;
+		firstBlock[i + 1] = firstBlock[i] + blocks;
+	}
+
+	unsigned blocksCount = firstBlock.back();
+	leafDataStorage.resize(static_cast<size_t>(blocksCount) * blockSize, numeric_limits<float>::quiet_NaN());
+	leafSphereIdsStorage.resize(static_cast<size_t>(blocksCount) * leafBlockWidth, -1);
+	leafBoundsStorage.resize(blocksCount);
+
+	auto fillLeaves = [&](int from, int to)
+	{
+		for(int leaf = from; leaf < to; ++leaf)
+		{
+			const int* sphereIndices = tree.leafIndices.data() + leafStarts[leaf];
+			unsigned spheresCount = leafStarts[leaf + 1] - leafStarts[leaf];
+			float* blocks = leafDataStorage.data() + static_cast<size_t>(firstBlock[leaf]) * blockSize;
+			int* ids = leafSphereIdsStorage.data() + static_cast<size_t>(firstBlock[leaf]) * leafBlockWidth;
+			std::fill(leafBoundsStorage.begin() + firstBlock[leaf], leafBoundsStorage.begin() + firstBlock[leaf + 1],
+					tree.leafBounds[leaf]);
+
+			for(unsigned i = 0; i < spheresCount; ++i)
+			{
+				int idx = sphereIndices[i];
+				float* block = blocks + (i / leafBlockWidth) * blockSize;
+				int lane = i % leafBlockWidth;
+
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					block[axis * leafBlockWidth + lane] = spheres.centerCoords[axis][idx];
+				}
+				block[3 * leafBlockWidth + lane] = spheres.radiuses[idx];
+				ids[i] = idx;
+			}
+		}
+	};
+	if(pool)
+	{
+		pool->parallelFor(leavesCount, 1024, fillLeaves);
+	}
+	else
+	{
+		fillLeaves(0, leavesCount);
+	}
+	tree.leafIndices = vector<int>();
+	tree.leafStarts = vector<unsigned>();
+	tree.leafBounds = vector<BoundingBox>();
+
+	const unsigned leafFlag = static_cast<unsigned>(1 << 31);
+	for(auto& node : tree.nodes)
+	{
+		if((node.leaf.flagAndOffset & leafFlag) && node.leaf.spheresCount != lazyLeafCount)
+		{
+			node.leaf.flagAndOffset = leafFlag | firstBlock[node.leaf.flagAndOffset & ~leafFlag];
+		}
+	}
+}
+
+
+RayData::RayData(const Ray& ray) : ray(ray), octant(0)
+{
+	this->ray.direction = normalize(ray.direction);
+	invDirection.vec = 1.f / this->ray.direction.vec;
+	// the sign bit also covers -0, whose inverse is -inf
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		octant |= std::signbit(this->ray.direction[axis]) << axis;
+	}
+}
+
+IntersectionData KDTree::intersectRay(const Ray& ray) const
+{
+	IntersectionData data;
+	traverse<QUERY_CLOSEST>(RayData(ray), data, nullptr);
+	return data;
+}
+
+void KDTree::intersectRay(const Ray& ray, HitRecord& hit) const
+{
+	traverse<QUERY_CLOSEST>(RayData(ray), hit, &hit);
+}
+
+bool KDTree::isOccluded(const Ray& ray, float maxDistance) const
+{
+	RayData rayData(ray);
+	rayData.ray.tmax = min(ray.tmax, maxDistance);
+
+	IntersectionData unused;
+	return traverse<QUERY_ANY>(rayData, unused, nullptr);
+}
+
+int KDTree::countHits(const Ray& ray) const
+{
+	IntersectionData unused;
+	return traverse<QUERY_COUNT>(RayData(ray), unused, nullptr);
+}
+
+void KDTree::intersectRays(const Ray* rays, int count, IntersectionData* results) const
+{
+	for(int first = 0; first < count; first += binnedRays)
+	{
+		int batch = min(static_cast<int>(binnedRays), count - first);
+		RayData rayData[binnedRays];
+		for(int i = 0; i < batch; ++i)
+		{
+			rayData[i] = RayData(rays[first + i]);
+		}
+
+		IntersectionData* batchResults = results + first;
+		traverseBinned<QUERY_CLOSEST>(rayData, batch, [batchResults](int i, int, const IntersectionData& closest)
+		{
+			batchResults[i] = closest;
+		});
+	}
+}
+
+void KDTree::occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const
+{
+	for(int first = 0; first < count; first += binnedRays)
+	{
+		int batch = min(static_cast<int>(binnedRays), count - first);
+		RayData rayData[binnedRays];
+		for(int i = 0; i < batch; ++i)
+		{
+			rayData[i] = RayData(rays[first + i]);
+			rayData[i].ray.tmax = min(rays[first + i].tmax, maxDistance);
+		}
+
+		traverseBinned<QUERY_ANY>(rayData, batch, [first, occluded](int i, int hits, const IntersectionData&)
+		{
+			int rayIdx = first + i;
+			occluded[rayIdx / 64] |= static_cast<uint64_t>(hits != 0) << (rayIdx % 64);
+		});
+	}
+}
+
+template<QueryType query, typename Store>
+void KDTree::traverseBinned(const RayData* rayData, int count, Store store) const
+{
+	// counting sort of the ray indices by octant
+	int binStart[9] = { 0 };
+	for(int i = 0; i < count; ++i)
+	{
+		++binStart[rayData[i].octant + 1];
+	}
+	for(int octant = 0; octant < 8; ++octant)
+	{
+		binStart[octant + 1] += binStart[octant];
+	}
+
+	int order[binnedRays];
+	int binEnd[8];
+	std::copy(binStart, binStart + 8, binEnd);
+	for(int i = 0; i < count; ++i)
+	{
+		order[binEnd[rayData[i].octant]++] = i;
+	}
+
+	traverseBin<0, query>(rayData, order, binStart[0], binStart[1], store);
+	traverseBin<1, query>(rayData, order, binStart[1], binStart[2], store);
+	traverseBin<2, query>(rayData, order, binStart[2], binStart[3], store);
+	traverseBin<3, query>(rayData, order, binStart[3], binStart[4], store);
+	traverseBin<4, query>(rayData, order, binStart[4], binStart[5], store);
+	traverseBin<5, query>(rayData, order, binStart[5], binStart[6], store);
+	traverseBin<6, query>(rayData, order, binStart[6], binStart[7], store);
+	traverseBin<7, query>(rayData, order, binStart[7], binStart[8], store);
+}
+
+template<int octant, QueryType query, typename Store>
+void KDTree::traverseBin(const RayData* rayData, const int* order, int from, int to, Store& store) const
+{
+	for(int i = from; i < to; ++i)
+	{
+		STATS_BEGIN_RAY();
+		IntersectionData closest;
+		int hits = traverse<octant, query>(rayData[order[i]], closest, nullptr);
+		STATS_END_RAY();
+		store(order[i], hits, closest);
+	}
+}
+
+template<QueryType query>
+int KDTree::traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const
+{
+	switch(rayData.octant)
+	{
+	case 0: return traverse<0, query>(rayData, closest, record);
+	case 1: return traverse<1, query>(rayData, closest, record);
+	case 2: return traverse<2, query>(rayData, closest, record);
+	case 3: return traverse<3, query>(rayData, closest, record);
+	case 4: return traverse<4, query>(rayData, closest, record);
+	case 5: return traverse<5, query>(rayData, closest, record);
+	case 6: return traverse<6, query>(rayData, closest, record);
+	default: return traverse<7, query>(rayData, closest, record);
+	}
+}
+
+template<int octant, QueryType query>
+int KDTree::traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const
+{
+	closest.intersection = false;
+	closest.sphereIndex = -1;
+
+	// tmax of the copy shrinks to the closest hit found so far
+	Ray ray = rayData.ray;
+
+	TraversalNode node;
+	node.tnear = ray.tmin;
+	node.tfar = ray.tmax;
+	clipRay<octant>(sceneBBox, rayData, node.tnear, node.tfar);
+
+	if(node.tnear > node.tfar)
+	{
+		return 0;
+	}
+
+	// a node is pushed at most once per level, the builder and the loader keep the depth in bounds
+	assert(depth <= maxTreeDepth);
+	TraversalNode st[maxTreeDepth + 1];
+	int stackSize = 0;
+
+	int hits = 0;
+	unsigned hitLeaf = 0;
+	int hitSlot = -1;
+
+	node.nodeIdx = 0; // root
+	while(1)
+	{
+		while(!isLeaf(node.nodeIdx))
+		{
+			STATS_ADD(INNER_NODES, 1);
+			int axis = splittingAxis(node.nodeIdx);
+			float tsplit = (nodes[node.nodeIdx].inner.splitCoord - ray.origin[axis]) * rayData.invDirection[axis];
+			// rays going in the negative direction along the axis meet the right child first
+			unsigned negative = (octant >> axis) & 1;
+			unsigned nearChild = leftChild(node.nodeIdx) + negative;
+			unsigned farChild = leftChild(node.nodeIdx) + (negative ^ 1);
+
+			if(tsplit <= node.tnear)
+			{
+				node.nodeIdx = farChild;
+			}
+			else if(tsplit >= node.tfar)
+			{
+				node.nodeIdx = nearChild;
+			}
+			else
+			{
+				st[stackSize].nodeIdx = farChild;
+				st[stackSize].tnear = tsplit;
+				st[stackSize].tfar = node.tfar;
+				++stackSize;
+				STATS_MAX(STACK_DEPTH, stackSize);
+
+				node.nodeIdx = nearChild;
+				node.tfar = tsplit;
+			}
+		}
+
+		if(isLazyLeaf(node.nodeIdx))
+		{
+			// the subtree covers the box of the leaf, so its leaves split the interval of the leaf
+			RayData subtreeRay = rayData;
+			subtreeRay.ray.tmax = query == QUERY_COUNT ? node.tfar : ray.tmax;
+			IntersectionData subtreeHit;
+			int subtreeHits = lazySubtree(node.nodeIdx).traverse<octant, query>(subtreeRay, subtreeHit, record);
+			if(query == QUERY_ANY && subtreeHits)
+			{
+				return 1;
+			}
+			else if(query == QUERY_COUNT)
+			{
+				hits += subtreeHits;
+			}
+			else if(subtreeHits)
+			{
+				// the subtree filled the record, the hit already has its global sphere index
+				closest = subtreeHit;
+				hits = 1;
+				hitSlot = -1;
+				ray.tmax = subtreeHit.tIntersection;
+				if(record)
+				{
+					record->sphereIndex = subtreeHit.sphereIndex;
+				}
+			}
+		}
+		else if(enterLeaf<octant>(node, rayData, ray.tmax))
+		{
+			int spheresCount = leafSpheresCount(node.nodeIdx);
+			const float* blocks = leafBlocks(node.nodeIdx);
+			STATS_ADD(LEAVES, 1);
+			STATS_ADD(SPHERES_TESTED, spheresCount);
+			STATS_ADD(WASTED_LANES, (leafBlockWidth - spheresCount % leafBlockWidth) % leafBlockWidth);
+
+			if(query == QUERY_ANY)
+			{
+				if(Intersection::occludedRaySpheres(ray, blocks, spheresCount))
+				{
+					return 1;
+				}
+			}
+			else if(query == QUERY_COUNT)
+			{
+				// only hits inside this leaf count, spheres in several leaves are counted once
+				Ray leafRay = ray;
+				leafRay.tmax = node.tfar;
+				hits += Intersection::countRaySpheres(leafRay, blocks, spheresCount, node.tnear);
+			}
+			else
+			{
+				IntersectionData leafHit = Intersection::intersectRaySpheres(ray, blocks, spheresCount);
+				if(leafHit.intersection)
+				{
+					// later leaves only need to look for something closer
+					closest = leafHit;
+					hits = 1;
+					hitLeaf = node.nodeIdx;
+					hitSlot = leafHit.sphereIndex;
+					ray.tmax = leafHit.tIntersection;
+				}
+			}
+		}
+
+		if(query == QUERY_CLOSEST)
+		{
+			// nodes are visited front to back, nothing left on the stack starts before tfar
+			if(hits && closest.tIntersection <= node.tfar)
+			{
+				break;
+			}
+
+			// skip subtrees starting behind the closest hit so far
+			while(stackSize > 0 && st[stackSize - 1].tnear > ray.tmax)
+			{
+				--stackSize;
+			}
+		}
+
+		if(stackSize == 0)
+		{
+			break;
+		}
+
+		node = st[--stackSize];
+	}
+
+	// hits from lazy subtrees are complete already
+	if(query == QUERY_CLOSEST && hits && hitSlot >= 0)
+	{
+		if(record)
+		{
+			record->tIntersection = closest.tIntersection;
+			record->sphereIndex = hitSlot;
+			Intersection::hitGeometry(ray, leafBlocks(hitLeaf), *record);
+		}
+		closest.sphereIndex = leafSpheres(hitLeaf)[hitSlot];
+	}
+	return hits;
+}
+
+template<int N>
+void KDTree::intersectPacket(const Ray* rays, int count, IntersectionData* results) const
+{
+	// packets wider than the vectors of the CPU are traced as several narrower ones,
+	// the leaf kernel width is the widest vector it runs natively
+	int width = min(N, Intersection::leafKernelWidth());
+	for(int first = 0; first < count; first += width)
+	{
+		int packetCount = min(width, count - first);
+		switch(width)
+		{
+		case 16: tracePacketAVX512(rays + first, packetCount, results + first); break;
+		case 8: tracePacketAVX2(rays + first, packetCount, results + first); break;
+		default: tracePacket<4>(rays + first, packetCount, results + first); break;
+		}
+	}
+}
+
+__attribute__ ((target("avx2,fma")))
+void KDTree::tracePacketAVX2(const Ray* rays, int count, IntersectionData* results) const
+{
+	tracePacket<8>(rays, count, results);
+}
+
+__attribute__ ((target("avx512f")))
+void KDTree::tracePacketAVX512(const Ray* rays, int count, IntersectionData* results) const
+{
+	tracePacket<16>(rays, count, results);
+}
+
+/**
+ * Calls nothing returning a wide vector, min and max are written out, so the width
+ * specific variants are compiled for their own instructions only
+ * */
+template<int N>
+void KDTree::tracePacket(const Ray* rays, int count, IntersectionData* results) const
+{
+	typedef typename RayPacket<N>::FloatN FloatN;
+	typedef typename RayPacket<N>::MaskN MaskN;
+
+	struct PacketTraversalNode
+	{
+		FloatN tnear, tfar;
+		unsigned nodeIdx;
+	};
+
+	RayPacket<N> packet;
+	packet.load(rays, count);
+
+	int signs[3];
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		signs[axis] = packet.directionSign(axis);
+		if(signs[axis] < 0)
+		{
+			for(int i = 0; i < count; ++i)
+			{
+				results[i] = intersectRay(rays[i]);
+			}
+			return;
+		}
+	}
+
+	FloatN tnear = packet.tmin;
+	FloatN tfar = packet.tmax;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		FloatN t1 = (sceneBBox.vmin[axis] - packet.origin[axis]) * packet.invDirection[axis];
+		FloatN t2 = (sceneBBox.vmax[axis] - packet.origin[axis]) * packet.invDirection[axis];
+		FloatN entry = t1 < t2 ? t1 : t2;
+		FloatN exit = t1 > t2 ? t1 : t2;
+		tnear = tnear > entry ? tnear : entry;
+		tfar = tfar < exit ? tfar : exit;
+	}
+
+	FloatN tHit = packet.tmax;
+	MaskN hit = MaskN{};
+	MaskN hitSphere = MaskN{} - 1;
+	MaskN active = packet.active & (tnear <= tfar);
+
+	assert(depth <= maxTreeDepth);
+	PacketTraversalNode st[maxTreeDepth + 1];
+	int stackSize = 0;
+	unsigned nodeIdx = 0; // root
+
+	while(anyLane(active))
+	{
+		while(!isLeaf(nodeIdx))
+		{
+			STATS_ADD(INNER_NODES, 1);
+			int axis = splittingAxis(nodeIdx);
+			FloatN tsplit = (nodes[nodeIdx].inner.splitCoord - packet.origin[axis]) * packet.invDirection[axis];
+
+			unsigned nearChild = signs[axis] ? rightChild(nodeIdx) : leftChild(nodeIdx);
+			unsigned farChild = signs[axis] ? leftChild(nodeIdx) : rightChild(nodeIdx);
+
+			MaskN inRange = active & (tnear <= tfar);
+			if(!anyLane(inRange & (tsplit > tnear)))
+			{
+				nodeIdx = farChild;
+			}
+			else if(!anyLane(inRange & (tsplit < tfar)))
+			{
+				nodeIdx = nearChild;
+			}
+			else
+			{
+				st[stackSize].nodeIdx = farChild;
+				st[stackSize].tnear = tsplit > tnear ? tsplit : tnear;
+				st[stackSize].tfar = tfar;
+				++stackSize;
+				STATS_MAX(STACK_DEPTH, stackSize);
+
+				tfar = tsplit < tfar ? tsplit : tfar;
+				nodeIdx = nearChild;
+			}
+		}
+
+		MaskN inRange = active & (tnear <= tfar);
+		if(anyLane(inRange))
+		{
+			if(isLazyLeaf(nodeIdx))
+			{
+				// lazy subtrees trace the lanes one at a time
+				const KDTree& subtree = lazySubtree(nodeIdx);
+				for(int i = 0; i < N; ++i)
+				{
+					if(!inRange[i])
+					{
+						continue;
+					}
+					Ray ray = rays[i < count ? i : 0];
+					ray.tmax = tHit[i];
+					IntersectionData laneHit = subtree.intersectRay(ray);
+					if(laneHit.intersection)
+					{
+						tHit[i] = laneHit.tIntersection;
+						hitSphere[i] = laneHit.sphereIndex;
+						hit[i] = -1;
+					}
+				}
+			}
+			else if(leafSpheresCount(nodeIdx) > 0)
+			{
+				// lanes missing the bounds of the spheres skip the leaf
+				const BoundingBox& bounds = leafBox(nodeIdx);
+				FloatN boundsNear = tnear;
+				FloatN boundsFar = tfar < tHit ? tfar : tHit;
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					FloatN t1 = (bounds.vmin[axis] - packet.origin[axis]) * packet.invDirection[axis];
+					FloatN t2 = (bounds.vmax[axis] - packet.origin[axis]) * packet.invDirection[axis];
+					FloatN entry = t1 < t2 ? t1 : t2;
+					FloatN exit = t1 > t2 ? t1 : t2;
+					boundsNear = boundsNear > entry ? boundsNear : entry;
+					boundsFar = boundsFar < exit ? boundsFar : exit;
+				}
+				inRange &= boundsNear <= boundsFar;
+
+				const float* blocks = leafBlocks(nodeIdx);
+				const int* sphereIds = leafSpheres(nodeIdx);
+				int spheresCount = anyLane(inRange) ? leafSpheresCount(nodeIdx) : 0;
+				int blocksCount = (spheresCount + leafBlockWidth - 1) / leafBlockWidth;
+
+				int activeLanes = 0;
+				for(int i = 0; i < N; ++i)
+				{
+					activeLanes += inRange[i] != 0;
+				}
+				STATS_ADD(LEAVES, activeLanes > 0);
+				STATS_ADD(SPHERES_TESTED, spheresCount * activeLanes);
+				STATS_ADD(WASTED_LANES, spheresCount * (N - activeLanes));
+
+				// every sphere of a block is broadcast to the packet lanes, the padding
+				// of the last block is skipped
+				for(int blockIdx = 0; blockIdx < blocksCount; ++blockIdx)
+				{
+					const float* block = blocks + blockIdx * 4 * leafBlockWidth;
+					const int* blockIds = sphereIds + blockIdx * leafBlockWidth;
+					int slots = min(leafBlockWidth, spheresCount - blockIdx * leafBlockWidth);
+					for(int slot = 0; slot < slots; ++slot)
+					{
+						float radius = block[3 * leafBlockWidth + slot];
+						FloatN oc[3], b = FloatN{};
+						for(int axis = 0; axis < 3; ++axis)
+						{
+							oc[axis] = packet.origin[axis] - block[axis * leafBlockWidth + slot];
+							b += oc[axis] * packet.direction[axis];
+						}
+
+						// same form as the leaf kernels, r^2 - |oc - b * d|^2
+						FloatN discriminant = FloatN{} + radius * radius;
+						for(int axis = 0; axis < 3; ++axis)
+						{
+							FloatN f = oc[axis] - b * packet.direction[axis];
+							discriminant -= f * f;
+						}
+						MaskN valid = inRange & (discriminant >= 0.f);
+						if(!anyLane(valid))
+						{
+							continue;
+						}
+
+						FloatN squareRoot = valid ? discriminant : FloatN{};
+						sqrtLanes(squareRoot);
+						FloatN t1 = -b - squareRoot;
+						FloatN t2 = -b + squareRoot;
+						FloatN t = t1 > packet.tmin ? t1 : t2;
+
+						MaskN closer = valid & (t > packet.tmin) & (t < tHit);
+						tHit = closer ? t : tHit;
+						hitSphere = closer ? (MaskN{} + blockIds[slot]) : hitSphere;
+						hit |= closer;
+					}
+				}
+			}
+
+			// lanes with a hit before the end of this leaf are done
+			active &= ~(hit & (tHit <= tfar));
+		}
+
+		if(stackSize == 0)
+		{
+			break;
+		}
+
+		--stackSize;
+		nodeIdx = st[stackSize].nodeIdx;
+		tnear = st[stackSize].tnear;
+		tfar = st[stackSize].tfar < tHit ? st[stackSize].tfar : tHit;
+	}
+
+	for(int i = 0; i < count; ++i)
+	{
+		results[i].intersection = hit[i] != 0;
+		results[i].tIntersection = tHit[i];
+		results[i].sphereIndex = hitSphere[i];
 	}
 }
 
+template void KDTree::intersectPacket<4>(const Ray* rays, int count, IntersectionData* results) const;
+template void KDTree::intersectPacket<8>(const Ray* rays, int count, IntersectionData* results) const;
+template void KDTree::intersectPacket<16>(const Ray* rays, int count, IntersectionData* results) const;
@@ -3,17 +3,48 @@
 
 #include "Common.h"
 #include "Vec3.h"
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include "IndexArena.h"
+#include "MappedFile.h"
+#include "Accelerator.h"
 #include <limits>
 #include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
 
 using std::vector;
 using std::unique_ptr;
 
+/**
+ * Non-owning array. The tree reads its arrays through views, so they can
+ * live either in vectors filled by the builder or in a mapped tree file.
+ * */
+template<class T>
+class ArrayView
+{
+public:
+	ArrayView() : ptr(nullptr), count(0) {}
+	ArrayView(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+
+	const T& operator[](size_t i) const { return ptr[i]; }
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+
+private:
+	const T* ptr;
+	size_t count;
+};
+
 struct KDLeaf
 {
 	unsigned flagAndOffset;
+	unsigned spheresCount;
 	/**
-	 * bits 0..30 Children index in leavesChildren
+	 * bits 0..30 first block of the leaf in leafData
+	 * (index of the leaf in the subtree until the leaves are compacted)
 	 * bit 31 flag whether the node is leaf
 	 * */
 };
@@ -35,14 +66,6 @@ union KDNode
 	KDLeaf leaf;
 };
 
-enum Axis
-{
-	AXIS_X = 0,
-	AXIS_Y = 1,
-	AXIS_Z = 2,
-	AXIS_NONE,
-};
-
 enum SpherePosition
 {
 	LEFT,
@@ -55,61 +78,223 @@ struct SAHCost
 	float cost;
 	Axis splitAxis;
 	float splitPos;
+	/**
+	 * Bounds of the spheres of the node clipped to it, found while binning
+	 * */
+	BoundingBox bounds;
 };
 
-struct TraversalNode
-{
-	float tnear, tfar;
-	unsigned nodeIdx;
-};
-
-struct BoundingBox
+struct SAHParams
 {
-	BoundingBox()
+	SAHParams()
 	{
-		float min = std::numeric_limits<float>::lowest();
-		float max = std::numeric_limits<float>::max();
-		vmin = Vec3(min, min, min);
-		vmax = Vec3(max, max, max);
+		traversalCost = 4.f;
+		intersectionCost = 1.f;
+		maxDepth = 0;
+		lazyLevels = 0;
 	}
 
-	void split(Axis axis, float where, BoundingBox& left, BoundingBox& right) const
-	{
-		left = *this;
-		right = *this;
-		left.vmax[axis] = where;
-		right.vmin[axis] = where;
-
-	}
-
-	bool inBoundingBox(float coord, Axis axis) const
-	{
-		return vmin[axis] <= coord && vmax[axis] >= coord;
-	}
-
-	void intersectRay(const Ray& ray, float& tnear, float& tfar) const;
+	float traversalCost;
+	float intersectionCost;
+	/**
+	 * 0 means the depth limit is derived from the number of spheres
+	 * */
+	int maxDepth;
+	/**
+	 * Levels built at once by a lazy build, 0 builds the whole tree. Deeper nodes with
+	 * many spheres keep them until the first ray reaches them, then their subtree is
+	 * built the same way.
+	 * */
+	int lazyLevels;
+};
 
-	Vec3 vmin;
-	Vec3 vmax;
+struct TraversalNode
+{
+	float tnear, tfar;
+	unsigned nodeIdx;
 };
 
 struct StackNode
 {
 	int nodeIdx;
+	int depth;
 	BoundingBox bbox;
-	vector<int> sphereIndices;
+	/**
+	 * The sphere indices of the node are count ints at first in the arena of the builder,
+	 * arenaTop is the top of the arena to restore when the node is taken from the stack
+	 * */
+	size_t first;
+	unsigned count;
+	size_t arenaTop;
 };
 
-class KDTree
+struct KDSubtree
+{
+	KDSubtree() : leafStarts(1, 0), lazyStarts(1, 0), leaves(0), depth(0) {}
+
+	vector<KDNode> nodes;
+	/**
+	 * Sphere indices of all leaves one after another,
+	 * leaf i owns [leafStarts[i], leafStarts[i + 1])
+	 * */
+	vector<int> leafIndices;
+	vector<unsigned> leafStarts;
+	/**
+	 * Bounds of the spheres of every leaf clipped to the leaf, inverted for empty leaves
+	 * */
+	vector<BoundingBox> leafBounds;
+	/**
+	 * Sphere indices, boxes and depths of the nodes left for a lazy build, laid out like the leaves
+	 * */
+	vector<int> lazyIndices;
+	vector<unsigned> lazyStarts;
+	vector<BoundingBox> lazyBoxes;
+	vector<int> lazyDepths;
+	int leaves;
+	int depth;
+};
+
+class KDTree : public Accelerator
 {
 public:
-	void build(const Spheres& spheres);
+	explicit KDTree(const SAHParams& params = SAHParams()) : sahParams(params), leafBlockWidth(0),
+			linkedNodes(0), garbageBlocks(0), leaves(0), buildMemoryPeak(0), depth(0) {}
+
+	KDTree(const KDTree&) = delete;
+	KDTree& operator=(const KDTree&) = delete;
+	KDTree(KDTree&&) = default;
+	KDTree& operator=(KDTree&&) = default;
+
+	/**
+	 * The tree keeps only a view of the spheres, they must outlive it.
+	 * Pass the spheres by rvalue to let the tree own them.
+	 * */
+	void build(const SpheresView& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+	void build(Spheres&& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+
+	/**
+	 * Closest hit in (ray.tmin, ray.tmax), the record variant also
+	 * computes the hit point and the normal
+	 * */
+	IntersectionData intersectRay(const Ray& ray) const override;
+	void intersectRay(const Ray& ray, HitRecord& hit) const override;
+
+	/**
+	 * Whether any sphere is hit in (ray.tmin, min(ray.tmax, maxDistance)) along the
+	 * normalized ray direction. Stops at the first hit instead of finding the closest one.
+	 * */
+	bool isOccluded(const Ray& ray, float maxDistance) const override;
+
+	/**
+	 * Number of spheres hit in (ray.tmin, ray.tmax)
+	 * */
+	int countHits(const Ray& ray) const override;
+
+	/**
+	 * Batch variants, the rays are binned by direction octant and every bin runs
+	 * the traversal specialized for it. Occlusion sets bit i % 64 of occluded[i / 64]
+	 * for every occluded ray and leaves the other bits untouched.
+	 * */
+	void intersectRays(const Ray* rays, int count, IntersectionData* results) const override;
+	void occludedRays(const Ray* rays, int count, float maxDistance, uint64_t* occluded) const override;
+
+	/**
+	 * Traverses up to N rays together, instantiated for N = 4, 8 and 16. The 8 and 16 wide
+	 * packets run with AVX2 and AVX-512 when the CPU has them and as narrower packets otherwise.
+	 * Falls back to single ray traversal when the direction signs of the rays differ.
+	 * */
+	template<int N>
+	void intersectPacket(const Ray* rays, int count, IntersectionData* results) const;
 
-	IntersectionData intersectRay(const Ray& ray) const;
+	/**
+	 * Builds only the leaves reached by the old or the new bounds of a changed sphere
+	 * again, as subtrees over their regions spliced in their place. The scene box grows
+	 * to cover moved and inserted spheres. Lazy and mapped trees, updates changing more
+	 * than a quarter of the spheres and trees whose dropped leaf blocks outweigh the live
+	 * ones or whose nodes doubled since the first update are built again over the spheres left.
+	 * */
+	void update(const SpheresView& spheres, const SphereUpdate& changes, ThreadPool& pool) override;
+
+	/**
+	 * The statistics of a lazy tree cover the levels built by build and the subtrees
+	 * built since, leaves not built yet are not counted
+	 * */
+	int getSize() const override;
+	int getLeaves() const override;
+	int getDepth() const override;
+	const BoundingBox& getBoundingBox() const override { return sceneBBox; }
+	const char* getName() const override { return "kdtree"; }
+
+	/**
+	 * Bytes held by the tree, including the spheres when the tree owns them
+	 * */
+	size_t getMemoryUsage() const override;
+
+	/**
+	 * Most bytes the last build held at once in its index arenas,
+	 * plus the node and leaf index arrays it produced
+	 * */
+	size_t getBuildMemoryPeak() const override { return buildMemoryPeak; }
 
-	int getSize()const { return nodes.size(); }
-	int getLeaves()const { return leaves; }
+	/**
+	 * Writes the tree and the spheres to a versioned binary file. load maps such a file
+	 * and uses the arrays in place, the spheres are referenced from the mapping too.
+	 * When the file was written for another leaf kernel width only the leaf blocks
+	 * are rebuilt from the mapped sphere indices. Both return false on any error,
+	 * save also for lazy trees, load for files of another version or byte order.
+	 * A loaded tree counts the spheres no leaf references as removed.
+	 * */
+	bool save(const char* path) const;
+	bool load(const char* path, ThreadPool& pool = ThreadPool::defaultPool());
 private:
+	struct BuildContext;
+	struct LazyNode;
+
+	static const int sahBins = 32;
+	static const int maxNodes = 6000000;
+	static const int maxTreeDepth = 64;
+	/**
+	 * Subtrees with at least that many spheres are built as separate tasks,
+	 * nodes with at least parallelSplitThreshold spheres are binned and partitioned in parallel
+	 * */
+	static const int parallelBuildThreshold = 4096;
+	static const int parallelSplitThreshold = 1 << 16;
+	/**
+	 * Lazy builds finish nodes with fewer spheres at once. Leaves whose subtree is not
+	 * built yet have lazyLeafCount spheres and the index of their LazyNode as offset.
+	 * */
+	static const unsigned lazyMinSpheres = 1024;
+	static const unsigned lazyLeafCount = 0xFFFFFFFF;
+	/**
+	 * An empty slab of at least this part of the node extent is cut off with an empty leaf
+	 * before the SAH split, so rays cross it in one step
+	 * */
+	static constexpr float emptyCutRatio = 0.15f;
+
+	/**
+	 * Per axis histograms of the bins where the sphere bounds, clipped to the node,
+	 * start and end. A sphere straddling a plane counts on both sides of it.
+	 * */
+	struct SAHBins
+	{
+		SAHBins() : starts(), ends()
+		{
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				lower[axis] = std::numeric_limits<float>::max();
+				upper[axis] = std::numeric_limits<float>::lowest();
+			}
+		}
+
+		unsigned starts[3][sahBins];
+		unsigned ends[3][sahBins];
+		/**
+		 * Sphere bounds clipped to the node
+		 * */
+		float lower[3];
+		float upper[3];
+	};
+
 	inline bool isLeaf(const unsigned nodeIdx) const
 	{
 		return nodes[nodeIdx].inner.flagDimAndOffset & static_cast<unsigned>(1 << 31);
@@ -127,11 +312,115 @@ private:
 		return res;
 	}
 
+	/**
+	 * Spheres of a leaf in blocks of leafBlockWidth, every block holds
+	 * the x, y, z and radius arrays one after another, the tail is padded with NaN
+	 * */
+	inline const float* leafBlocks(unsigned leafIdx) const
+	{
+		return leafData.data() + leafChildrenIdx(leafIdx) * 4 * leafBlockWidth;
+	}
+
+	inline const int* leafSpheres(unsigned leafIdx) const
+	{
+		return leafSphereIds.data() + leafChildrenIdx(leafIdx) * leafBlockWidth;
+	}
+
+	inline int leafSpheresCount(unsigned leafIdx) const
+	{
+		return nodes[leafIdx].leaf.spheresCount;
+	}
+
+	/**
+	 * Tight bounds of a leaf with spheres, stored with its first block
+	 * */
+	inline const BoundingBox& leafBox(unsigned leafIdx) const
+	{
+		return leafBounds[leafChildrenIdx(leafIdx)];
+	}
+
+	/**
+	 * Clips [tnear, tfar] to the part of the ray inside the box
+	 * */
+	template<int octant>
+	static inline void clipRay(const BoundingBox& box, const RayData& rayData, float& tnear, float& tfar)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			bool negative = (octant >> axis) & 1;
+			float nearPlane = negative ? box.vmax[axis] : box.vmin[axis];
+			float farPlane = negative ? box.vmin[axis] : box.vmax[axis];
+			tnear = std::max(tnear, (nearPlane - rayData.ray.origin[axis]) * rayData.invDirection[axis]);
+			tfar = std::min(tfar, (farPlane - rayData.ray.origin[axis]) * rayData.invDirection[axis]);
+		}
+	}
+
+	inline bool isLazyLeaf(unsigned leafIdx) const
+	{
+		return nodes[leafIdx].leaf.spheresCount == lazyLeafCount;
+	}
+
+	/**
+	 * Whether the part of the ray in the leaf node up to tmax meets the bounds of its spheres
+	 * */
+	template<int octant>
+	inline bool enterLeaf(const TraversalNode& node, const RayData& rayData, float tmax) const
+	{
+		if(leafSpheresCount(node.nodeIdx) == 0)
+		{
+			return false;
+		}
+		float tnear = node.tnear;
+		float tfar = std::min(node.tfar, tmax);
+		clipRay<octant>(leafBox(node.nodeIdx), rayData, tnear, tfar);
+		return tnear <= tfar;
+	}
+
+	/**
+	 * Builds the subtree of a lazy leaf the first time it is asked for, threads asking
+	 * meanwhile wait for it
+	 * */
+	const KDTree& lazySubtree(unsigned leafIdx) const;
+
+	/**
+	 * Packet traversal for any width, inlined into the variants compiled for the vector
+	 * instructions of that width
+	 * */
+	template<int N>
+	__attribute__ ((always_inline)) inline void tracePacket(const Ray* rays, int count,
+			IntersectionData* results) const;
+	void tracePacketAVX2(const Ray* rays, int count, IntersectionData* results) const;
+	void tracePacketAVX512(const Ray* rays, int count, IntersectionData* results) const;
+
 	inline int splittingAxis(const unsigned nodeIdx) const
 	{
 		return nodes[nodeIdx].inner.flagDimAndOffset & 0x3;
 	}
 
+	/**
+	 * Traversal specialized for the octant of the ray and the query type. Returns whether
+	 * a hit was found, or the number of hits for QUERY_COUNT. The closest hit is stored
+	 * with its global sphere index, record gets its point and normal when not null.
+	 * */
+	template<int octant, QueryType query>
+	int traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const;
+	template<QueryType query>
+	int traverse(const RayData& rayData, IntersectionData& closest, HitRecord* record) const;
+
+	/**
+	 * Runs the specialized traversal over rays binned by octant, store(i, hits, closest)
+	 * receives the result of ray i
+	 * */
+	template<QueryType query, typename Store>
+	void traverseBinned(const RayData* rayData, int count, Store store) const;
+	template<int octant, QueryType query, typename Store>
+	void traverseBin(const RayData* rayData, const int* order, int from, int to, Store& store) const;
+
+	/**
+	 * Rays binned together by the batch queries
+	 * */
+	static const int binnedRays = 256;
+
 	unsigned leftChild(const unsigned nodeIdx) const;
 	unsigned rightChild(const unsigned nodeIdx) const;
 
@@ -140,26 +429,135 @@ private:
 	float surfaceAreaHeuristic(const BoundingBox& bbox, Axis axis, float spiltPoint,
 			unsigned spheresLeft, unsigned spheresRight) const;
 
-	BoundingBox createBoundingBox(const Spheres& spheres) const;
-	SAHCost chooseSplittingAxis(const Spheres& spheres, const BoundingBox& bbox) const;
-	void spheresCount(const Spheres &spheres, Axis axis, const float from, const float to, unsigned& count) const;
-	void minSAHCost(const Spheres& spheres, const BoundingBox& bbox, Axis axis, SAHCost& sahCost) const;
+	BoundingBox createBoundingBox(const SpheresView& spheres, ThreadPool& pool) const;
+	SAHCost chooseSplittingAxis(BuildContext& context, const StackNode& node, const int* indices) const;
+	void binSpheres(const SpheresView& spheres, const StackNode& node, const int* indices, int from, int to,
+			SAHBins& bins) const;
+	void minSAHCost(const StackNode& node, Axis axis, const SAHBins& bins, SAHCost& sahCost) const;
+	/**
+	 * Inverted box of the empty leaves, no ray enters it
+	 * */
+	static BoundingBox emptyBounds();
+	/**
+	 * Bounds of the spheres of the node clipped to its box and grown by padding
+	 * */
+	BoundingBox clippedBounds(const SpheresView& spheres, const StackNode& node, const int* indices,
+			float padding) const;
+	SpherePosition classifySphere(const SpheresView& spheres, int sphereIdx, Axis axis, float splitPos,
+			const StackNode& left, const StackNode& right) const;
 
-	void initInnerNode(unsigned nodeIdx, Axis axis, float splitPos, unsigned firstChiledIdx);
-	void initLeafNode(unsigned nodeIdx, unsigned dataIdx);
+	/**
+	 * Reorders the indices of the node in place into left only, straddling and right only spheres.
+	 * The left child keeps the first two groups in place, the right child gets the last two,
+	 * in place when nothing straddles and copied to the top of the arena otherwise.
+	 * */
+	void partitionSpheres(BuildContext& context, IndexArena& arena, const StackNode& node, Axis axis,
+			float splitPos, StackNode& left, StackNode& right) const;
 
-	void findMinMax(const Spheres& spheres, Axis axis, float& min, float& max) const;
+	void buildSubtree(BuildContext& context, IndexArena& arena, const StackNode& root, KDSubtree& subtree) const;
+	static void spliceSubtree(KDSubtree& parent, unsigned slotIdx, KDSubtree& child);
 
-	static const int maxSpheresInLeaf = 24;
-	static const int maxNodes = 6000000;
+	static void initInnerNode(vector<KDNode>& nodes, unsigned nodeIdx, Axis axis, float splitPos,
+			unsigned firstChildIdx);
+	static void initLeafNode(vector<KDNode>& nodes, unsigned nodeIdx, unsigned dataIdx, unsigned spheresCount);
 
-	vector<KDNode> nodes;
-	vector<vector<int>> leavesChildren;
-	Spheres spheres;
+	/**
+	 * Appends the leaf blocks of the subtree to the storage and points its leaf nodes at them
+	 * */
+	void compactLeaves(KDSubtree& tree, ThreadPool* pool);
+	void useStorage();
+
+	/**
+	 * Builds over the given sphere indices, over all spheres when ids is null.
+	 * Without a pool everything runs on the calling thread.
+	 * */
+	void buildSpheres(const int* ids, int count, const BoundingBox& bbox, ThreadPool* pool);
+	void initBuildContext(BuildContext& context, int count) const;
+
+	/**
+	 * Local rebuilds of update, false when the tree has to be built again instead
+	 * */
+	bool rebuildChanged(const SphereUpdate& changes, ThreadPool& pool);
+	void resetUpdateLinks();
+	/**
+	 * Fills the links of the whole tree, linkSubtree the parents and depths below nodeIdx
+	 * */
+	void linkNodes();
+	void linkSubtree(unsigned nodeIdx);
+	/**
+	 * Appends the leaves whose regions the bounds reach
+	 * */
+	void findLeaves(const BoundingBox& bounds, vector<unsigned>& leavesFound) const;
+	/**
+	 * Region of the node, the scene box cut by the split planes above it
+	 * */
+	BoundingBox nodeBox(unsigned nodeIdx) const;
+	void findMinMax(const SpheresView& spheres, Axis axis, int from, int to, float& min, float& max) const;
+
+	SAHParams sahParams;
+	ArrayView<KDNode> nodes;
+	ArrayView<float> leafData;
+	ArrayView<int> leafSphereIds;
+	/**
+	 * Leaf bounds per block of leafData, every block holds the bounds of its leaf
+	 * */
+	ArrayView<BoundingBox> leafBounds;
+	/**
+	 * Arrays of a built tree, empty when the views point into mappedFile
+	 * */
+	vector<KDNode> nodesStorage;
+	AlignedVector<float> leafDataStorage;
+	vector<int> leafSphereIdsStorage;
+	vector<BoundingBox> leafBoundsStorage;
+	unique_ptr<MappedFile> mappedFile;
+	int leafBlockWidth;
+	unique_ptr<Spheres> ownedSpheres;
+	SpheresView spheres;
+	/**
+	 * Set for the spheres removed by updates
+	 * */
+	vector<char> removedSpheres;
+	/**
+	 * Links for the updates, filled at the first update after a build or load. The root is
+	 * its own parent. sphereBounds are the bounds every sphere was placed in the leaves
+	 * with, inverted when it is in none.
+	 * */
+	vector<unsigned> nodeParents;
+	vector<int> nodeDepths;
+	vector<BoundingBox> sphereBounds;
+	/**
+	 * Nodes when the links were filled and leaf blocks dropped by the rebuilds since
+	 * */
+	size_t linkedNodes;
+	size_t garbageBlocks;
 	BoundingBox sceneBBox;
 	int leaves;
+	/**
+	 * Filled by the build, a lazy subtree is stored in its node once built
+	 * */
+	vector<unique_ptr<LazyNode>> lazyNodes;
+	size_t buildMemoryPeak;
+	/**
+	 * Depth of the deepest leaf, recorded by the builder and never more than maxTreeDepth,
+	 * which sizes the traversal stacks on the C stack so queries do not allocate
+	 * */
+	int depth;
 };
 
+/**
+ * Part of a lazy kd-tree below a lazy leaf, built over sphereIds inside bbox.
+ * tree is published once the subtree is complete, mutex serializes the build.
+ * */
+struct KDTree::LazyNode
+{
+	LazyNode() : depth(0), tree(nullptr) {}
 
+	BoundingBox bbox;
+	int depth;
+	vector<int> sphereIds;
+	std::atomic<const KDTree*> tree;
+	std::mutex mutex;
+	unique_ptr<KDTree> ownedTree;
+};
 
 #endif /* KDTREE_H_ */
@@ -0,0 +1,293 @@
+#include "KDTree.h"
+#include "Utils.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+namespace
+{
+	const char treeFileMagic[8] = { 'R', 'S', 'K', 'D', 'T', 'R', 'E', 'E' };
+	const uint32_t treeFileVersion = 2;
+
+	struct TreeFileHeader
+	{
+		char magic[8];
+		uint32_t endianTag;
+		uint32_t version;
+		uint32_t nodeSize;
+		uint32_t leafBlockWidth;
+		int32_t leaves;
+		int32_t depth;
+		float bboxMin[3];
+		float bboxMax[3];
+		uint64_t nodesCount;
+		uint64_t leafDataCount;
+		uint64_t leafSphereIdsCount;
+		uint64_t leafBoundsCount;
+		uint64_t spheresCount;
+		uint64_t nodesOffset;
+		uint64_t leafDataOffset;
+		uint64_t leafSphereIdsOffset;
+		uint64_t leafBoundsOffset;
+		uint64_t centerCoordsOffset[3];
+		uint64_t radiusesOffset;
+		uint64_t fileSize;
+	};
+
+	/**
+	 * Widest leaf block a kernel uses, wider ones are rejected before any size is computed from them
+	 * */
+	const uint32_t maxLeafBlockWidth = 64;
+
+	/**
+	 * Checks the mapped nodes and leaf blocks in one pass before the queries trust them.
+	 * Children follow their parents, so the depth of a node is known when the pass reaches it
+	 * and a node referenced twice or never means the nodes are no tree.
+	 * */
+	bool validTree(const TreeFileHeader& header, const char* base, int maxDepth)
+	{
+		const uint64_t width = header.leafBlockWidth;
+		const uint64_t blocksCount = header.leafBoundsCount;
+		if(header.leafDataCount != blocksCount * 4 * width || header.leafSphereIdsCount != blocksCount * width)
+		{
+			return false;
+		}
+
+		const KDNode* nodes = reinterpret_cast<const KDNode*>(base + header.nodesOffset);
+		const int* sphereIds = reinterpret_cast<const int*>(base + header.leafSphereIdsOffset);
+		const unsigned leafFlag = static_cast<unsigned>(1 << 31);
+		const uint64_t nodesCount = header.nodesCount;
+
+		vector<int> nodeDepth(nodesCount, -1);
+		nodeDepth[0] = 0;
+		int64_t leaves = 0;
+		for(uint64_t i = 0; i < nodesCount; ++i)
+		{
+			if(nodeDepth[i] < 0 || nodeDepth[i] > header.depth || nodeDepth[i] > maxDepth)
+			{
+				return false;
+			}
+
+			if(nodes[i].leaf.flagAndOffset & leafFlag)
+			{
+				// lazy leaves are never saved, their count fails the block range too
+				uint64_t firstBlock = nodes[i].leaf.flagAndOffset & ~leafFlag;
+				uint64_t count = nodes[i].leaf.spheresCount;
+				++leaves;
+				if(count == 0)
+				{
+					continue;
+				}
+				if(firstBlock + (count + width - 1) / width > blocksCount)
+				{
+					return false;
+				}
+				const int* ids = sphereIds + firstBlock * width;
+				for(uint64_t j = 0; j < count; ++j)
+				{
+					if(ids[j] < 0 || static_cast<uint64_t>(ids[j]) >= header.spheresCount)
+					{
+						return false;
+					}
+				}
+				continue;
+			}
+
+			unsigned flagDimAndOffset = nodes[i].inner.flagDimAndOffset;
+			unsigned offset = flagDimAndOffset & 0x7FFFFFFC;
+			uint64_t leftChild = i + offset / sizeof(KDNode);
+			if((flagDimAndOffset & 3) > AXIS_Z || offset == 0 || offset % sizeof(KDNode) != 0 ||
+					leftChild + 1 >= nodesCount || nodeDepth[leftChild] >= 0 || nodeDepth[leftChild + 1] >= 0)
+			{
+				return false;
+			}
+			nodeDepth[leftChild] = nodeDepth[leftChild + 1] = nodeDepth[i] + 1;
+		}
+		return leaves == header.leaves;
+	}
+}
+
+bool KDTree::save(const char* path) const
+{
+	// lazy leaves have no blocks to write
+	if(!lazyNodes.empty())
+	{
+		return false;
+	}
+
+	TreeFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, treeFileMagic, sizeof(treeFileMagic));
+	header.endianTag = fileEndianTag;
+	header.version = treeFileVersion;
+	header.nodeSize = sizeof(KDNode);
+	header.leafBlockWidth = leafBlockWidth;
+	header.leaves = leaves;
+	header.depth = depth;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		header.bboxMin[axis] = sceneBBox.vmin[axis];
+		header.bboxMax[axis] = sceneBBox.vmax[axis];
+	}
+	header.nodesCount = nodes.size();
+	header.leafDataCount = leafData.size();
+	header.leafSphereIdsCount = leafSphereIds.size();
+	header.leafBoundsCount = leafBounds.size();
+	header.spheresCount = spheres.count;
+
+	size_t offset = alignFileSection(sizeof(header));
+	auto section = [&offset](size_t bytes)
+	{
+		size_t start = offset;
+		offset = alignFileSection(offset + bytes);
+		return start;
+	};
+	header.nodesOffset = section(nodes.size() * sizeof(KDNode));
+	header.leafDataOffset = section(leafData.size() * sizeof(float));
+	header.leafSphereIdsOffset = section(leafSphereIds.size() * sizeof(int));
+	header.leafBoundsOffset = section(leafBounds.size() * sizeof(BoundingBox));
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		header.centerCoordsOffset[axis] = section(spheres.count * sizeof(float));
+	}
+	header.radiusesOffset = section(spheres.count * sizeof(float));
+	header.fileSize = offset;
+
+	FILE* file = fopen(path, "wb");
+	if(!file)
+	{
+		return false;
+	}
+
+	size_t position = 0;
+	size_t spheresBytes = spheres.count * sizeof(float);
+	bool written = writeFileSection(file, position, 0, &header, sizeof(header)) &&
+			writeFileSection(file, position, header.nodesOffset, nodes.data(), nodes.size() * sizeof(KDNode)) &&
+			writeFileSection(file, position, header.leafDataOffset, leafData.data(), leafData.size() * sizeof(float)) &&
+			writeFileSection(file, position, header.leafSphereIdsOffset, leafSphereIds.data(),
+					leafSphereIds.size() * sizeof(int)) &&
+			writeFileSection(file, position, header.leafBoundsOffset, leafBounds.data(),
+					leafBounds.size() * sizeof(BoundingBox)) &&
+			writeFileSection(file, position, header.centerCoordsOffset[0], spheres.centerCoords[0], spheresBytes) &&
+			writeFileSection(file, position, header.centerCoordsOffset[1], spheres.centerCoords[1], spheresBytes) &&
+			writeFileSection(file, position, header.centerCoordsOffset[2], spheres.centerCoords[2], spheresBytes) &&
+			writeFileSection(file, position, header.radiusesOffset, spheres.radiuses, spheresBytes) &&
+			writeFileSection(file, position, header.fileSize, nullptr, 0);
+
+	return fclose(file) == 0 && written;
+}
+
+bool KDTree::load(const char* path, ThreadPool& pool)
+{
+	unique_ptr<MappedFile> file(new MappedFile);
+	if(!file->open(path) || file->size() < sizeof(TreeFileHeader))
+	{
+		return false;
+	}
+
+	TreeFileHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+	if(memcmp(header.magic, treeFileMagic, sizeof(treeFileMagic)) != 0 || header.endianTag != fileEndianTag ||
+			header.version != treeFileVersion || header.nodeSize != sizeof(KDNode) ||
+			header.fileSize != file->size())
+	{
+		return false;
+	}
+
+	// the traversal stacks are sized from the depth
+	if(header.depth < 0 || header.depth > maxTreeDepth || header.leafBlockWidth == 0 ||
+			header.leafBlockWidth > maxLeafBlockWidth || header.nodesCount == 0 ||
+			header.spheresCount > static_cast<uint64_t>(std::numeric_limits<int>::max()) ||
+			!fileSectionFits(header.fileSize, header.nodesOffset, header.nodesCount, sizeof(KDNode)) ||
+			!fileSectionFits(header.fileSize, header.leafDataOffset, header.leafDataCount, sizeof(float)) ||
+			!fileSectionFits(header.fileSize, header.leafSphereIdsOffset, header.leafSphereIdsCount, sizeof(int)) ||
+			!fileSectionFits(header.fileSize, header.leafBoundsOffset, header.leafBoundsCount, sizeof(BoundingBox)) ||
+			!fileSectionFits(header.fileSize, header.radiusesOffset, header.spheresCount, sizeof(float)))
+	{
+		return false;
+	}
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		if(!fileSectionFits(header.fileSize, header.centerCoordsOffset[axis], header.spheresCount, sizeof(float)))
+		{
+			return false;
+		}
+	}
+
+	const char* base = file->data();
+	if(!validTree(header, base, maxTreeDepth))
+	{
+		return false;
+	}
+
+	ownedSpheres.reset();
+	lazyNodes.clear();
+	nodesStorage = vector<KDNode>();
+	leafDataStorage = AlignedVector<float>();
+	leafSphereIdsStorage = vector<int>();
+	leafBoundsStorage = vector<BoundingBox>();
+	resetUpdateLinks();
+
+	SpheresView view;
+	view.count = header.spheresCount;
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		view.centerCoords[axis] = reinterpret_cast<const float*>(base + header.centerCoordsOffset[axis]);
+		sceneBBox.vmin[axis] = header.bboxMin[axis];
+		sceneBBox.vmax[axis] = header.bboxMax[axis];
+	}
+	view.radiuses = reinterpret_cast<const float*>(base + header.radiusesOffset);
+	spheres = view;
+
+	leaves = header.leaves;
+	depth = header.depth;
+	buildMemoryPeak = 0;
+	nodes = ArrayView<KDNode>(reinterpret_cast<const KDNode*>(base + header.nodesOffset), header.nodesCount);
+	leafBlockWidth = header.leafBlockWidth;
+	leafData = ArrayView<float>(reinterpret_cast<const float*>(base + header.leafDataOffset), header.leafDataCount);
+	leafSphereIds = ArrayView<int>(reinterpret_cast<const int*>(base + header.leafSphereIdsOffset),
+			header.leafSphereIdsCount);
+	leafBounds = ArrayView<BoundingBox>(reinterpret_cast<const BoundingBox*>(base + header.leafBoundsOffset),
+			header.leafBoundsCount);
+
+	// the removed flags are not written, a sphere in no leaf was removed before the save
+	removedSpheres.assign(view.count, 1);
+	for(unsigned i = 0; i < nodes.size(); ++i)
+	{
+		if(isLeaf(i))
+		{
+			const int* ids = leafSpheres(i);
+			for(int j = 0; j < leafSpheresCount(i); ++j)
+			{
+				removedSpheres[ids[j]] = 0;
+			}
+		}
+	}
+
+	if(leafBlockWidth != Intersection::leafKernelWidth())
+	{
+		// written for another kernel width, gather the sphere indices of every leaf
+		// from the mapped blocks and lay the leaves out again
+		KDSubtree tree;
+		tree.nodes.assign(nodes.data(), nodes.data() + nodes.size());
+		const unsigned leafFlag = static_cast<unsigned>(1 << 31);
+		for(unsigned i = 0; i < tree.nodes.size(); ++i)
+		{
+			if(isLeaf(i))
+			{
+				const int* ids = leafSpheres(i);
+				tree.leafIndices.insert(tree.leafIndices.end(), ids, ids + leafSpheresCount(i));
+				tree.leafStarts.push_back(tree.leafIndices.size());
+				tree.leafBounds.push_back(leafSpheresCount(i) > 0 ? leafBox(i) : emptyBounds());
+				tree.nodes[i].leaf.flagAndOffset = leafFlag | tree.leaves;
+				++tree.leaves;
+			}
+		}
+		compactLeaves(tree, &pool);
+		nodesStorage = std::move(tree.nodes);
+		useStorage();
+	}
+
+	mappedFile = std::move(file);
+	return true;
+}
@@ -0,0 +1,82 @@
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* path)
+{
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	// the mapping keeps the file alive, the descriptor is not needed anymore
+	void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapping == MAP_FAILED)
+	{
+		return false;
+	}
+
+	bytes = static_cast<const char*>(mapping);
+	length = info.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if(bytes)
+	{
+		munmap(const_cast<char*>(bytes), length);
+		bytes = nullptr;
+		length = 0;
+	}
+}
+
+size_t alignFileSection(size_t offset)
+{
+	return (offset + fileSectionAlignment - 1) / fileSectionAlignment * fileSectionAlignment;
+}
+
+bool writeFileSection(FILE* file, size_t& position, size_t offset, const void* data, size_t bytes)
+{
+	static const char padding[fileSectionAlignment] = {};
+	while(position < offset)
+	{
+		size_t chunk = std::min(offset - position, fileSectionAlignment);
+		if(fwrite(padding, 1, chunk, file) != chunk)
+		{
+			return false;
+		}
+		position += chunk;
+	}
+
+	if(bytes > 0 && fwrite(data, 1, bytes, file) != bytes)
+	{
+		return false;
+	}
+	position += bytes;
+	return true;
+}
+
+bool fileSectionFits(uint64_t fileSize, uint64_t offset, uint64_t count, size_t elementSize)
+{
+	return offset % fileSectionAlignment == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+}
@@ -0,0 +1,55 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+
+/**
+ * Read only shared mapping of a whole file. Processes mapping the same file
+ * share its pages through the page cache.
+ * */
+class MappedFile
+{
+public:
+	MappedFile() : bytes(nullptr), length(0) {}
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	/**
+	 * Returns false if the file cannot be opened or mapped
+	 * */
+	bool open(const char* path);
+	void close();
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const char* bytes;
+	size_t length;
+};
+
+/**
+ * Binary files meant to be mapped start their sections at offsets aligned for the
+ * SIMD loads of the data, the mapping itself is page aligned. The byte order tag
+ * reads back as another value on a machine with a different byte order.
+ * */
+const size_t fileSectionAlignment = 64;
+const uint32_t fileEndianTag = 0x01020304;
+
+size_t alignFileSection(size_t offset);
+
+/**
+ * Pads the file with zeros from position up to offset and writes the section there
+ * */
+bool writeFileSection(FILE* file, size_t& position, size_t offset, const void* data, size_t bytes);
+
+/**
+ * Whether count elements at offset are aligned and inside a file of fileSize bytes
+ * */
+bool fileSectionFits(uint64_t fileSize, uint64_t offset, uint64_t count, size_t elementSize);
+
+#endif /* MAPPEDFILE_H_ */
@@ -0,0 +1,135 @@
+#include "RayOrder.h"
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+namespace RayOrder
+{
+	namespace
+	{
+		const int keyBitsPerDimension = 10;
+		const int mortonKeyBits = 6 * keyBitsPerDimension;
+		const int radixBits = 8;
+		const int radixBuckets = 1 << radixBits;
+
+		/**
+		 * Sorted elements per block, each block keeps its own digit histogram
+		 * */
+		const int radixBlockSize = 1 << 16;
+
+		/**
+		 * Spreads the 10 low bits of value to every 6th bit
+		 * */
+		uint64_t spreadBits(uint64_t value)
+		{
+			uint64_t result = 0;
+			for(int bit = 0; bit < keyBitsPerDimension; ++bit)
+			{
+				result |= ((value >> bit) & 1) << (6 * bit);
+			}
+			return result;
+		}
+
+		uint64_t quantize(float value, float from, float to)
+		{
+			const float cells = (1 << keyBitsPerDimension) - 1;
+			float relative = to > from ? (value - from) / (to - from) : 0.f;
+			// also maps NaN to 0
+			relative = relative > 0.f ? min(relative, 1.f) : 0.f;
+			return static_cast<uint64_t>(relative * cells);
+		}
+	}
+
+	uint64_t mortonKey(const Ray& ray, const BoundingBox& box)
+	{
+		Vec3 direction = normalize(ray.direction);
+
+		// origin bits are the more significant ones of each group
+		uint64_t key = 0;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			key |= spreadBits(quantize(ray.origin[axis], box.vmin[axis], box.vmax[axis])) << (5 - axis);
+			key |= spreadBits(quantize(direction[axis], -1.f, 1.f)) << (2 - axis);
+		}
+		return key;
+	}
+
+	void radixSort(vector<uint64_t>& keys, vector<int>& values, int keyBits, ThreadPool& pool)
+	{
+		int count = keys.size();
+		int blocks = (count + radixBlockSize - 1) / radixBlockSize;
+		vector<uint64_t> keysOut(count);
+		vector<int> valuesOut(count);
+		vector<int> offsets(blocks * radixBuckets);
+
+		for(int shift = 0; shift < keyBits; shift += radixBits)
+		{
+			pool.parallelFor(blocks, 1, [&](int from, int to)
+			{
+				for(int block = from; block < to; ++block)
+				{
+					int* histogram = &offsets[block * radixBuckets];
+					std::fill(histogram, histogram + radixBuckets, 0);
+					int end = min(count, (block + 1) * radixBlockSize);
+					for(int i = block * radixBlockSize; i < end; ++i)
+					{
+						++histogram[(keys[i] >> shift) & (radixBuckets - 1)];
+					}
+				}
+			});
+
+			// digit major, block minor prefix sums keep the sort stable
+			int total = 0;
+			bool singleDigit = false;
+			for(int digit = 0; digit < radixBuckets; ++digit)
+			{
+				int digitStart = total;
+				for(int block = 0; block < blocks; ++block)
+				{
+					int& offset = offsets[block * radixBuckets + digit];
+					int digitCount = offset;
+					offset = total;
+					total += digitCount;
+				}
+				singleDigit = singleDigit || total - digitStart == count;
+			}
+			if(singleDigit)
+			{
+				continue;
+			}
+
+			pool.parallelFor(blocks, 1, [&](int from, int to)
+			{
+				for(int block = from; block < to; ++block)
+				{
+					int* offset = &offsets[block * radixBuckets];
+					int end = min(count, (block + 1) * radixBlockSize);
+					for(int i = block * radixBlockSize; i < end; ++i)
+					{
+						int target = offset[(keys[i] >> shift) & (radixBuckets - 1)]++;
+						keysOut[target] = keys[i];
+						valuesOut[target] = values[i];
+					}
+				}
+			});
+			keys.swap(keysOut);
+			values.swap(valuesOut);
+		}
+	}
+
+	void mortonOrder(const Ray* rays, int count, const BoundingBox& box, vector<int>& order, ThreadPool& pool)
+	{
+		vector<uint64_t> keys(count);
+		order.resize(count);
+		pool.parallelFor(count, radixBlockSize, [&](int from, int to)
+		{
+			for(int i = from; i < to; ++i)
+			{
+				keys[i] = mortonKey(rays[i], box);
+				order[i] = i;
+			}
+		});
+		radixSort(keys, order, mortonKeyBits, pool);
+	}
+}
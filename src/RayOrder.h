@@ -0,0 +1,34 @@
+#ifndef RAYORDER_H_
+#define RAYORDER_H_
+
+#include <cstdint>
+#include "Common.h"
+#include "KDTree.h"
+#include "ThreadPool.h"
+
+/**
+ * Reordering of incoherent rays so that rays traced one after another start
+ * close to each other and point in similar directions, and so touch the same
+ * nodes and leaves of the tree.
+ * */
+namespace RayOrder
+{
+	/**
+	 * 60 bit key interleaving 10 bits of each origin coordinate, relative to box,
+	 * and of each direction component. Origins outside the box are clamped to it.
+	 * */
+	uint64_t mortonKey(const Ray& ray, const BoundingBox& box);
+
+	/**
+	 * Stable parallel LSD radix sort of values by the low keyBits bits of keys,
+	 * 8 bits per pass. Passes where all keys share the digit are skipped.
+	 * */
+	void radixSort(vector<uint64_t>& keys, vector<int>& values, int keyBits, ThreadPool& pool);
+
+	/**
+	 * order[i] is the input index of the i-th ray in Morton order
+	 * */
+	void mortonOrder(const Ray* rays, int count, const BoundingBox& box, vector<int>& order, ThreadPool& pool);
+}
+
+#endif /* RAYORDER_H_ */
@@ -0,0 +1,146 @@
+#ifndef RAYPACKET_H_
+#define RAYPACKET_H_
+
+#include "Common.h"
+#include <limits>
+#include <immintrin.h>
+
+template<int N>
+struct SimdVector;
+
+template<>
+struct SimdVector<4>
+{
+	typedef float FloatN __attribute__ ((vector_size(4 * sizeof(float))));
+	typedef int MaskN __attribute__ ((vector_size(4 * sizeof(int))));
+};
+
+template<>
+struct SimdVector<8>
+{
+	typedef float FloatN __attribute__ ((vector_size(8 * sizeof(float))));
+	typedef int MaskN __attribute__ ((vector_size(8 * sizeof(int))));
+};
+
+template<>
+struct SimdVector<16>
+{
+	typedef float FloatN __attribute__ ((vector_size(16 * sizeof(float))));
+	typedef int MaskN __attribute__ ((vector_size(16 * sizeof(int))));
+};
+
+/**
+ * N coherent rays in SoA form, one SIMD lane per ray. The vector width follows N,
+ * the compiler lowers it to the instructions the function using the packet targets.
+ * Wide packets belong in functions compiled for AVX2 or AVX-512, so the members are
+ * always inlined and no wide vector is returned from a function compiled without them.
+ * */
+template<int N>
+struct RayPacket
+{
+	typedef typename SimdVector<N>::FloatN FloatN;
+	typedef typename SimdVector<N>::MaskN MaskN;
+
+	static const int width = N;
+
+	/**
+	 * Loads count <= N rays, the remaining lanes stay inactive
+	 * */
+	__attribute__ ((always_inline)) void load(const Ray* rays, int count)
+	{
+		for(int i = 0; i < N; ++i)
+		{
+			const Ray& ray = rays[i < count ? i : 0];
+			Vec3 direction = normalize(ray.direction);
+			for(int j = 0; j < 3; ++j)
+			{
+				origin[j][i] = ray.origin[j];
+				this->direction[j][i] = direction[j];
+				invDirection[j][i] = 1.f / direction[j];
+			}
+			tmin[i] = ray.tmin;
+			tmax[i] = ray.tmax;
+			active[i] = i < count ? -1 : 0;
+		}
+	}
+
+	/**
+	 * Returns the sign of the direction along axis, or -1 if the lanes disagree
+	 * */
+	__attribute__ ((always_inline)) int directionSign(int axis) const
+	{
+		int negative = 0, positive = 0;
+		for(int i = 0; i < N; ++i)
+		{
+			if(!active[i])
+			{
+				continue;
+			}
+			if(direction[axis][i] < 0.f)
+			{
+				++negative;
+			}
+			else
+			{
+				++positive;
+			}
+		}
+		if(negative && positive)
+		{
+			return -1;
+		}
+		return negative ? 1 : 0;
+	}
+
+	FloatN origin[3];
+	FloatN direction[3];
+	FloatN invDirection[3];
+	FloatN tmin;
+	FloatN tmax;
+	MaskN active;
+};
+
+/**
+ * Square root of every lane in place, one overload per width compiled for its instructions
+ * */
+inline void sqrtLanes(SimdVector<4>::FloatN& values)
+{
+	values = _mm_sqrt_ps(values);
+}
+
+__attribute__ ((target("avx2")))
+inline void sqrtLanes(SimdVector<8>::FloatN& values)
+{
+	values = _mm256_sqrt_ps(values);
+}
+
+__attribute__ ((target("avx512f")))
+inline void sqrtLanes(SimdVector<16>::FloatN& values)
+{
+	values = _mm512_sqrt_ps(values);
+}
+
+template<class MaskN>
+inline bool anyLane(const MaskN& mask)
+{
+	int res = 0;
+	for(unsigned i = 0; i < sizeof(MaskN) / sizeof(int); ++i)
+	{
+		res |= mask[i];
+	}
+	return res != 0;
+}
+
+template<class VecN>
+inline VecN minLanes(const VecN& a, const VecN& b)
+{
+	return a < b ? a : b;
+}
+
+template<class VecN>
+inline VecN maxLanes(const VecN& a, const VecN& b)
+{
+	return a > b ? a : b;
+}
+
+#endif /* RAYPACKET_H_ */
@@ -1,59 +1,322 @@
 #include "RaySphereIntersect.h"
-#include "KDTree.h"
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include "Stats.h"
+#include "RayOrder.h"
 
+using std::min;
 using std::thread;
+using std::mutex;
+using std::condition_variable;
+using std::lock_guard;
+using std::unique_lock;
 
-const int predefinedNoThreads = 100000;
-const int predefined1Thread = 1000000;
+/**
+ * Multiple of the widest packet and of the 64 rays of an occlusion mask word
+ * */
+const int raysChunk = 256;
 
 
-void intersectSpheres(const Rays& rays, const KDTree& tree, int from, int count, vector<IntersectionData>& result)
+void intersectSpheres(const Rays& rays, const Accelerator& accelerator, int from, int count,
+		vector<IntersectionData>& result)
 {
+	STATS_TIMER(PHASE_QUERY);
+	accelerator.intersectRays(&rays.rays[from], count, &result[from]);
+}
+
+template<int N>
+void intersectPackets(const Rays& rays, const KDTree& tree, int from, int count, vector<IntersectionData>& result)
+{
+	STATS_TIMER(PHASE_QUERY);
 	int end = from + count;
-	for(int i = from; i < end; ++i)
+	for(int i = from; i < end; i += N)
 	{
-		result[i] = tree.intersectRay(rays.rays[i]);
+		// a packet is counted as one query
+		STATS_BEGIN_RAY();
+		tree.intersectPacket<N>(&rays.rays[i], min(N, end - i), &result[i]);
+		STATS_END_RAY();
 	}
 }
 
-void intersectRaySpheres(const Ray& ray, const Spheres& spheres, IntersectionData& data)
+SphereScene::SphereScene(const SpheresView& spheres, ThreadPool& pool, AcceleratorType type) : pool(pool),
+		kdTree(nullptr)
 {
-	KDTree tree;
-	tree.build(spheres);
+	build(spheres, type);
+}
 
-	data = tree.intersectRay(ray);
+SphereScene::SphereScene(Spheres&& spheres, ThreadPool& pool, AcceleratorType type) : pool(pool), kdTree(nullptr)
+{
+	build(std::move(spheres), type);
 }
 
-void intersectRaysSpheres(const Rays& rays, const Spheres& spheres, std::vector<IntersectionData>& intersections)
+SphereScene::SphereScene(KDTree&& tree, ThreadPool& pool) : pool(pool)
 {
-	KDTree tree;
-	tree.build(spheres);
+	KDTree* kd = new KDTree(std::move(tree));
+	accelerator.reset(kd);
+	kdTree = kd;
+}
 
-	int raysCount = rays.rays.size();
-	intersections.resize(raysCount);
+SphereScene::SphereScene(InstanceTree&& tree, ThreadPool& pool) : pool(pool), kdTree(nullptr)
+{
+	accelerator.reset(new InstanceTree(std::move(tree)));
+}
 
-	if(raysCount <= predefinedNoThreads)
+template<typename SpheresT>
+void SphereScene::build(SpheresT&& spheres, AcceleratorType type)
+{
+	if(type == ACCELERATOR_AUTO)
 	{
-		intersectSpheres(rays, tree, 0, raysCount, intersections);
+		type = chooseAccelerator(SpheresView(spheres), pool);
 	}
-	else if(raysCount <= predefined1Thread)
+
+	if(type == ACCELERATOR_BVH4)
 	{
-		int half = raysCount / 2;
-		thread th(intersectSpheres, rays, std::cref(tree), 0, half, std::ref(intersections));
-		intersectSpheres(rays, tree, half, raysCount - half, intersections);
-		th.join();
+		BVH4* bvh = new BVH4();
+		accelerator.reset(bvh);
+		bvh->build(std::forward<SpheresT>(spheres), pool);
 	}
 	else
 	{
-		int third = raysCount / 3;
-		thread t1, t2;
-		t1 = thread(intersectSpheres, rays, std::cref(tree), 0, third, std::ref(intersections));
-		t2 = thread(intersectSpheres, rays, std::cref(tree), third, third, std::ref(intersections));
-		intersectSpheres(rays, tree, 2 * third, raysCount - 2 * third, intersections);
-		t1.join();
-		t2.join();
+		KDTree* kd = new KDTree();
+		accelerator.reset(kd);
+		kdTree = kd;
+		kd->build(std::forward<SpheresT>(spheres), pool);
+	}
+}
+
+IntersectionData SphereScene::intersectRay(const Ray& ray) const
+{
+	return accelerator->intersectRay(ray);
+}
+
+void SphereScene::intersectRay(const Ray& ray, HitRecord& hit) const
+{
+	accelerator->intersectRay(ray, hit);
+}
+
+void SphereScene::intersectRays(const Rays& rays, std::vector<IntersectionData>& intersections,
+		TraversalMode mode, RayOrdering ordering) const
+{
+	if(ordering == RAYS_MORTON_ORDER)
+	{
+		int raysCount = rays.rays.size();
+		vector<int> order;
+		RayOrder::mortonOrder(rays.rays.data(), raysCount, accelerator->getBoundingBox(), order, pool);
+
+		Rays sorted;
+		sorted.rays.resize(raysCount);
+		pool.parallelFor(raysCount, 1 << 14, [&](int from, int to)
+		{
+			for(int i = from; i < to; ++i)
+			{
+				sorted.rays[i] = rays.rays[order[i]];
+			}
+		});
+
+		vector<IntersectionData> sortedIntersections;
+		intersectRays(sorted, sortedIntersections, mode);
+
+		intersections.resize(raysCount);
+		pool.parallelFor(raysCount, 1 << 14, [&](int from, int to)
+		{
+			for(int i = from; i < to; ++i)
+			{
+				intersections[order[i]] = sortedIntersections[i];
+			}
+		});
+		return;
+	}
+
+	void (*intersectPacketsN)(const Rays&, const KDTree&, int, int, vector<IntersectionData>&) = nullptr;
+	switch(kdTree ? mode : TRAVERSAL_SINGLE)
+	{
+	case TRAVERSAL_PACKET4: intersectPacketsN = intersectPackets<4>; break;
+	case TRAVERSAL_PACKET8: intersectPacketsN = intersectPackets<8>; break;
+	case TRAVERSAL_PACKET16: intersectPacketsN = intersectPackets<16>; break;
+	default: break;
+	}
+
+	int raysCount = rays.rays.size();
+	intersections.resize(raysCount);
+
+	// small chunks handed out on demand keep the threads busy when rays cost differently
+	pool.parallelFor(raysCount, raysChunk, [&](int from, int to)
+	{
+		if(intersectPacketsN)
+		{
+			intersectPacketsN(rays, *kdTree, from, to - from, intersections);
+		}
+		else
+		{
+			intersectSpheres(rays, *accelerator, from, to - from, intersections);
+		}
+	});
+}
+
+void SphereScene::intersectRays(const Rays& rays, std::vector<HitRecord>& hits) const
+{
+	int raysCount = rays.rays.size();
+	hits.resize(raysCount);
+
+	pool.parallelFor(raysCount, raysChunk, [&](int from, int to)
+	{
+		STATS_TIMER(PHASE_QUERY);
+		for(int i = from; i < to; ++i)
+		{
+			STATS_BEGIN_RAY();
+			accelerator->intersectRay(rays.rays[i], hits[i]);
+			STATS_END_RAY();
+		}
+	});
+}
+
+bool SphereScene::intersectRayStream(const RayReader& read, const IntersectionWriter& write, TraversalMode mode,
+		int chunkRays) const
+{
+	const int buffersCount = 3;
+	Rays rays[buffersCount];
+	vector<IntersectionData> intersections[buffersCount];
+
+	// chunks handed from the reader to the pool to the writer, chunk i lives in buffer i % 3,
+	// so the reader fills a buffer again only after the chunk three before it was written
+	mutex handOffMutex;
+	condition_variable handedOff;
+	int readChunks = 0, intersectedChunks = 0, writtenChunks = 0;
+	bool readEnd = false, intersectEnd = false, writeFailed = false;
+
+	thread reader([&]()
+	{
+		for(int chunk = 0; ; ++chunk)
+		{
+			{
+				unique_lock<mutex> lock(handOffMutex);
+				handedOff.wait(lock, [&] { return writeFailed || writtenChunks >= chunk - (buffersCount - 1); });
+				if(writeFailed)
+				{
+					return;
+				}
+			}
+
+			vector<Ray>& buffer = rays[chunk % buffersCount].rays;
+			buffer.resize(chunkRays);
+			int count = read(buffer.data(), chunkRays);
+			buffer.resize(std::max(count, 0));
+
+			lock_guard<mutex> lock(handOffMutex);
+			if(buffer.empty())
+			{
+				readEnd = true;
+				handedOff.notify_all();
+				return;
+			}
+			readChunks = chunk + 1;
+			handedOff.notify_all();
+		}
+	});
+
+	thread writer([&]()
+	{
+		for(int chunk = 0; ; ++chunk)
+		{
+			{
+				unique_lock<mutex> lock(handOffMutex);
+				handedOff.wait(lock, [&] { return intersectEnd || intersectedChunks > chunk; });
+				if(intersectedChunks <= chunk)
+				{
+					return;
+				}
+			}
+
+			const vector<IntersectionData>& results = intersections[chunk % buffersCount];
+			bool written = write(results.data(), results.size());
+
+			lock_guard<mutex> lock(handOffMutex);
+			writeFailed = !written;
+			writtenChunks = chunk + 1;
+			handedOff.notify_all();
+			if(!written)
+			{
+				return;
+			}
+		}
+	});
+
+	for(int chunk = 0; ; ++chunk)
+	{
+		{
+			unique_lock<mutex> lock(handOffMutex);
+			handedOff.wait(lock, [&] { return readEnd || writeFailed || readChunks > chunk; });
+			if(readChunks <= chunk || writeFailed)
+			{
+				break;
+			}
+		}
+
+		int buffer = chunk % buffersCount;
+		intersectRays(rays[buffer], intersections[buffer], mode);
+
+		lock_guard<mutex> lock(handOffMutex);
+		intersectedChunks = chunk + 1;
+		handedOff.notify_all();
 	}
 
+	{
+		lock_guard<mutex> lock(handOffMutex);
+		intersectEnd = true;
+		handedOff.notify_all();
+	}
+	reader.join();
+	writer.join();
+	return !writeFailed;
+}
 
+void SphereScene::update(const SpheresView& spheres, const SphereUpdate& changes)
+{
+	accelerator->update(spheres, changes, pool);
+}
+
+bool SphereScene::isOccluded(const Ray& ray, float maxDistance) const
+{
+	return accelerator->isOccluded(ray, maxDistance);
+}
+
+int SphereScene::countHits(const Ray& ray) const
+{
+	return accelerator->countHits(ray);
+}
+
+void SphereScene::occludedRays(const Rays& rays, float maxDistance, std::vector<uint64_t>& occluded) const
+{
+	int raysCount = rays.rays.size();
+	occluded.assign((raysCount + 63) / 64, 0);
+
+	// chunks are multiples of 64 rays so no two threads write the same word
+	pool.parallelFor(raysCount, raysChunk, [&](int from, int to)
+	{
+		STATS_TIMER(PHASE_QUERY);
+		accelerator->occludedRays(&rays.rays[from], to - from, maxDistance, &occluded[from / 64]);
+	});
+}
+
+void intersectRaySpheres(const Ray& ray, const Spheres& spheres, IntersectionData& data, ThreadPool& pool,
+		AcceleratorType type)
+{
+	SphereScene scene(SpheresView(spheres), pool, type);
+	data = scene.intersectRay(ray);
+}
+
+void intersectRaysSpheres(const Rays& rays, const Spheres& spheres, std::vector<IntersectionData>& intersections,
+		TraversalMode mode, ThreadPool& pool, RayOrdering ordering, AcceleratorType type)
+{
+	SphereScene scene(SpheresView(spheres), pool, type);
+	scene.intersectRays(rays, intersections, mode, ordering);
+}
+
+void occludedRaysSpheres(const Rays& rays, const Spheres& spheres, float maxDistance, std::vector<uint64_t>& occluded,
+		ThreadPool& pool, AcceleratorType type)
+{
+	SphereScene scene(SpheresView(spheres), pool, type);
+	scene.occludedRays(rays, maxDistance, occluded);
 }
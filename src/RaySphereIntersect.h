@@ -2,12 +2,127 @@
 #define RAYSPHEREINTERSECT_H_
 
 #include <vector>
+#include <cstdint>
+#include <functional>
 #include "Common.h"
+#include "KDTree.h"
+#include "BVH4.h"
+#include "InstanceTree.h"
 
-void intersectRaySpheres(const Ray& ray, const Spheres& spheres, IntersectionData& data);
+enum TraversalMode
+{
+	TRAVERSAL_SINGLE,
+	TRAVERSAL_PACKET4,
+	TRAVERSAL_PACKET8,
+	TRAVERSAL_PACKET16,
+};
 
-void intersectRaysSpheres(const Rays& rays, const Spheres& spheres, std::vector<IntersectionData>& intersections);
+/**
+ * Morton order sorts incoherent rays by origin and direction before tracing them,
+ * the results are still returned in input order
+ * */
+enum RayOrdering
+{
+	RAYS_INPUT_ORDER,
+	RAYS_MORTON_ORDER,
+};
 
+/**
+ * Spheres with an acceleration structure built once in the constructor.
+ * The const queries may be called concurrently from many threads.
+ * The build and the batch queries run on the given pool, the default
+ * pool has one thread per hardware thread. The kd-tree is the default,
+ * ACCELERATOR_AUTO picks the structure with chooseAccelerator.
+ * */
+class SphereScene
+{
+public:
+	/**
+	 * Keeps a view of the spheres, they must outlive the scene
+	 * */
+	explicit SphereScene(const SpheresView& spheres, ThreadPool& pool = ThreadPool::defaultPool(),
+			AcceleratorType type = ACCELERATOR_KDTREE);
+	explicit SphereScene(Spheres&& spheres, ThreadPool& pool = ThreadPool::defaultPool(),
+			AcceleratorType type = ACCELERATOR_KDTREE);
+	/**
+	 * Takes a tree built or loaded before, e.g. with KDTree::load
+	 * */
+	explicit SphereScene(KDTree&& tree, ThreadPool& pool = ThreadPool::defaultPool());
+	/**
+	 * Takes a two level structure over instanced assemblies, the sphere indices of the
+	 * hits are those of InstanceTree::expandSpheres
+	 * */
+	explicit SphereScene(InstanceTree&& tree, ThreadPool& pool = ThreadPool::defaultPool());
 
+	IntersectionData intersectRay(const Ray& ray) const;
+	void intersectRay(const Ray& ray, HitRecord& hit) const;
+
+	/**
+	 * Packet modes trace consecutive rays together, they pay off for coherent rays.
+	 * They need the kd-tree, the BVH traces every mode one ray at a time.
+	 * */
+	void intersectRays(const Rays& rays, std::vector<IntersectionData>& intersections,
+			TraversalMode mode = TRAVERSAL_SINGLE, RayOrdering ordering = RAYS_INPUT_ORDER) const;
+	void intersectRays(const Rays& rays, std::vector<HitRecord>& hits) const;
+
+	/**
+	 * Fills rays with at most maxCount rays and returns how many, 0 at the end of the stream
+	 * */
+	typedef std::function<int(Ray* rays, int maxCount)> RayReader;
+	/**
+	 * Takes the results of the next count rays in stream order, false stops the stream
+	 * */
+	typedef std::function<bool(const IntersectionData* intersections, int count)> IntersectionWriter;
+
+	/**
+	 * Intersects a stream of rays of any length in chunks of chunkRays, memory stays bounded
+	 * by three chunks. One reader and one writer thread run for the whole stream, while the
+	 * pool intersects one chunk the reader fills the next buffer and the writer drains the
+	 * previous one. Returns false if the writer failed.
+	 * */
+	bool intersectRayStream(const RayReader& read, const IntersectionWriter& write,
+			TraversalMode mode = TRAVERSAL_SINGLE, int chunkRays = 1 << 16) const;
+
+	bool isOccluded(const Ray& ray, float maxDistance) const;
+	int countHits(const Ray& ray) const;
+
+	/**
+	 * Bit i % 64 of occluded[i / 64] is set when ray i hits a sphere closer than maxDistance
+	 * */
+	void occludedRays(const Rays& rays, float maxDistance, std::vector<uint64_t>& occluded) const;
+
+	/**
+	 * Applies the changes of a frame, the structure then uses the given spheres.
+	 * The BVH refits and rebuilds only around the changes, the kd-tree builds the leaves they reach again.
+	 * Instanced scenes ignore sphere changes, see InstanceTree::setInstances.
+	 * Must not run concurrently with queries.
+	 * */
+	void update(const SpheresView& spheres, const SphereUpdate& changes);
+
+	const Accelerator& getAccelerator() const { return *accelerator; }
+	/**
+	 * nullptr when the scene uses another structure
+	 * */
+	const KDTree* getKDTree() const { return kdTree; }
+
+private:
+	template<typename SpheresT>
+	void build(SpheresT&& spheres, AcceleratorType type);
+
+	ThreadPool& pool;
+	unique_ptr<Accelerator> accelerator;
+	const KDTree* kdTree;
+};
+
+void intersectRaySpheres(const Ray& ray, const Spheres& spheres, IntersectionData& data,
+		ThreadPool& pool = ThreadPool::defaultPool(), AcceleratorType type = ACCELERATOR_KDTREE);
+
+void intersectRaysSpheres(const Rays& rays, const Spheres& spheres, std::vector<IntersectionData>& intersections,
+		TraversalMode mode = TRAVERSAL_SINGLE, ThreadPool& pool = ThreadPool::defaultPool(),
+		RayOrdering ordering = RAYS_INPUT_ORDER, AcceleratorType type = ACCELERATOR_KDTREE);
+
+
+void occludedRaysSpheres(const Rays& rays, const Spheres& spheres, float maxDistance, std::vector<uint64_t>& occluded,
+		ThreadPool& pool = ThreadPool::defaultPool(), AcceleratorType type = ACCELERATOR_KDTREE);
 
 #endif /* RAYSPHEREINTERSECT_H_ */
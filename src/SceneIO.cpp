@@ -0,0 +1,528 @@
+#include "SceneIO.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::min;
+using std::max;
+using std::numeric_limits;
+
+namespace SceneIO
+{
+	namespace
+	{
+		const char spheresMagic[8] = { 'R', 'S', 'S', 'P', 'H', 'E', 'R', 'E' };
+		const char raysMagic[8] = { 'R', 'S', 'R', 'A', 'Y', 'S', 0, 0 };
+		const uint32_t columnsFileVersion = 1;
+		const int maxColumns = 8;
+		const int sphereColumns = 4;
+		const int rayColumns = 8;
+
+		/**
+		 * Text files are split in chunks of at least that many bytes
+		 * */
+		const size_t textChunkBytes = 1 << 20;
+
+		struct ColumnsFileHeader
+		{
+			char magic[8];
+			uint32_t endianTag;
+			uint32_t version;
+			uint32_t columnsCount;
+			uint32_t reserved;
+			uint64_t count;
+			uint64_t columnOffsets[maxColumns];
+			uint64_t fileSize;
+		};
+
+		bool saveColumns(const char* path, const char* magic, const float* const* columns, int columnsCount,
+				size_t count)
+		{
+			ColumnsFileHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, magic, sizeof(header.magic));
+			header.endianTag = fileEndianTag;
+			header.version = columnsFileVersion;
+			header.columnsCount = columnsCount;
+			header.count = count;
+
+			size_t offset = alignFileSection(sizeof(header));
+			for(int column = 0; column < columnsCount; ++column)
+			{
+				header.columnOffsets[column] = offset;
+				offset = alignFileSection(offset + count * sizeof(float));
+			}
+			header.fileSize = offset;
+
+			FILE* file = fopen(path, "wb");
+			if(!file)
+			{
+				return false;
+			}
+
+			size_t position = 0;
+			bool written = writeFileSection(file, position, 0, &header, sizeof(header));
+			for(int column = 0; column < columnsCount && written; ++column)
+			{
+				written = writeFileSection(file, position, header.columnOffsets[column], columns[column],
+						count * sizeof(float));
+			}
+			written = written && writeFileSection(file, position, header.fileSize, nullptr, 0);
+
+			return fclose(file) == 0 && written;
+		}
+
+		bool validColumnsHeader(const ColumnsFileHeader& header, const char* magic, int columnsCount, uint64_t fileSize)
+		{
+			if(memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.endianTag != fileEndianTag ||
+					header.version != columnsFileVersion || header.columnsCount != static_cast<uint32_t>(columnsCount) ||
+					header.fileSize != fileSize || header.count > static_cast<uint64_t>(numeric_limits<int>::max()))
+			{
+				return false;
+			}
+
+			for(int column = 0; column < columnsCount; ++column)
+			{
+				if(!fileSectionFits(header.fileSize, header.columnOffsets[column], header.count, sizeof(float)))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * Maps the file and points the columns into the mapping
+		 * */
+		bool mapColumns(const char* path, const char* magic, int columnsCount, MappedFile& file,
+				const float* (&columns)[maxColumns], int& count)
+		{
+			if(!file.open(path) || file.size() < sizeof(ColumnsFileHeader))
+			{
+				return false;
+			}
+
+			ColumnsFileHeader header;
+			memcpy(&header, file.data(), sizeof(header));
+			if(!validColumnsHeader(header, magic, columnsCount, file.size()))
+			{
+				return false;
+			}
+
+			for(int column = 0; column < columnsCount; ++column)
+			{
+				columns[column] = reinterpret_cast<const float*>(file.data() + header.columnOffsets[column]);
+			}
+			count = header.count;
+			return true;
+		}
+
+		/**
+		 * Parses a decimal float, returns the position after it or nullptr.
+		 * Digits past the precision of the mantissa only shift the exponent.
+		 * */
+		const char* parseFloat(const char* text, const char* end, float& value)
+		{
+			static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+					1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+			const uint64_t mantissaLimit = 100000000000000000ULL;
+
+			bool negative = false;
+			if(text < end && (*text == '-' || *text == '+'))
+			{
+				negative = *text == '-';
+				++text;
+			}
+
+			uint64_t mantissa = 0;
+			int exponent = 0, digits = 0;
+			for(; text < end && *text >= '0' && *text <= '9'; ++text, ++digits)
+			{
+				if(mantissa < mantissaLimit)
+				{
+					mantissa = mantissa * 10 + (*text - '0');
+				}
+				else
+				{
+					++exponent;
+				}
+			}
+			if(text < end && *text == '.')
+			{
+				for(++text; text < end && *text >= '0' && *text <= '9'; ++text, ++digits)
+				{
+					if(mantissa < mantissaLimit)
+					{
+						mantissa = mantissa * 10 + (*text - '0');
+						--exponent;
+					}
+				}
+			}
+			if(digits == 0)
+			{
+				return nullptr;
+			}
+
+			if(text < end && (*text == 'e' || *text == 'E'))
+			{
+				++text;
+				bool negativeExponent = false;
+				if(text < end && (*text == '-' || *text == '+'))
+				{
+					negativeExponent = *text == '-';
+					++text;
+				}
+
+				int written = 0, exponentDigits = 0;
+				for(; text < end && *text >= '0' && *text <= '9'; ++text, ++exponentDigits)
+				{
+					written = min(written * 10 + (*text - '0'), 100000);
+				}
+				if(exponentDigits == 0)
+				{
+					return nullptr;
+				}
+				exponent += negativeExponent ? -written : written;
+			}
+
+			double result = static_cast<double>(mantissa);
+			if(exponent >= 0)
+			{
+				result = exponent <= 22 ? result * powers[exponent] : result * std::pow(10.0, exponent);
+			}
+			else
+			{
+				result = exponent >= -22 ? result / powers[-exponent] : result * std::pow(10.0, exponent);
+			}
+			value = static_cast<float>(negative ? -result : result);
+			return text;
+		}
+
+		bool isSeparator(char c)
+		{
+			return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r';
+		}
+
+		/**
+		 * Number of values on the line, -1 if anything is not a number or there are too many
+		 * */
+		int parseLine(const char* text, const char* end, float* values, int maxValues)
+		{
+			int count = 0;
+			while(1)
+			{
+				while(text < end && isSeparator(*text))
+				{
+					++text;
+				}
+				if(text == end)
+				{
+					return count;
+				}
+				if(count == maxValues)
+				{
+					return -1;
+				}
+
+				text = parseFloat(text, end, values[count]);
+				if(!text || (text < end && !isSeparator(*text)))
+				{
+					return -1;
+				}
+				++count;
+			}
+		}
+
+		/**
+		 * Parses rows of minColumns to columnsCount values, missing trailing values are taken
+		 * from defaults. resize(rows) is called once with the number of rows, then store(row, values)
+		 * for every row from the pool.
+		 * */
+		template<typename Resize, typename Store>
+		bool importText(const char* path, int minColumns, int columnsCount, const float* defaults, ThreadPool& pool,
+				Resize resize, Store store)
+		{
+			MappedFile file;
+			if(!file.open(path))
+			{
+				return false;
+			}
+			const char* data = file.data();
+			const char* end = data + file.size();
+
+			// chunk boundaries move forward to the start of the next line
+			int chunksCount = static_cast<int>(min(file.size() / textChunkBytes + 1, static_cast<size_t>(pool.size()) * 8));
+			vector<const char*> bounds(chunksCount + 1, end);
+			bounds[0] = data;
+			for(int i = 1; i < chunksCount; ++i)
+			{
+				const char* split = max(data + file.size() / chunksCount * i, bounds[i - 1]);
+				const char* newline = static_cast<const char*>(memchr(split, '\n', end - split));
+				bounds[i] = newline ? newline + 1 : end;
+			}
+
+			vector<vector<float>> values(chunksCount);
+			std::atomic<bool> valid(true);
+			pool.parallelFor(chunksCount, 1, [&](int from, int to)
+			{
+				for(int chunk = from; chunk < to && valid; ++chunk)
+				{
+					const char* chunkEnd = bounds[chunk + 1];
+					for(const char* line = bounds[chunk]; line < chunkEnd; )
+					{
+						const char* newline = static_cast<const char*>(memchr(line, '\n', chunkEnd - line));
+						const char* lineEnd = newline ? newline : chunkEnd;
+
+						const char* first = line;
+						while(first < lineEnd && isSeparator(*first))
+						{
+							++first;
+						}
+
+						float row[maxColumns];
+						if(first < lineEnd && *first != '#')
+						{
+							int count = parseLine(first, lineEnd, row, columnsCount);
+							if(count >= minColumns)
+							{
+								std::copy(defaults + count, defaults + columnsCount, row + count);
+								values[chunk].insert(values[chunk].end(), row, row + columnsCount);
+							}
+							else if(line != data)
+							{
+								// only the first line of the file may be a header
+								valid = false;
+								break;
+							}
+						}
+						line = lineEnd + 1;
+					}
+				}
+			});
+			if(!valid)
+			{
+				return false;
+			}
+
+			vector<size_t> firstRow(chunksCount + 1, 0);
+			for(int chunk = 0; chunk < chunksCount; ++chunk)
+			{
+				firstRow[chunk + 1] = firstRow[chunk] + values[chunk].size() / columnsCount;
+			}
+			if(firstRow.back() > static_cast<size_t>(numeric_limits<int>::max()))
+			{
+				return false;
+			}
+
+			resize(static_cast<int>(firstRow.back()));
+			pool.parallelFor(chunksCount, 1, [&](int from, int to)
+			{
+				for(int chunk = from; chunk < to; ++chunk)
+				{
+					const float* rows = values[chunk].data();
+					size_t rowsCount = firstRow[chunk + 1] - firstRow[chunk];
+					for(size_t row = 0; row < rowsCount; ++row)
+					{
+						store(firstRow[chunk] + row, rows + row * columnsCount);
+					}
+					vector<float>().swap(values[chunk]);
+				}
+			});
+			return true;
+		}
+	}
+
+	bool saveSpheres(const char* path, const SpheresView& spheres)
+	{
+		const float* columns[sphereColumns] = { spheres.centerCoords[0], spheres.centerCoords[1],
+				spheres.centerCoords[2], spheres.radiuses };
+		return saveColumns(path, spheresMagic, columns, sphereColumns, spheres.count);
+	}
+
+	bool loadSpheres(const char* path, MappedSpheres& spheres)
+	{
+		const float* columns[maxColumns];
+		int count = 0;
+		if(!mapColumns(path, spheresMagic, sphereColumns, spheres.file, columns, count))
+		{
+			spheres.file.close();
+			return false;
+		}
+
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			spheres.spheres.centerCoords[axis] = columns[axis];
+		}
+		spheres.spheres.radiuses = columns[3];
+		spheres.spheres.count = count;
+		return true;
+	}
+
+	bool saveRays(const char* path, const Rays& rays)
+	{
+		size_t count = rays.rays.size();
+		vector<float> columns[rayColumns];
+		for(auto& column : columns)
+		{
+			column.resize(count);
+		}
+		for(size_t i = 0; i < count; ++i)
+		{
+			const Ray& ray = rays.rays[i];
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				columns[axis][i] = ray.origin[axis];
+				columns[3 + axis][i] = ray.direction[axis];
+			}
+			columns[6][i] = ray.tmin;
+			columns[7][i] = ray.tmax;
+		}
+
+		const float* data[rayColumns];
+		for(int column = 0; column < rayColumns; ++column)
+		{
+			data[column] = columns[column].data();
+		}
+		return saveColumns(path, raysMagic, data, rayColumns, count);
+	}
+
+	bool loadRays(const char* path, Rays& rays, ThreadPool& pool)
+	{
+		MappedFile file;
+		const float* columns[maxColumns];
+		int count = 0;
+		if(!mapColumns(path, raysMagic, rayColumns, file, columns, count))
+		{
+			return false;
+		}
+
+		rays.rays.resize(count);
+		pool.parallelFor(count, 1 << 16, [&](int from, int to)
+		{
+			for(int i = from; i < to; ++i)
+			{
+				rays.rays[i] = Ray(Vec3(columns[0][i], columns[1][i], columns[2][i]),
+						Vec3(columns[3][i], columns[4][i], columns[5][i]), columns[6][i], columns[7][i]);
+			}
+		});
+		return true;
+	}
+
+	RayFileReader::~RayFileReader()
+	{
+		close();
+	}
+
+	bool RayFileReader::open(const char* path)
+	{
+		close();
+		fd = ::open(path, O_RDONLY);
+		if(fd < 0)
+		{
+			return false;
+		}
+
+		struct stat info;
+		ColumnsFileHeader header;
+		if(fstat(fd, &info) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+				!validColumnsHeader(header, raysMagic, rayColumns, info.st_size))
+		{
+			close();
+			return false;
+		}
+
+		std::copy(header.columnOffsets, header.columnOffsets + rayColumns, columnOffsets);
+		count = header.count;
+		position = 0;
+		failed = false;
+		return true;
+	}
+
+	void RayFileReader::close()
+	{
+		if(fd >= 0)
+		{
+			::close(fd);
+			fd = -1;
+		}
+		count = position = 0;
+	}
+
+	int RayFileReader::read(Ray* rays, int maxCount)
+	{
+		int readCount = static_cast<int>(min<uint64_t>(maxCount, count - position));
+		column.resize(readCount);
+		for(int c = 0; c < rayColumns && readCount > 0; ++c)
+		{
+			char* bytes = reinterpret_cast<char*>(column.data());
+			size_t toRead = readCount * sizeof(float);
+			off_t offset = columnOffsets[c] + position * sizeof(float);
+			while(toRead > 0)
+			{
+				ssize_t chunk = pread(fd, bytes, toRead, offset);
+				if(chunk <= 0)
+				{
+					failed = true;
+					return 0;
+				}
+				bytes += chunk;
+				toRead -= chunk;
+				offset += chunk;
+			}
+
+			// columns 0-2 are the origin, 3-5 the direction, then tmin and tmax
+			for(int i = 0; i < readCount; ++i)
+			{
+				float value = column[i];
+				Ray& ray = rays[i];
+				if(c < 3) ray.origin[c] = value;
+				else if(c < 6) ray.direction[c - 3] = value;
+				else if(c == 6) ray.tmin = value;
+				else ray.tmax = value;
+			}
+		}
+		position += readCount;
+		return readCount;
+	}
+
+	bool importSpheresText(const char* path, Spheres& spheres, ThreadPool& pool)
+	{
+		const float defaults[sphereColumns] = { 0.f, 0.f, 0.f, 0.f };
+		return importText(path, sphereColumns, sphereColumns, defaults, pool, [&spheres](int count)
+		{
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				spheres.centerCoords[axis].resize(count);
+			}
+			spheres.radiuses.resize(count);
+			spheres.count = count;
+		},
+		[&spheres](size_t i, const float* values)
+		{
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				spheres.centerCoords[axis][i] = values[axis];
+			}
+			spheres.radiuses[i] = values[3];
+		});
+	}
+
+	bool importRaysText(const char* path, Rays& rays, ThreadPool& pool)
+	{
+		const float defaults[rayColumns] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, numeric_limits<float>::max() };
+		return importText(path, 6, rayColumns, defaults, pool, [&rays](int count)
+		{
+			rays.rays.resize(count);
+		},
+		[&rays](size_t i, const float* values)
+		{
+			rays.rays[i] = Ray(Vec3(values[0], values[1], values[2]), Vec3(values[3], values[4], values[5]),
+					values[6], values[7]);
+		});
+	}
+}
@@ -0,0 +1,78 @@
+#ifndef SCENEIO_H_
+#define SCENEIO_H_
+
+#include "Common.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+/**
+ * Binary columnar files for spheres and rays, and a parallel importer for text files.
+ * The binary files hold one float column per field (x, y, z, radius for spheres,
+ * origin, direction, tmin and tmax for rays) at aligned offsets, with a versioned,
+ * byte order checked header. All functions return false on any error.
+ * */
+namespace SceneIO
+{
+	/**
+	 * Spheres used in place from a mapped file, the view lives as long as the mapping
+	 * */
+	struct MappedSpheres
+	{
+		MappedFile file;
+		SpheresView spheres;
+	};
+
+	bool saveSpheres(const char* path, const SpheresView& spheres);
+	bool loadSpheres(const char* path, MappedSpheres& spheres);
+
+	/**
+	 * Rays are stored as columns too, loading expands them to Ray records in parallel
+	 * straight from the mapping
+	 * */
+	bool saveRays(const char* path, const Rays& rays);
+	bool loadRays(const char* path, Rays& rays, ThreadPool& pool = ThreadPool::defaultPool());
+
+	/**
+	 * Reads a binary ray file in chunks instead of loading it whole, e.g. as the
+	 * reader of SphereScene::intersectRayStream. Memory is bounded by the chunk size.
+	 * */
+	class RayFileReader
+	{
+	public:
+		RayFileReader() : fd(-1), count(0), position(0), failed(false) {}
+		~RayFileReader();
+
+		RayFileReader(const RayFileReader&) = delete;
+		RayFileReader& operator=(const RayFileReader&) = delete;
+
+		bool open(const char* path);
+		void close();
+
+		/**
+		 * Reads the next rays, returns how many, 0 at the end of the file or on a read error
+		 * */
+		int read(Ray* rays, int maxCount);
+
+		uint64_t size() const { return count; }
+		bool hasFailed() const { return failed; }
+
+	private:
+		int fd;
+		uint64_t count;
+		uint64_t position;
+		uint64_t columnOffsets[8];
+		bool failed;
+		vector<float> column;
+	};
+
+	/**
+	 * Text files with one sphere "x y z radius" or one ray "ox oy oz dx dy dz [tmin tmax]"
+	 * per line, separated by commas, semicolons or whitespace. Empty lines, lines starting
+	 * with # and a header line at the top are skipped. The file is mapped and split into
+	 * chunks at line ends that are parsed in parallel.
+	 * */
+	bool importSpheresText(const char* path, Spheres& spheres, ThreadPool& pool = ThreadPool::defaultPool());
+	bool importRaysText(const char* path, Rays& rays, ThreadPool& pool = ThreadPool::defaultPool());
+}
+
+#endif /* SCENEIO_H_ */
@@ -0,0 +1,200 @@
+#include "Stats.h"
+
+#ifdef RAYS_SPHERES_STATS
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using std::mutex;
+using std::lock_guard;
+using std::unique_ptr;
+using std::vector;
+
+namespace Stats
+{
+	namespace
+	{
+		const char* counterNames[COUNTERS] = { "inner nodes", "leaves", "spheres tested", "wasted lanes", "stack depth" };
+		const char* phaseNames[PHASES] = { "bounding box", "binning", "partition", "compaction", "query" };
+
+		struct ThreadStats
+		{
+			ThreadStats()
+			{
+				memset(&ray, 0, sizeof(ray));
+				memset(&lastRay, 0, sizeof(lastRay));
+				memset(&totals, 0, sizeof(totals));
+			}
+
+			RayStats ray;
+			RayStats lastRay;
+			Totals totals;
+		};
+
+		// thread blocks live until exit so the totals of finished threads are kept
+		mutex registryMutex;
+		vector<unique_ptr<ThreadStats>> registry;
+
+		ThreadStats& threadStats()
+		{
+			thread_local ThreadStats* stats = nullptr;
+			if(!stats)
+			{
+				stats = new ThreadStats;
+				lock_guard<mutex> lock(registryMutex);
+				registry.push_back(unique_ptr<ThreadStats>(stats));
+			}
+			return *stats;
+		}
+
+		int bucket(unsigned value)
+		{
+			int res = 0;
+			while(value && res < histogramBuckets - 1)
+			{
+				value >>= 1;
+				++res;
+			}
+			return res;
+		}
+
+		void accumulate(Totals& total, const Totals& totals)
+		{
+			total.queries += totals.queries;
+			for(int i = 0; i < COUNTERS; ++i)
+			{
+				total.counters[i] += totals.counters[i];
+				if(totals.maxCounters[i] > total.maxCounters[i])
+				{
+					total.maxCounters[i] = totals.maxCounters[i];
+				}
+				for(int j = 0; j < histogramBuckets; ++j)
+				{
+					total.histograms[i][j] += totals.histograms[i][j];
+				}
+			}
+			for(int i = 0; i < PHASES; ++i)
+			{
+				total.phaseSeconds[i] += totals.phaseSeconds[i];
+			}
+		}
+	}
+
+	void beginRay()
+	{
+		memset(&threadStats().ray, 0, sizeof(RayStats));
+	}
+
+	void endRay()
+	{
+		ThreadStats& stats = threadStats();
+		stats.lastRay = stats.ray;
+		++stats.totals.queries;
+		for(int i = 0; i < COUNTERS; ++i)
+		{
+			unsigned value = stats.ray.counters[i];
+			stats.totals.counters[i] += value;
+			if(value > stats.totals.maxCounters[i])
+			{
+				stats.totals.maxCounters[i] = value;
+			}
+			++stats.totals.histograms[i][bucket(value)];
+		}
+	}
+
+	void add(Counter counter, unsigned value)
+	{
+		threadStats().ray.counters[counter] += value;
+	}
+
+	void max(Counter counter, unsigned value)
+	{
+		unsigned& current = threadStats().ray.counters[counter];
+		if(value > current)
+		{
+			current = value;
+		}
+	}
+
+	const RayStats& lastRay()
+	{
+		return threadStats().lastRay;
+	}
+
+	void addPhaseTime(Phase phase, double seconds)
+	{
+		threadStats().totals.phaseSeconds[phase] += seconds;
+	}
+
+	Totals total()
+	{
+		Totals res;
+		memset(&res, 0, sizeof(res));
+
+		lock_guard<mutex> lock(registryMutex);
+		for(auto& stats : registry)
+		{
+			accumulate(res, stats->totals);
+		}
+		return res;
+	}
+
+	int threadsCount()
+	{
+		lock_guard<mutex> lock(registryMutex);
+		return registry.size();
+	}
+
+	Totals threadTotal(int threadIdx)
+	{
+		lock_guard<mutex> lock(registryMutex);
+		return registry[threadIdx]->totals;
+	}
+
+	void reset()
+	{
+		lock_guard<mutex> lock(registryMutex);
+		for(auto& stats : registry)
+		{
+			memset(&stats->totals, 0, sizeof(Totals));
+		}
+	}
+
+	void print(FILE* file)
+	{
+		Totals res = total();
+		unsigned long long queries = res.queries ? res.queries : 1;
+
+		fprintf(file, "%llu queries\n", res.queries);
+		for(int i = 0; i < COUNTERS; ++i)
+		{
+			fprintf(file, "  %-15s avg %8.2f  max %6u  histogram", counterNames[i],
+					static_cast<double>(res.counters[i]) / queries, res.maxCounters[i]);
+			int last = histogramBuckets - 1;
+			while(last > 0 && !res.histograms[i][last])
+			{
+				--last;
+			}
+			for(int j = 0; j <= last; ++j)
+			{
+				fprintf(file, " %llu", res.histograms[i][j]);
+			}
+			fprintf(file, "\n");
+		}
+
+		int threads = threadsCount();
+		for(int i = 0; i < PHASES; ++i)
+		{
+			fprintf(file, "  %-15s %8.4f s total, per thread:", phaseNames[i], res.phaseSeconds[i]);
+			for(int j = 0; j < threads; ++j)
+			{
+				fprintf(file, " %.4f", threadTotal(j).phaseSeconds[i]);
+			}
+			fprintf(file, "\n");
+		}
+	}
+}
+
+#endif /* RAYS_SPHERES_STATS */
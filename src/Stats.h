@@ -0,0 +1,106 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/**
+ * Traversal counters and phase timers, compiled in only with -DRAYS_SPHERES_STATS.
+ * Without it every STATS_ macro expands to nothing.
+ * */
+
+#ifdef RAYS_SPHERES_STATS
+
+#include <chrono>
+#include <cstdio>
+
+namespace Stats
+{
+	enum Counter
+	{
+		INNER_NODES,
+		LEAVES,
+		SPHERES_TESTED,
+		WASTED_LANES,
+		STACK_DEPTH,
+		COUNTERS,
+	};
+
+	enum Phase
+	{
+		PHASE_BOUNDING_BOX,
+		PHASE_BINNING,
+		PHASE_PARTITION,
+		PHASE_COMPACTION,
+		PHASE_QUERY,
+		PHASES,
+	};
+
+	/**
+	 * Buckets of powers of two, bucket i counts values in [2^(i-1), 2^i)
+	 * */
+	const int histogramBuckets = 32;
+
+	struct RayStats
+	{
+		unsigned counters[COUNTERS];
+	};
+
+	struct Totals
+	{
+		unsigned long long queries;
+		unsigned long long counters[COUNTERS];
+		unsigned maxCounters[COUNTERS];
+		unsigned long long histograms[COUNTERS][histogramBuckets];
+		double phaseSeconds[PHASES];
+	};
+
+	void beginRay();
+	void endRay();
+	void add(Counter counter, unsigned value);
+	void max(Counter counter, unsigned value);
+
+	/**
+	 * Counters of the last query finished by the calling thread
+	 * */
+	const RayStats& lastRay();
+
+	void addPhaseTime(Phase phase, double seconds);
+
+	Totals total();
+	int threadsCount();
+	Totals threadTotal(int threadIdx);
+	void reset();
+	void print(FILE* file);
+
+	class ScopedTimer
+	{
+	public:
+		explicit ScopedTimer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+		~ScopedTimer()
+		{
+			addPhaseTime(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+
+	private:
+		Phase phase;
+		std::chrono::steady_clock::time_point start;
+	};
+}
+
+#define STATS_BEGIN_RAY() Stats::beginRay()
+#define STATS_END_RAY() Stats::endRay()
+#define STATS_ADD(counter, value) Stats::add(Stats::counter, value)
+#define STATS_MAX(counter, value) Stats::max(Stats::counter, value)
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_TIMER(phase) Stats::ScopedTimer STATS_CONCAT(statsTimer, __LINE__)(Stats::phase)
+
+#else
+
+#define STATS_BEGIN_RAY() ((void)0)
+#define STATS_END_RAY() ((void)0)
+#define STATS_ADD(counter, value) ((void)0)
+#define STATS_MAX(counter, value) ((void)0)
+#define STATS_TIMER(phase) ((void)0)
+
+#endif /* RAYS_SPHERES_STATS */
+
+#endif /* STATS_H_ */
@@ -0,0 +1,188 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+using std::thread;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::min;
+
+namespace
+{
+	thread_local ThreadPool* currentPool = nullptr;
+	thread_local unsigned currentQueue = 0;
+}
+
+ThreadPool::ThreadPool(unsigned threadsCount) : queuedTasks(0), stopping(false)
+{
+	if(threadsCount == 0)
+	{
+		threadsCount = std::max(thread::hardware_concurrency(), 1u);
+	}
+	this->threadsCount = threadsCount;
+
+	// the last queue is shared by the threads outside of the pool
+	for(unsigned i = 0; i < threadsCount; ++i)
+	{
+		queues.push_back(unique_ptr<WorkQueue>(new WorkQueue));
+	}
+
+	for(unsigned i = 0; i + 1 < threadsCount; ++i)
+	{
+		workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for(auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+ThreadPool& ThreadPool::defaultPool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::push(const Task& task)
+{
+	unsigned queueIdx = (currentPool == this) ? currentQueue : threadsCount - 1;
+	{
+		lock_guard<mutex> lock(queues[queueIdx]->mutex);
+		queues[queueIdx]->tasks.push_back(task);
+	}
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		++queuedTasks;
+	}
+	wakeUp.notify_one();
+}
+
+bool ThreadPool::tryRunTask()
+{
+	unsigned ownQueue = (currentPool == this) ? currentQueue : threadsCount - 1;
+	Task task;
+	bool found = false;
+
+	{
+		WorkQueue& queue = *queues[ownQueue];
+		lock_guard<mutex> lock(queue.mutex);
+		if(!queue.tasks.empty())
+		{
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+			found = true;
+		}
+	}
+
+	for(unsigned i = 1; !found && i < threadsCount; ++i)
+	{
+		WorkQueue& victim = *queues[(ownQueue + i) % threadsCount];
+		lock_guard<mutex> lock(victim.mutex);
+		if(!victim.tasks.empty())
+		{
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			found = true;
+		}
+	}
+
+	if(!found)
+	{
+		return false;
+	}
+
+	--queuedTasks;
+	task.func();
+	--task.group->pending;
+	return true;
+}
+
+void ThreadPool::workerLoop(unsigned queueIdx)
+{
+	currentPool = this;
+	currentQueue = queueIdx;
+
+	while(1)
+	{
+		if(tryRunTask())
+		{
+			continue;
+		}
+
+		unique_lock<mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this] { return stopping || queuedTasks > 0; });
+		if(stopping)
+		{
+			return;
+		}
+	}
+}
+
+void ThreadPool::parallelFor(int count, int grain, const std::function<void(int, int)>& body)
+{
+	grain = std::max(grain, 1);
+	int chunks = (count + grain - 1) / grain;
+	if(chunks <= 1 || threadsCount == 1)
+	{
+		for(int from = 0; from < count; from += grain)
+		{
+			body(from, min(from + grain, count));
+		}
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto loop = [&]()
+	{
+		int from;
+		while((from = next.fetch_add(grain)) < count)
+		{
+			body(from, min(from + grain, count));
+		}
+	};
+
+	TaskGroup group(*this);
+	int helpers = min(static_cast<int>(threadsCount), chunks) - 1;
+	for(int i = 0; i < helpers; ++i)
+	{
+		group.run(loop);
+	}
+	loop();
+	group.wait();
+}
+
+void TaskGroup::run(const std::function<void()>& func)
+{
+	if(pool.size() == 1)
+	{
+		func();
+		return;
+	}
+
+	++pending;
+	ThreadPool::Task task;
+	task.func = func;
+	task.group = this;
+	pool.push(task);
+}
+
+void TaskGroup::wait()
+{
+	while(pending > 0)
+	{
+		if(!pool.tryRunTask())
+		{
+			std::this_thread::yield();
+		}
+	}
+}
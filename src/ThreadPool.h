@@ -0,0 +1,92 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+using std::unique_ptr;
+
+class TaskGroup;
+
+/**
+ * Persistent pool of workers with one task deque per worker.
+ * A worker pops from the back of its own deque and steals from the
+ * front of the others when it runs out of work.
+ * */
+class ThreadPool
+{
+public:
+	/**
+	 * threadsCount 0 means one thread per hardware thread. The thread that
+	 * waits on a TaskGroup executes tasks too, so threadsCount - 1 workers are started.
+	 * */
+	explicit ThreadPool(unsigned threadsCount = 0);
+	~ThreadPool();
+
+	unsigned size() const { return threadsCount; }
+
+	/**
+	 * Calls body(from, to) for consecutive ranges of at most grain
+	 * elements of [0, count). Ranges are handed out dynamically.
+	 * */
+	void parallelFor(int count, int grain, const std::function<void(int, int)>& body);
+
+	static ThreadPool& defaultPool();
+
+private:
+	friend class TaskGroup;
+
+	struct Task
+	{
+		std::function<void()> func;
+		TaskGroup* group;
+	};
+
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void push(const Task& task);
+	bool tryRunTask();
+	void workerLoop(unsigned queueIdx);
+
+	unsigned threadsCount;
+	vector<unique_ptr<WorkQueue>> queues;
+	vector<std::thread> workers;
+
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<int> queuedTasks;
+	bool stopping;
+};
+
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool) : pool(pool), pending(0) {}
+	~TaskGroup() { wait(); }
+
+	void run(const std::function<void()>& func);
+
+	/**
+	 * Executes queued tasks of the pool until all tasks of the group finish
+	 * */
+	void wait();
+
+private:
+	friend class ThreadPool;
+
+	ThreadPool& pool;
+	std::atomic<int> pending;
+};
+
+#endif /* THREADPOOL_H_ */
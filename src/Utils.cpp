@@ -1,5 +1,5 @@
 #include "Utils.h"
-#include <xmmintrin.h>
+#include <immintrin.h>
 #include <limits>
 #include <cmath>
 
@@ -7,128 +7,378 @@ using std::numeric_limits;
 
 namespace Intersection
 {
-	IntersectionData intersectSingleSphere(const Ray& ray, const Sphere& sphere)
+	namespace
 	{
-		IntersectionData data;
-		float A = 1.f, B = 0.f, C = 0.f;
+		typedef int (*LeafKernel)(const Ray& ray, const float* spheresBlocks, int count, float from,
+				IntersectionData& closest);
 
-		for(int i = 0; i < 3; ++i)
-		{
-			B += (ray.direction.coords[i] * ray.origin.coords[i] - ray.direction.coords[i] * sphere.center.coords[i]);
-			C += (ray.origin.coords[i] * ray.origin.coords[i] -
-				  2.f * ray.origin.coords[i] * sphere.center.coords[i] +
-				  sphere.center.coords[i] * sphere.center.coords[i]);
-		}
-		C -= sphere.radius * sphere.radius;
-		float discriminant = B * B - 4.f * C;
-		if(discriminant < 0)
+		IntersectionData closestHit(const float* t, const int* slots, int width, float tmax)
 		{
-			data.intersection = false;
-			return data;
+			IntersectionData result;
+			result.intersection = false;
+			result.tIntersection = tmax;
+			result.sphereIndex = -1;
+			for(int i = 0; i < width; ++i)
+			{
+				if(t[i] < result.tIntersection)
+				{
+					result.intersection = true;
+					result.tIntersection = t[i];
+					result.sphereIndex = slots[i];
+				}
+			}
+			return result;
 		}
 
-		float squareRoot = sqrt(discriminant);
-		float point1 = (-B - squareRoot) / 2.f;
-		if(point1 > 0)
+		/**
+		 * The kernels share one body per instruction set, the query type only changes what
+		 * happens with the hits of a block. They return whether the closest hit was found,
+		 * whether any sphere was hit or the number of spheres hit in [from, ray.tmax).
+		 * The discriminant is computed as r^2 - |oc - b * d|^2, which does not cancel out
+		 * for spheres far from the origin of the ray like b^2 - |oc|^2 + r^2 does.
+		 * */
+		template<QueryType query>
+		int leafKernelSSE(const Ray& ray, const float* spheresBlocks, int count, float from,
+				IntersectionData& closest)
 		{
-			data.intersection = true;
-			data.tIntersection = point1;
-			return data;
-		}
+			//a is 1, the ray direction is normalized
+			__m128 origin[3], direction[3];
+			for(int j = 0; j < 3; ++j)
+			{
+				origin[j] = _mm_set1_ps(ray.origin.coords[j]);
+				direction[j] = _mm_set1_ps(ray.direction.coords[j]);
+			}
 
-		data.tIntersection = (-B + squareRoot) / 2.f;
-		return data;
-	}
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 tmin = _mm_set1_ps(ray.tmin);
+			const __m128 tfrom = _mm_set1_ps(from);
+			__m128 best = _mm_set1_ps(ray.tmax);
+			__m128i slot = _mm_setr_epi32(0, 1, 2, 3);
+			__m128i bestSlot = _mm_set1_epi32(-1);
+			int hits = 0;
 
-	IntersectionData intersectRaySpheres(const Ray& ray, const vector<int>& spheresIndices,
-			const Spheres& spheres)
-	{
-		const int maxSpheresToCheck = 4;
-		IntersectionData result;
-		result.intersection = false;
-		result.tIntersection = numeric_limits<float>::max();
+			// padding lanes hold NaN and fail every comparison
+			for(const float* block = spheresBlocks; count > 0; block += 16, count -= 4)
+			{
+				__m128 oc[3], b = zero;
+				for(int j = 0; j < 3; ++j)
+				{
+					oc[j] = _mm_sub_ps(origin[j], _mm_load_ps(block + 4 * j));
+					b = _mm_add_ps(b, _mm_mul_ps(oc[j], direction[j]));
+				}
+				__m128 radius = _mm_load_ps(block + 12);
+				__m128 discriminant = _mm_mul_ps(radius, radius);
+				for(int j = 0; j < 3; ++j)
+				{
+					__m128 f = _mm_sub_ps(oc[j], _mm_mul_ps(b, direction[j]));
+					discriminant = _mm_sub_ps(discriminant, _mm_mul_ps(f, f));
+				}
 
-		int remainder = spheresIndices.size() % maxSpheresToCheck;
-		bool canUseSIMD = (remainder < spheresIndices.size());
+				__m128 valid = _mm_cmpge_ps(discriminant, zero);
+				__m128 squareRoot = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
 
-		int nonSIMDStartPos = 0;
+				__m128 minusB = _mm_sub_ps(zero, b);
+				__m128 t1 = _mm_sub_ps(minusB, squareRoot);
+				__m128 t2 = _mm_add_ps(minusB, squareRoot);
+				__m128 t1InRange = _mm_cmpgt_ps(t1, tmin);
+				__m128 t = _mm_or_ps(_mm_and_ps(t1InRange, t1), _mm_andnot_ps(t1InRange, t2));
 
-		if(canUseSIMD)
+				__m128 hit = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, tmin), _mm_cmplt_ps(t, best)));
+				if(query == QUERY_ANY)
+				{
+					if(_mm_movemask_ps(hit))
+					{
+						return 1;
+					}
+				}
+				else if(query == QUERY_COUNT)
+				{
+					hits += __builtin_popcount(_mm_movemask_ps(_mm_and_ps(hit, _mm_cmpge_ps(t, tfrom))));
+				}
+				else
+				{
+					best = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best));
+					__m128i hitInt = _mm_castps_si128(hit);
+					bestSlot = _mm_or_si128(_mm_and_si128(hitInt, slot), _mm_andnot_si128(hitInt, bestSlot));
+					slot = _mm_add_epi32(slot, _mm_set1_epi32(4));
+				}
+			}
+
+			if(query == QUERY_CLOSEST)
+			{
+				float t[4];
+				int slots[4];
+				_mm_storeu_ps(t, best);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(slots), bestSlot);
+				closest = closestHit(t, slots, 4, ray.tmax);
+				return closest.intersection;
+			}
+			return hits;
+		}
+
+		template<QueryType query>
+		__attribute__ ((target("avx2,fma")))
+		int leafKernelAVX2(const Ray& ray, const float* spheresBlocks, int count, float from,
+				IntersectionData& closest)
 		{
-			const int spheresToSIMDCheck = spheresIndices.size() - remainder;
-			nonSIMDStartPos = spheresToSIMDCheck;
-			//Vec4Float a = _mm_set1_ps(1.f); when rayDir is normalized a is 1
-			Vec4Float b = _mm_set1_ps(0.f);
-			Vec4Float c = b;
-			Vec4Float D = c;
+			__m256 origin[3], direction[3];
+			for(int j = 0; j < 3; ++j)
+			{
+				origin[j] = _mm256_set1_ps(ray.origin.coords[j]);
+				direction[j] = _mm256_set1_ps(ray.direction.coords[j]);
+			}
 
-			Vec4Float centerCoords[3], radiuses;
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 tmin = _mm256_set1_ps(ray.tmin);
+			const __m256 tfrom = _mm256_set1_ps(from);
+			__m256 best = _mm256_set1_ps(ray.tmax);
+			__m256i slot = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			__m256i bestSlot = _mm256_set1_epi32(-1);
+			int hits = 0;
 
-			for(int i = 0; i < spheresToSIMDCheck; i += 4)
+			for(const float* block = spheresBlocks; count > 0; block += 32, count -= 8)
 			{
+				__m256 oc[3], b = zero;
 				for(int j = 0; j < 3; ++j)
 				{
-					centerCoords[j] = _mm_set_ps(
-							spheres.centerCoords[j][spheresIndices[i]], spheres.centerCoords[j][spheresIndices[i + 1]],
-							spheres.centerCoords[j][spheresIndices[i + 2]], spheres.centerCoords[j][spheresIndices[i + 3]]
-					);
-
-					radiuses = _mm_set_ps(
-							spheres.radiuses[spheresIndices[i]], spheres.radiuses[spheresIndices[i + 1]],
-							spheres.radiuses[spheresIndices[i + 2]], spheres.radiuses[spheresIndices[i + 2]]
-					);
-
-					b += 2.f * ray.direction.coords[j] * (ray.origin.coords[j] - centerCoords[j]);
-					c += (ray.origin.coords[j] - centerCoords[j]) * (ray.origin.coords[j] - centerCoords[j]);
+					oc[j] = _mm256_sub_ps(origin[j], _mm256_load_ps(block + 8 * j));
+					b = _mm256_fmadd_ps(oc[j], direction[j], b);
+				}
+				__m256 radius = _mm256_load_ps(block + 24);
+				__m256 discriminant = _mm256_mul_ps(radius, radius);
+				for(int j = 0; j < 3; ++j)
+				{
+					__m256 f = _mm256_fnmadd_ps(b, direction[j], oc[j]);
+					discriminant = _mm256_fnmadd_ps(f, f, discriminant);
 				}
-				D = b * b - 4.f * c;
 
-				Vec4Float mask = _mm_cmpge_ps(D, _mm_set_ps1(0.f));
-				Vec4Float squareRootD = _mm_sqrt_ps(D);
-				D = _mm_and_ps(squareRootD, mask);
+				__m256 valid = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+				__m256 squareRoot = _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero));
 
-				Vec4Float t1, t2;
-				t1 = _mm_or_ps((-b - squareRootD) * 0.5f, _mm_andnot_ps(mask, D));
-				t2 = _mm_or_ps((-b + squareRootD) * 0.5f, _mm_andnot_ps(mask, D));
+				__m256 minusB = _mm256_sub_ps(zero, b);
+				__m256 t1 = _mm256_sub_ps(minusB, squareRoot);
+				__m256 t2 = _mm256_add_ps(minusB, squareRoot);
+				__m256 t = _mm256_blendv_ps(t2, t1, _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ));
 
-				float tRes = result.tIntersection;
-				for(int j = 0; j < 4; ++j)
+				__m256 hit = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, tmin, _CMP_GT_OQ),
+						_mm256_cmp_ps(t, best, _CMP_LT_OQ)));
+				if(query == QUERY_ANY)
 				{
-					if(t1[j] >= 0 && t1[j] < tRes)
+					if(_mm256_movemask_ps(hit))
 					{
-						tRes = t1[j];
-					}
-					if(t2[j] >= 0 && t2[j] < tRes)
-					{
-						tRes = t2[j];
+						return 1;
 					}
 				}
+				else if(query == QUERY_COUNT)
+				{
+					hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, tfrom, _CMP_GE_OQ));
+					hits += __builtin_popcount(_mm256_movemask_ps(hit));
+				}
+				else
+				{
+					best = _mm256_blendv_ps(best, t, hit);
+					bestSlot = _mm256_blendv_epi8(bestSlot, slot, _mm256_castps_si256(hit));
+					slot = _mm256_add_epi32(slot, _mm256_set1_epi32(8));
+				}
+			}
 
-				if(tRes	< result.tIntersection)
+			if(query == QUERY_CLOSEST)
+			{
+				float t[8];
+				int slots[8];
+				_mm256_storeu_ps(t, best);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(slots), bestSlot);
+				closest = closestHit(t, slots, 8, ray.tmax);
+				return closest.intersection;
+			}
+			return hits;
+		}
 
-					result.intersection = true;
-					result.tIntersection = tRes;
-				}
+		template<QueryType query>
+		__attribute__ ((target("avx512f")))
+		int leafKernelAVX512(const Ray& ray, const float* spheresBlocks, int count, float from,
+				IntersectionData& closest)
+		{
+			__m512 origin[3], direction[3];
+			for(int j = 0; j < 3; ++j)
+			{
+				origin[j] = _mm512_set1_ps(ray.origin.coords[j]);
+				direction[j] = _mm512_set1_ps(ray.direction.coords[j]);
 			}
 
-			for(int i = nonSIMDStartPos; i < spheresIndices.size(); ++i)
+			const __m512 zero = _mm512_setzero_ps();
+			const __m512 tmin = _mm512_set1_ps(ray.tmin);
+			const __m512 tfrom = _mm512_set1_ps(from);
+			__m512 best = _mm512_set1_ps(ray.tmax);
+			__m512i slot = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+			__m512i bestSlot = _mm512_set1_epi32(-1);
+			int hits = 0;
+
+			for(const float* block = spheresBlocks; count > 0; block += 64, count -= 16)
 			{
-				IntersectionData data;
-				int idx = spheresIndices[i];
-				Sphere sphere;
-				sphere.center.x = spheres.centerCoords[0][idx];
-				sphere.center.y = spheres.centerCoords[1][idx];
-				sphere.center.z = spheres.centerCoords[2][idx];
-				sphere.radius = spheres.radiuses[idx];
-				data = intersectSingleSphere(ray, sphere);
+				__m512 oc[3], b = zero;
+				for(int j = 0; j < 3; ++j)
+				{
+					oc[j] = _mm512_sub_ps(origin[j], _mm512_load_ps(block + 16 * j));
+					b = _mm512_fmadd_ps(oc[j], direction[j], b);
+				}
+				__m512 radius = _mm512_load_ps(block + 48);
+				__m512 discriminant = _mm512_mul_ps(radius, radius);
+				for(int j = 0; j < 3; ++j)
+				{
+					__m512 f = _mm512_fnmadd_ps(b, direction[j], oc[j]);
+					discriminant = _mm512_fnmadd_ps(f, f, discriminant);
+				}
+
+				__mmask16 valid = _mm512_cmp_ps_mask(discriminant, zero, _CMP_GE_OQ);
+				__m512 squareRoot = _mm512_sqrt_ps(_mm512_max_ps(discriminant, zero));
+
+				__m512 minusB = _mm512_sub_ps(zero, b);
+				__m512 t1 = _mm512_sub_ps(minusB, squareRoot);
+				__m512 t2 = _mm512_add_ps(minusB, squareRoot);
+				__m512 t = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(t1, tmin, _CMP_GT_OQ), t2, t1);
 
-				if(data.intersection && data.tIntersection < result.tIntersection)
+				__mmask16 hit = _mm512_mask_cmp_ps_mask(valid, t, tmin, _CMP_GT_OQ);
+				hit = _mm512_mask_cmp_ps_mask(hit, t, best, _CMP_LT_OQ);
+				if(query == QUERY_ANY)
 				{
-					result = data;
+					if(hit)
+					{
+						return 1;
+					}
+				}
+				else if(query == QUERY_COUNT)
+				{
+					hits += __builtin_popcount(_mm512_mask_cmp_ps_mask(hit, t, tfrom, _CMP_GE_OQ));
+				}
+				else
+				{
+					best = _mm512_mask_blend_ps(hit, best, t);
+					bestSlot = _mm512_mask_blend_epi32(hit, bestSlot, slot);
+					slot = _mm512_add_epi32(slot, _mm512_set1_epi32(16));
 				}
 			}
 
-			return result;
+			if(query == QUERY_CLOSEST)
+			{
+				float t[16];
+				int slots[16];
+				_mm512_storeu_ps(t, best);
+				_mm512_storeu_si512(slots, bestSlot);
+				closest = closestHit(t, slots, 16, ray.tmax);
+				return closest.intersection;
+			}
+			return hits;
+		}
+
+		struct KernelInfo
+		{
+			/**
+			 * Indexed by QueryType
+			 * */
+			LeafKernel kernels[3];
+			int width;
+			const char* name;
+		};
+
+		KernelInfo selectKernel()
+		{
+			__builtin_cpu_init();
+
+			KernelInfo info;
+			if(__builtin_cpu_supports("avx512f"))
+			{
+				info.kernels[QUERY_CLOSEST] = leafKernelAVX512<QUERY_CLOSEST>;
+				info.kernels[QUERY_ANY] = leafKernelAVX512<QUERY_ANY>;
+				info.kernels[QUERY_COUNT] = leafKernelAVX512<QUERY_COUNT>;
+				info.width = 16;
+				info.name = "avx512";
+			}
+			else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			{
+				info.kernels[QUERY_CLOSEST] = leafKernelAVX2<QUERY_CLOSEST>;
+				info.kernels[QUERY_ANY] = leafKernelAVX2<QUERY_ANY>;
+				info.kernels[QUERY_COUNT] = leafKernelAVX2<QUERY_COUNT>;
+				info.width = 8;
+				info.name = "avx2";
+			}
+			else
+			{
+				info.kernels[QUERY_CLOSEST] = leafKernelSSE<QUERY_CLOSEST>;
+				info.kernels[QUERY_ANY] = leafKernelSSE<QUERY_ANY>;
+				info.kernels[QUERY_COUNT] = leafKernelSSE<QUERY_COUNT>;
+				info.width = 4;
+				info.name = "sse";
+			}
+			return info;
+		}
+
+		const KernelInfo leafKernel = selectKernel();
 	}
 
+	IntersectionData intersectSingleSphere(const Ray& ray, const Sphere& sphere)
+	{
+		IntersectionData data;
+		data.intersection = false;
+		data.sphereIndex = -1;
+
+		//a is 1, the ray direction is normalized
+		Vec3 oc = ray.origin - sphere.center;
+		float B = oc * ray.direction;
+		Vec3 f = oc - ray.direction * B;
+		float discriminant = sphere.radius * sphere.radius - f * f;
+		if(discriminant < 0)
+		{
+			return data;
+		}
+
+		float squareRoot = sqrt(discriminant);
+		float point1 = -B - squareRoot;
+		float point2 = -B + squareRoot;
+		data.tIntersection = (point1 > ray.tmin) ? point1 : point2;
+		data.intersection = data.tIntersection > ray.tmin && data.tIntersection < ray.tmax;
+		return data;
+	}
+
+	IntersectionData intersectRaySpheres(const Ray& ray, const float* spheresBlocks, int count)
+	{
+		IntersectionData closest;
+		leafKernel.kernels[QUERY_CLOSEST](ray, spheresBlocks, count, ray.tmin, closest);
+		return closest;
+	}
+
+	bool occludedRaySpheres(const Ray& ray, const float* spheresBlocks, int count)
+	{
+		IntersectionData unused;
+		return leafKernel.kernels[QUERY_ANY](ray, spheresBlocks, count, ray.tmin, unused);
+	}
+
+	int countRaySpheres(const Ray& ray, const float* spheresBlocks, int count, float from)
+	{
+		IntersectionData unused;
+		return leafKernel.kernels[QUERY_COUNT](ray, spheresBlocks, count, from, unused);
+	}
+
+	void hitGeometry(const Ray& ray, const float* spheresBlocks, HitRecord& hit)
+	{
+		const int width = leafKernel.width;
+		const float* block = spheresBlocks + (hit.sphereIndex / width) * 4 * width;
+		int lane = hit.sphereIndex % width;
+
+		Vec3 center(block[lane], block[width + lane], block[2 * width + lane]);
+		float radius = block[3 * width + lane];
+
+		hit.point = ray.origin + ray.direction * hit.tIntersection;
+		hit.normal = (hit.point - center) * (1.f / radius);
+	}
+
+	int leafKernelWidth()
+	{
+		return leafKernel.width;
+	}
+
+	const char* leafKernelName()
+	{
+		return leafKernel.name;
+	}
 }
@@ -9,10 +9,38 @@ using std::vector;
 namespace Intersection
 {
 
-	IntersectionData intersectRaySpheres(const Ray& ray, const vector<int>& spheresIndices,
-			const Spheres& spheres);
+	/**
+	 * Closest hit in (ray.tmin, ray.tmax) of a ray with a normalized direction.
+	 * Runs the widest SIMD kernel the CPU supports (SSE, AVX2 or AVX-512), chosen at startup.
+	 * The spheres are stored in aligned blocks of leafKernelWidth() spheres:
+	 * x, y, z and radius arrays one after another, padded with NaN.
+	 * sphereIndex of the result is the position of the sphere in the blocks.
+	 * */
+	IntersectionData intersectRaySpheres(const Ray& ray, const float* spheresBlocks, int count);
+
+	/**
+	 * Whether any of the spheres is hit in (ray.tmin, ray.tmax),
+	 * returns at the first block with a hit
+	 * */
+	bool occludedRaySpheres(const Ray& ray, const float* spheresBlocks, int count);
+
+	/**
+	 * Number of spheres whose first hit after ray.tmin lies in [from, ray.tmax).
+	 * A hit point lies in exactly one leaf, so counting over the interval of each leaf
+	 * counts spheres referenced from several leaves once.
+	 * */
+	int countRaySpheres(const Ray& ray, const float* spheresBlocks, int count, float from);
+
+	/**
+	 * Fills the hit point and normal of a hit returned by intersectRaySpheres,
+	 * while the blocks of the leaf are still in the cache
+	 * */
+	void hitGeometry(const Ray& ray, const float* spheresBlocks, HitRecord& hit);
 
 	IntersectionData intersectSingleSphere(const Ray& ray, const Sphere& sphere);
+
+	int leafKernelWidth();
+	const char* leafKernelName();
 }
 
 
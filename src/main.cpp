@@ -1,7 +1,604 @@
 #include "RaySphereIntersect.h"
+#include "Generators.h"
+#include "Utils.h"
+#include "Stats.h"
+#include "SceneIO.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <random>
+#include <sys/resource.h>
 
-int main()
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using namespace Generators;
+
+namespace
+{
+	struct Options
+	{
+		Options()
+		{
+			scene = SCENE_UNIFORM;
+			spheresCount = 1000000;
+			raysType = RAYS_CAMERA;
+			raysCount = 1 << 20;
+			threads = 0;
+			verifyCount = 1000;
+			seed = 42;
+			saveFile = nullptr;
+			loadFile = nullptr;
+			spheresFile = nullptr;
+			raysFile = nullptr;
+			writeSpheresFile = nullptr;
+			writeRaysFile = nullptr;
+			streamChunk = 1 << 16;
+			accelerator = ACCELERATOR_KDTREE;
+			frames = 0;
+			moving = 0.01f;
+			lazyLevels = 0;
+			instances = 0;
+			assemblies = 4;
+		}
+
+		SceneType scene;
+		int spheresCount;
+		RaysType raysType;
+		int raysCount;
+		unsigned threads;
+		int verifyCount;
+		unsigned seed;
+		const char* saveFile;
+		const char* loadFile;
+		const char* spheresFile;
+		const char* raysFile;
+		const char* writeSpheresFile;
+		const char* writeRaysFile;
+		int streamChunk;
+		AcceleratorType accelerator;
+		int frames;
+		float moving;
+		int lazyLevels;
+		int instances;
+		int assemblies;
+	};
+
+	const char* sceneNames[] = { "uniform", "clustered", "mixed" };
+	const char* raysNames[] = { "camera", "random", "shadow" };
+	const char* acceleratorNames[] = { "auto", "kdtree", "bvh4" };
+	const char* modeNames[] = { "single", "packet4", "packet8", "packet16", "morton" };
+
+	void usage(const char* program)
+	{
+		printf("usage: %s [--scene uniform|clustered|mixed] [--spheres N] [--rays camera|random|shadow]\n"
+				"       [--count N] [--threads N] [--verify N] [--seed N] [--save FILE] [--load FILE]\n"
+				"       [--spheres-file FILE] [--rays-file FILE] [--write-spheres FILE] [--write-rays FILE]\n"
+				"       [--stream-chunk N] [--accel auto|kdtree|bvh4] [--frames N] [--moving F]\n"
+				"       [--lazy-levels N] [--instances N] [--assemblies N]\n"
+				"files ending in .csv or .txt are imported as text, others are binary\n", program);
+	}
+
+	int findName(const char* name, const char* const* names, int count)
+	{
+		for(int i = 0; i < count; ++i)
+		{
+			if(strcmp(name, names[i]) == 0)
+			{
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		for(int i = 1; i < argc; ++i)
+		{
+			if(i + 1 >= argc)
+			{
+				return false;
+			}
+
+			const char* value = argv[i + 1];
+			if(strcmp(argv[i], "--scene") == 0)
+			{
+				int scene = findName(value, sceneNames, 3);
+				if(scene < 0) return false;
+				options.scene = static_cast<SceneType>(scene);
+			}
+			else if(strcmp(argv[i], "--rays") == 0)
+			{
+				int rays = findName(value, raysNames, 3);
+				if(rays < 0) return false;
+				options.raysType = static_cast<RaysType>(rays);
+			}
+			else if(strcmp(argv[i], "--accel") == 0)
+			{
+				int accelerator = findName(value, acceleratorNames, 3);
+				if(accelerator < 0) return false;
+				options.accelerator = static_cast<AcceleratorType>(accelerator);
+			}
+			else if(strcmp(argv[i], "--spheres") == 0) options.spheresCount = atoi(value);
+			else if(strcmp(argv[i], "--count") == 0) options.raysCount = atoi(value);
+			else if(strcmp(argv[i], "--threads") == 0) options.threads = atoi(value);
+			else if(strcmp(argv[i], "--verify") == 0) options.verifyCount = atoi(value);
+			else if(strcmp(argv[i], "--seed") == 0) options.seed = atoi(value);
+			else if(strcmp(argv[i], "--save") == 0) options.saveFile = value;
+			else if(strcmp(argv[i], "--load") == 0) options.loadFile = value;
+			else if(strcmp(argv[i], "--spheres-file") == 0) options.spheresFile = value;
+			else if(strcmp(argv[i], "--rays-file") == 0) options.raysFile = value;
+			else if(strcmp(argv[i], "--write-spheres") == 0) options.writeSpheresFile = value;
+			else if(strcmp(argv[i], "--write-rays") == 0) options.writeRaysFile = value;
+			else if(strcmp(argv[i], "--stream-chunk") == 0) options.streamChunk = atoi(value);
+			else if(strcmp(argv[i], "--frames") == 0) options.frames = atoi(value);
+			else if(strcmp(argv[i], "--moving") == 0) options.moving = atof(value);
+			else if(strcmp(argv[i], "--lazy-levels") == 0) options.lazyLevels = atoi(value);
+			else if(strcmp(argv[i], "--instances") == 0) options.instances = atoi(value);
+			else if(strcmp(argv[i], "--assemblies") == 0) options.assemblies = atoi(value);
+			else return false;
+
+			++i;
+		}
+		return options.spheresCount > 0 && options.raysCount > 0 && options.streamChunk > 0 && options.frames >= 0 &&
+				options.moving >= 0.f && options.moving <= 1.f && options.lazyLevels >= 0 && options.instances >= 0 &&
+				options.assemblies > 0 &&
+				// instanced scenes are generated and keep their spheres in the assemblies
+				(options.instances == 0 || (!options.spheresFile && !options.loadFile && options.lazyLevels == 0 &&
+				options.frames == 0));
+	}
+
+	bool isTextFile(const char* path)
+	{
+		const char* extension = strrchr(path, '.');
+		return extension && (strcmp(extension, ".csv") == 0 || strcmp(extension, ".txt") == 0);
+	}
+
+	double secondsSince(steady_clock::time_point start)
+	{
+		return duration<double>(steady_clock::now() - start).count();
+	}
+
+	double peakMemoryMB()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss / 1024.0;
+	}
+
+	bool sameHit(const IntersectionData& data, const IntersectionData& reference)
+	{
+		if(data.intersection != reference.intersection)
+		{
+			return false;
+		}
+		float tolerance = 1e-3f * std::max(1.f, reference.tIntersection);
+		return !reference.intersection || std::fabs(data.tIntersection - reference.tIntersection) <= tolerance;
+	}
+}
+
+int main(int argc, char** argv)
 {
+	Options options;
+	if(!parseOptions(argc, argv, options))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	ThreadPool pool(options.threads);
+
+	steady_clock::time_point start = steady_clock::now();
+	// binary sphere files are used in place from the mapping
+	Spheres spheres;
+	SceneIO::MappedSpheres mappedSpheres;
+	SpheresView sceneSpheres;
+	vector<Spheres> assemblies;
+	vector<Instance> instances;
+	if(options.instances > 0)
+	{
+		// every assembly is a scene of --spheres spheres, the expanded copies are the reference
+		for(int i = 0; i < options.assemblies; ++i)
+		{
+			assemblies.push_back(generateSpheres(options.scene, options.spheresCount, options.seed + 1000 * (i + 1), pool));
+		}
+		instances = generateInstances(options.instances, options.assemblies, options.seed);
+		InstanceTree::expandSpheres(assemblies, instances, spheres, pool);
+		sceneSpheres = spheres;
+	}
+	else if(options.spheresFile && !isTextFile(options.spheresFile))
+	{
+		if(!SceneIO::loadSpheres(options.spheresFile, mappedSpheres))
+		{
+			fprintf(stderr, "cannot load the spheres from %s\n", options.spheresFile);
+			return 1;
+		}
+		sceneSpheres = mappedSpheres.spheres;
+	}
+	else
+	{
+		if(options.spheresFile && !SceneIO::importSpheresText(options.spheresFile, spheres, pool))
+		{
+			fprintf(stderr, "cannot import the spheres from %s\n", options.spheresFile);
+			return 1;
+		}
+		if(!options.spheresFile)
+		{
+			spheres = generateSpheres(options.scene, options.spheresCount, options.seed, pool);
+		}
+		sceneSpheres = spheres;
+	}
+
+	Rays rays;
+	if(options.raysFile)
+	{
+		bool loaded = isTextFile(options.raysFile) ? SceneIO::importRaysText(options.raysFile, rays, pool) :
+				SceneIO::loadRays(options.raysFile, rays, pool);
+		if(!loaded || rays.rays.empty())
+		{
+			fprintf(stderr, "cannot load the rays from %s\n", options.raysFile);
+			return 1;
+		}
+		options.raysCount = rays.rays.size();
+	}
+	else
+	{
+		rays = generateRays(options.raysType, options.raysCount, options.seed, pool);
+	}
+	printf("scene %s, %d spheres, %s rays, %d rays, %u threads, %s leaf kernel, %s in %.3f s\n",
+			options.spheresFile ? options.spheresFile : sceneNames[options.scene], sceneSpheres.count,
+			options.raysFile ? options.raysFile : raysNames[options.raysType], options.raysCount, pool.size(),
+			Intersection::leafKernelName(), options.spheresFile || options.raysFile ? "loaded" : "generated",
+			secondsSince(start));
+
+	if(options.writeSpheresFile && !SceneIO::saveSpheres(options.writeSpheresFile, sceneSpheres))
+	{
+		fprintf(stderr, "cannot write the spheres to %s\n", options.writeSpheresFile);
+		return 1;
+	}
+	if(options.writeRaysFile && !SceneIO::saveRays(options.writeRaysFile, rays))
+	{
+		fprintf(stderr, "cannot write the rays to %s\n", options.writeRaysFile);
+		return 1;
+	}
+
+	// a loaded tree must come from a run with the same scene options to match the reference
+	start = steady_clock::now();
+	unique_ptr<SphereScene> loadedScene;
+	if(options.loadFile)
+	{
+		KDTree loaded;
+		if(!loaded.load(options.loadFile, pool))
+		{
+			fprintf(stderr, "cannot load the tree from %s\n", options.loadFile);
+			return 1;
+		}
+		loadedScene.reset(new SphereScene(std::move(loaded), pool));
+	}
+	else if(options.instances > 0)
+	{
+		InstanceTree instanced;
+		instanced.build(std::move(assemblies), instances, pool);
+		loadedScene.reset(new SphereScene(std::move(instanced), pool));
+	}
+	else if(options.lazyLevels > 0)
+	{
+		// lazy builds are a kd-tree mode
+		SAHParams params;
+		params.lazyLevels = options.lazyLevels;
+		KDTree lazy(params);
+		lazy.build(sceneSpheres, pool);
+		loadedScene.reset(new SphereScene(std::move(lazy), pool));
+	}
+	else
+	{
+		loadedScene.reset(new SphereScene(sceneSpheres, pool, options.accelerator));
+	}
+	SphereScene& scene = *loadedScene;
+	double buildSeconds = secondsSince(start);
+
+	// a lazy tree builds what the first ray needs here
+	start = steady_clock::now();
+	scene.intersectRay(rays.rays[0]);
+	double firstRaySeconds = secondsSince(start);
+
+	const Accelerator& tree = scene.getAccelerator();
+	printf("%s %s %.3f s, first ray %.4f s, %d nodes, %d leaves, depth %d, tree %.1f MB, build peak %.1f MB\n",
+			tree.getName(), options.loadFile ? "load" : "build", buildSeconds, firstRaySeconds, tree.getSize(),
+			tree.getLeaves(), tree.getDepth(), tree.getMemoryUsage() / (1024.0 * 1024.0),
+			tree.getBuildMemoryPeak() / (1024.0 * 1024.0));
+
+	// the same scene with every copy expanded into one kd-tree
+	if(options.instances > 0)
+	{
+		start = steady_clock::now();
+		KDTree flat;
+		flat.build(sceneSpheres, pool);
+		double flatSeconds = secondsSince(start);
+		size_t flatMemory = flat.getMemoryUsage();
+		size_t flatPeak = flat.getBuildMemoryPeak();
+
+		SphereScene flatScene(std::move(flat), pool);
+		vector<IntersectionData> flatIntersections;
+		start = steady_clock::now();
+		flatScene.intersectRays(rays, flatIntersections);
+		printf("%d instances of %d assemblies, flat kdtree build %.3f s, tree %.1f MB, build peak %.1f MB, "
+				"%.3f Mrays/s\n", options.instances, options.assemblies, flatSeconds, flatMemory / (1024.0 * 1024.0),
+				flatPeak / (1024.0 * 1024.0), options.raysCount / secondsSince(start) * 1e-6);
+	}
+
+	// only the kd-tree has a file format
+	if(options.saveFile && !(scene.getKDTree() && scene.getKDTree()->save(options.saveFile)))
+	{
+		fprintf(stderr, "cannot save the tree to %s\n", options.saveFile);
+		return 1;
+	}
+
+	// every verified ray is checked against all spheres
+	int verifyCount = std::min(options.verifyCount, options.raysCount);
+	int verifyStep = verifyCount > 0 ? options.raysCount / verifyCount : 1;
+	vector<IntersectionData> reference(verifyCount);
+	pool.parallelFor(verifyCount, 1, [&](int from, int to)
+	{
+		for(int i = from; i < to; ++i)
+		{
+			reference[i] = bruteForceIntersect(rays.rays[i * verifyStep], sceneSpheres);
+		}
+	});
+
+#ifdef RAYS_SPHERES_STATS
+	printf("build ");
+	Stats::print(stdout);
+#endif
+
+	// the last run traces single rays in Morton order, its time includes the sort
+	int failures = 0;
+	const int runsCount = TRAVERSAL_PACKET16 + 2;
+	double singleSeconds = 0;
+	for(int run = 0; run < runsCount; ++run)
+	{
+		bool morton = run == runsCount - 1;
+		TraversalMode mode = morton ? TRAVERSAL_SINGLE : static_cast<TraversalMode>(run);
+		vector<IntersectionData> intersections;
+#ifdef RAYS_SPHERES_STATS
+		Stats::reset();
+#endif
+		start = steady_clock::now();
+		scene.intersectRays(rays, intersections, mode, morton ? RAYS_MORTON_ORDER : RAYS_INPUT_ORDER);
+		double seconds = secondsSince(start);
+		if(run == TRAVERSAL_SINGLE)
+		{
+			singleSeconds = seconds;
+		}
+
+		int hits = 0;
+		for(auto& data : intersections)
+		{
+			hits += data.intersection;
+		}
+
+		int mismatches = 0;
+		for(int i = 0; i < verifyCount; ++i)
+		{
+			mismatches += !sameHit(intersections[i * verifyStep], reference[i]);
+		}
+		failures += mismatches;
+
+		printf("%-10s %9.3f Mrays/s  %10d hits  %d/%d mismatches", modeNames[run],
+				options.raysCount / seconds * 1e-6, hits, mismatches, verifyCount);
+		if(morton)
+		{
+			printf("  %.2fx single", singleSeconds / seconds);
+		}
+		printf("\n");
+#ifdef RAYS_SPHERES_STATS
+		Stats::print(stdout);
+#endif
+	}
+
+	// streamed from the ray file when there is a binary one, results are checked as they are written
+	{
+		SceneIO::RayFileReader reader;
+		bool fromFile = options.raysFile && !isTextFile(options.raysFile);
+		if(fromFile && !reader.open(options.raysFile))
+		{
+			fprintf(stderr, "cannot open the rays in %s\n", options.raysFile);
+			return 1;
+		}
+
+		int readRays = 0, streamedRays = 0, hits = 0, mismatches = 0;
+		auto readRaysChunk = [&](Ray* chunk, int maxCount)
+		{
+			if(fromFile)
+			{
+				return reader.read(chunk, maxCount);
+			}
+			int count = std::min(maxCount, options.raysCount - readRays);
+			std::copy(&rays.rays[readRays], &rays.rays[readRays] + count, chunk);
+			readRays += count;
+			return count;
+		};
+		auto writeResults = [&](const IntersectionData* intersections, int count)
+		{
+			for(int i = 0; i < count; ++i)
+			{
+				int rayIdx = streamedRays + i;
+				hits += intersections[i].intersection;
+				if(verifyStep > 0 && rayIdx % verifyStep == 0 && rayIdx / verifyStep < verifyCount)
+				{
+					mismatches += !sameHit(intersections[i], reference[rayIdx / verifyStep]);
+				}
+			}
+			streamedRays += count;
+			return true;
+		};
+
+		start = steady_clock::now();
+		scene.intersectRayStream(readRaysChunk, writeResults, TRAVERSAL_SINGLE, options.streamChunk);
+		double seconds = secondsSince(start);
+		if(reader.hasFailed() || streamedRays != options.raysCount)
+		{
+			fprintf(stderr, "streamed %d of %d rays\n", streamedRays, options.raysCount);
+			return 1;
+		}
+		failures += mismatches;
+
+		printf("%-10s %9.3f Mrays/s  %10d hits  %d/%d mismatches\n", "stream",
+				options.raysCount / seconds * 1e-6, hits, mismatches, verifyCount);
+	}
+
+	// occlusion up to the tmax of every ray, the segment of shadow rays
+	const float maxDistance = std::numeric_limits<float>::max();
+	vector<uint64_t> occluded;
+#ifdef RAYS_SPHERES_STATS
+	Stats::reset();
+#endif
+	start = steady_clock::now();
+	scene.occludedRays(rays, maxDistance, occluded);
+	double seconds = secondsSince(start);
+
+	int occludedCount = 0;
+	for(uint64_t bits : occluded)
+	{
+		occludedCount += __builtin_popcountll(bits);
+	}
+
+	int mismatches = 0;
+	for(int i = 0; i < verifyCount; ++i)
+	{
+		int rayIdx = i * verifyStep;
+		bool expected = reference[i].intersection;
+		mismatches += expected != static_cast<bool>((occluded[rayIdx / 64] >> (rayIdx % 64)) & 1);
+	}
+	failures += mismatches;
+
+	printf("%-10s %9.3f Mrays/s  %10d hits  %d/%d mismatches\n", "occlusion",
+			options.raysCount / seconds * 1e-6, occludedCount, mismatches, verifyCount);
+#ifdef RAYS_SPHERES_STATS
+	Stats::print(stdout);
+#endif
+
+	if(options.lazyLevels > 0)
+	{
+		// the subtrees the rays reached are built by now
+		printf("%-10s %d nodes, %d leaves, depth %d, tree %.1f MB after the queries\n", "lazy", tree.getSize(),
+				tree.getLeaves(), tree.getDepth(), tree.getMemoryUsage() / (1024.0 * 1024.0));
+	}
+
+	// every frame moves a fraction of the spheres a little, removes a few and inserts
+	// the ones removed before at new places. Removed spheres keep their radius, so the
+	// structure has to drop them, the last frame is verified against the spheres left.
+	if(options.frames > 0)
+	{
+		Spheres animated;
+		animated.count = sceneSpheres.count;
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			animated.centerCoords[axis].assign(sceneSpheres.centerCoords[axis],
+					sceneSpheres.centerCoords[axis] + sceneSpheres.count);
+		}
+		animated.radiuses.assign(sceneSpheres.radiuses, sceneSpheres.radiuses + sceneSpheres.count);
+
+		std::mt19937 random(options.seed);
+		std::uniform_int_distribution<int> anySphere(0, animated.count - 1);
+		std::uniform_real_distribution<float> jitter(-0.01f * sceneSize, 0.01f * sceneSize);
+		std::uniform_real_distribution<float> anywhere(0.f, sceneSize);
+		int movedCount = static_cast<int>(options.moving * animated.count);
+		int removedCount = movedCount / 8;
+
+		vector<char> removed(animated.count, 0);
+		vector<int> removedSpheres;
+		double updateSeconds = 0, traceSeconds = 0;
+		vector<IntersectionData> intersections;
+		for(int frame = 0; frame < options.frames; ++frame)
+		{
+			SphereUpdate changes;
+			for(int sphereIdx : removedSpheres)
+			{
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					animated.centerCoords[axis][sphereIdx] = anywhere(random);
+				}
+				removed[sphereIdx] = 0;
+				changes.inserted.push_back(sphereIdx);
+			}
+			removedSpheres.clear();
+
+			for(int i = 0; i < movedCount; ++i)
+			{
+				int sphereIdx = anySphere(random);
+				if(removed[sphereIdx])
+				{
+					continue;
+				}
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					animated.centerCoords[axis][sphereIdx] += jitter(random);
+				}
+				changes.moved.push_back(sphereIdx);
+			}
+			for(int i = 0; i < removedCount; ++i)
+			{
+				int sphereIdx = anySphere(random);
+				if(removed[sphereIdx])
+				{
+					continue;
+				}
+				removed[sphereIdx] = 1;
+				removedSpheres.push_back(sphereIdx);
+				changes.removed.push_back(sphereIdx);
+			}
+
+			start = steady_clock::now();
+			scene.update(SpheresView(animated), changes);
+			updateSeconds += secondsSince(start);
+
+			start = steady_clock::now();
+			scene.intersectRays(rays, intersections);
+			traceSeconds += secondsSince(start);
+		}
+
+		// the reference and the full build compared against get only the spheres left in the scene
+		Spheres live;
+		for(int sphereIdx = 0; sphereIdx < animated.count; ++sphereIdx)
+		{
+			if(!removed[sphereIdx])
+			{
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					live.centerCoords[axis].push_back(animated.centerCoords[axis][sphereIdx]);
+				}
+				live.radiuses.push_back(animated.radiuses[sphereIdx]);
+			}
+		}
+		live.count = live.radiuses.size();
+
+		mismatches = 0;
+		for(int i = 0; i < verifyCount; ++i)
+		{
+			IntersectionData expected = bruteForceIntersect(rays.rays[i * verifyStep], SpheresView(live));
+			mismatches += !sameHit(intersections[i * verifyStep], expected);
+		}
+		failures += mismatches;
+
+		start = steady_clock::now();
+		SphereScene rebuilt(SpheresView(live), pool, scene.getKDTree() ? ACCELERATOR_KDTREE : ACCELERATOR_BVH4);
+		double rebuildSeconds = secondsSince(start);
+		vector<IntersectionData> rebuiltIntersections;
+		start = steady_clock::now();
+		rebuilt.intersectRays(rays, rebuiltIntersections);
+		double rebuiltSeconds = secondsSince(start);
+
+		printf("%-10s %9.3f Mrays/s  %d frames, %d moved, update %.4f s per frame, full build %.4f s, "
+				"%.3f Mrays/s rebuilt, %d/%d mismatches\n", "frames",
+				options.frames * options.raysCount / traceSeconds * 1e-6, options.frames, movedCount,
+				updateSeconds / options.frames, rebuildSeconds, options.raysCount / rebuiltSeconds * 1e-6,
+				mismatches, verifyCount);
+	}
+
+	printf("peak memory %.1f MB\n", peakMemoryMB());
 
-	return 0;
+	return failures ? 2 : 0;
 }
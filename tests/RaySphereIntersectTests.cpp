@@ -0,0 +1,684 @@
+#include "RaySphereIntersect.h"
+#include "Generators.h"
+#include "SceneIO.h"
+#include "Utils.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <unistd.h>
+
+using namespace Generators;
+
+/**
+ * Checks every engine against the brute force reference on small generated scenes.
+ * Prints a line per failed check and exits with 1 if any failed, so ctest reports it.
+ * */
+namespace
+{
+	int failures = 0;
+
+	void check(bool passed, const char* name)
+	{
+		if(!passed)
+		{
+			fprintf(stderr, "FAILED: %s\n", name);
+			++failures;
+		}
+	}
+
+	bool sameHit(const IntersectionData& data, const IntersectionData& reference)
+	{
+		if(data.intersection != reference.intersection)
+		{
+			return false;
+		}
+		float tolerance = 1e-3f * std::max(1.f, reference.tIntersection);
+		return !reference.intersection || std::fabs(data.tIntersection - reference.tIntersection) <= tolerance;
+	}
+
+	bool sameBits(float a, float b)
+	{
+		return memcmp(&a, &b, sizeof(float)) == 0;
+	}
+
+	bool sameRayBits(const Ray& ray, const Ray& reference)
+	{
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			if(!sameBits(ray.origin[axis], reference.origin[axis]) ||
+					!sameBits(ray.direction[axis], reference.direction[axis]))
+			{
+				return false;
+			}
+		}
+		return sameBits(ray.tmin, reference.tmin) && sameBits(ray.tmax, reference.tmax);
+	}
+
+	/**
+	 * Cuts the file to half its size, false if that fails
+	 * */
+	bool truncateFile(const char* path)
+	{
+		FILE* file = fopen(path, "r+b");
+		long size = file && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : 0;
+		if(file)
+		{
+			fclose(file);
+		}
+		return size > 0 && truncate(path, size / 2) == 0;
+	}
+
+	/**
+	 * Overwrites the first byte of the magic, false if that fails
+	 * */
+	bool corruptHeader(const char* path)
+	{
+		FILE* file = fopen(path, "r+b");
+		bool written = file && fputc('X', file) != EOF;
+		return file && fclose(file) == 0 && written;
+	}
+
+	/**
+	 * Number of rays whose closest hit differs from the brute force one over spheres
+	 * */
+	int countMismatches(const Rays& rays, const vector<IntersectionData>& intersections, const SpheresView& spheres)
+	{
+		int mismatches = 0;
+		for(size_t i = 0; i < rays.rays.size(); ++i)
+		{
+			mismatches += !sameHit(intersections[i], bruteForceIntersect(rays.rays[i], spheres));
+		}
+		return mismatches;
+	}
+
+	/**
+	 * Copy of the spheres not flagged as removed
+	 * */
+	Spheres liveSpheres(const Spheres& spheres, const vector<char>& removed)
+	{
+		Spheres live;
+		for(int sphereIdx = 0; sphereIdx < spheres.count; ++sphereIdx)
+		{
+			if(!removed[sphereIdx])
+			{
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					live.centerCoords[axis].push_back(spheres.centerCoords[axis][sphereIdx]);
+				}
+				live.radiuses.push_back(spheres.radiuses[sphereIdx]);
+			}
+		}
+		live.count = live.radiuses.size();
+		return live;
+	}
+
+	/**
+	 * Number of spheres the ray hits in (tmin, tmax), every sphere counted once
+	 * */
+	int bruteForceCount(const Ray& ray, const SpheresView& spheres)
+	{
+		Ray normalized(ray.origin, normalize(ray.direction), ray.tmin, ray.tmax);
+		int count = 0;
+		for(int i = 0; i < spheres.count; ++i)
+		{
+			Sphere sphere;
+			sphere.center = Vec3(spheres.centerCoords[0][i], spheres.centerCoords[1][i], spheres.centerCoords[2][i]);
+			sphere.radius = spheres.radiuses[i];
+			count += Intersection::intersectSingleSphere(normalized, sphere).intersection;
+		}
+		return count;
+	}
+
+	void checkCounts(const char* name, const SphereScene& scene, const Rays& rays, const SpheresView& spheres)
+	{
+		int mismatches = 0;
+		for(const Ray& ray : rays.rays)
+		{
+			mismatches += scene.countHits(ray) != bruteForceCount(ray, spheres);
+		}
+		check(mismatches == 0, name);
+	}
+
+	void testScene(const char* name, SceneType sceneType, RaysType raysType, AcceleratorType type, ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(sceneType, 3000, 7, pool);
+		Rays rays = generateRays(raysType, 500, 11, pool);
+		SphereScene scene(SpheresView(spheres), pool, type);
+
+		const TraversalMode modes[] = { TRAVERSAL_SINGLE, TRAVERSAL_PACKET4, TRAVERSAL_PACKET8, TRAVERSAL_PACKET16 };
+		for(TraversalMode mode : modes)
+		{
+			vector<IntersectionData> intersections;
+			scene.intersectRays(rays, intersections, mode);
+			check(countMismatches(rays, intersections, SpheresView(spheres)) == 0, name);
+		}
+
+		vector<IntersectionData> intersections;
+		scene.intersectRays(rays, intersections, TRAVERSAL_SINGLE, RAYS_MORTON_ORDER);
+		check(countMismatches(rays, intersections, SpheresView(spheres)) == 0, name);
+
+		checkCounts(name, scene, rays, SpheresView(spheres));
+
+		vector<uint64_t> occluded;
+		scene.occludedRays(rays, std::numeric_limits<float>::max(), occluded);
+		for(size_t i = 0; i < rays.rays.size(); ++i)
+		{
+			bool expected = bruteForceIntersect(rays.rays[i], SpheresView(spheres)).intersection;
+			check(expected == static_cast<bool>((occluded[i / 64] >> (i % 64)) & 1), name);
+		}
+	}
+
+	/**
+	 * Hit points lie on the hit sphere with unit normals pointing out of it,
+	 * and a ray starting past its first hit finds the next one
+	 * */
+	void testHitRecords(const char* name, AcceleratorType type, ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(SCENE_MIXED_RADIUSES, 3000, 71, pool);
+		Rays rays = generateRays(RAYS_CAMERA, 500, 73, pool);
+		SphereScene scene(SpheresView(spheres), pool, type);
+
+		vector<HitRecord> hits;
+		scene.intersectRays(rays, hits);
+		check(hits.size() == rays.rays.size(), name);
+		for(size_t i = 0; i < hits.size(); ++i)
+		{
+			const Ray& ray = rays.rays[i];
+			HitRecord hit;
+			scene.intersectRay(ray, hit);
+			check(sameHit(hit, bruteForceIntersect(ray, SpheresView(spheres))) && sameHit(hits[i], hit), name);
+			if(!hit.intersection)
+			{
+				continue;
+			}
+
+			int sphereIdx = hit.sphereIndex;
+			Vec3 center(spheres.centerCoords[0][sphereIdx], spheres.centerCoords[1][sphereIdx],
+					spheres.centerCoords[2][sphereIdx]);
+			float radius = spheres.radiuses[sphereIdx];
+			float tolerance = 1e-3f * std::max(1.f, hit.tIntersection);
+			check(std::fabs((hit.point - center).length() - radius) <= tolerance, name);
+			// the error of the point grows with t and is divided by the radius in the normal
+			float normalTolerance = 1e-4f + 1e-6f * std::max(1.f, hit.tIntersection) / radius;
+			check(std::fabs(hit.normal.length() - 1.f) <= normalTolerance, name);
+			check((hit.normal - (hit.point - center) * (1.f / radius)).length() <= 1e-2f, name);
+
+			Ray past(ray.origin, ray.direction, hit.tIntersection + tolerance, ray.tmax);
+			HitRecord next;
+			scene.intersectRay(past, next);
+			check(sameHit(next, bruteForceIntersect(past, SpheresView(spheres))), name);
+			check(!next.intersection || next.tIntersection > hit.tIntersection, name);
+		}
+	}
+
+	/**
+	 * Streams in chunks that do not divide the rays count, then with a writer that stops after three chunks
+	 * */
+	void testStream(ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(SCENE_UNIFORM, 3000, 61, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 1001, 67, pool);
+		SphereScene scene(SpheresView(spheres), pool, ACCELERATOR_KDTREE);
+
+		size_t position = 0;
+		auto read = [&](Ray* chunk, int maxCount)
+		{
+			int count = static_cast<int>(std::min<size_t>(maxCount, rays.rays.size() - position));
+			std::copy(rays.rays.begin() + position, rays.rays.begin() + position + count, chunk);
+			position += count;
+			return count;
+		};
+
+		vector<IntersectionData> intersections;
+		int writes = 0;
+		bool written = scene.intersectRayStream(read, [&](const IntersectionData* results, int count)
+		{
+			intersections.insert(intersections.end(), results, results + count);
+			++writes;
+			return true;
+		}, TRAVERSAL_PACKET8, 64);
+		check(written && writes == 16 && intersections.size() == rays.rays.size(), "ray stream writes every chunk");
+		check(intersections.size() == rays.rays.size() &&
+				countMismatches(rays, intersections, SpheresView(spheres)) == 0, "ray stream");
+
+		position = 0;
+		writes = 0;
+		written = scene.intersectRayStream(read, [&](const IntersectionData*, int)
+		{
+			return ++writes < 3;
+		}, TRAVERSAL_SINGLE, 64);
+		check(!written && writes == 3, "ray stream stops at a failed write");
+	}
+
+	/**
+	 * Whether the ray is occluded, through isOccluded and through a one ray occludedRays
+	 * call, false if the two disagree
+	 * */
+	bool occludedBoth(const SphereScene& scene, const Ray& ray, float maxDistance, bool expected)
+	{
+		Rays rays;
+		rays.rays.push_back(ray);
+		vector<uint64_t> occluded;
+		scene.occludedRays(rays, maxDistance, occluded);
+		return scene.isOccluded(ray, maxDistance) == expected && static_cast<bool>(occluded[0] & 1) == expected;
+	}
+
+	/**
+	 * Occlusion just short of and just past the closest hit, bounded by maxDistance
+	 * or by the tmax of the ray, whichever is shorter
+	 * */
+	void testOcclusionDistances(const char* name, AcceleratorType type, ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(SCENE_CLUSTERED, 3000, 79, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 500, 83, pool);
+		SphereScene scene(SpheresView(spheres), pool, type);
+
+		int hits = 0;
+		for(const Ray& ray : rays.rays)
+		{
+			IntersectionData reference = bruteForceIntersect(ray, SpheresView(spheres));
+			if(!reference.intersection)
+			{
+				continue;
+			}
+			++hits;
+
+			float margin = 1e-3f * std::max(1.f, reference.tIntersection);
+			float shortDistance = reference.tIntersection - margin;
+			float pastDistance = reference.tIntersection + margin;
+			check(occludedBoth(scene, ray, shortDistance, false), name);
+			check(occludedBoth(scene, ray, pastDistance, true), name);
+
+			// a tmax below maxDistance bounds the query
+			Ray shortRay(ray.origin, ray.direction, ray.tmin, shortDistance);
+			check(occludedBoth(scene, shortRay, pastDistance, false), name);
+			check(occludedBoth(scene, shortRay, std::numeric_limits<float>::max(), false), name);
+			Ray pastRay(ray.origin, ray.direction, ray.tmin, pastDistance);
+			check(occludedBoth(scene, pastRay, std::numeric_limits<float>::max(), true), name);
+		}
+		check(hits > 0, name);
+	}
+
+	bool validChoice(AcceleratorType type)
+	{
+		return type == ACCELERATOR_KDTREE || type == ACCELERATOR_BVH4;
+	}
+
+	void testChooseAccelerator(ThreadPool& pool)
+	{
+		Spheres empty;
+		empty.count = 0;
+		check(chooseAccelerator(SpheresView(empty), pool) == ACCELERATOR_KDTREE, "empty scene gets the kd-tree");
+		Spheres tiny = generateSpheres(SCENE_UNIFORM, 10, 89, pool);
+		check(chooseAccelerator(SpheresView(tiny), pool) == ACCELERATOR_KDTREE, "tiny scene gets the kd-tree");
+
+		// centers in one plane give a flat crop box
+		Spheres flat = generateSpheres(SCENE_UNIFORM, 20000, 97, pool);
+		std::fill(flat.centerCoords[2].begin(), flat.centerCoords[2].end(), 0.5f * sceneSize);
+		check(validChoice(chooseAccelerator(SpheresView(flat), pool)), "flat scene");
+
+		// the scene runs chooseAccelerator itself
+		Spheres clustered = generateSpheres(SCENE_CLUSTERED, 40000, 101, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 200, 103, pool);
+		SphereScene scene(SpheresView(clustered), pool, ACCELERATOR_AUTO);
+		const char* chosen = scene.getAccelerator().getName();
+		check(strcmp(chosen, "kdtree") == 0 || strcmp(chosen, "bvh4") == 0, "clustered scene");
+		vector<IntersectionData> intersections;
+		scene.intersectRays(rays, intersections);
+		check(countMismatches(rays, intersections, SpheresView(clustered)) == 0, "auto clustered scene");
+
+		SphereScene emptyScene(SpheresView(empty), pool, ACCELERATOR_AUTO);
+		emptyScene.intersectRays(rays, intersections);
+		check(countMismatches(rays, intersections, SpheresView(empty)) == 0, "auto empty scene");
+	}
+
+	void testLazy(ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(SCENE_CLUSTERED, 20000, 3, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 500, 5, pool);
+		SAHParams params;
+		params.lazyLevels = 2;
+		KDTree lazy(params);
+		lazy.build(SpheresView(spheres), pool);
+		SphereScene scene(std::move(lazy), pool);
+
+		vector<IntersectionData> intersections;
+		scene.intersectRays(rays, intersections);
+		check(countMismatches(rays, intersections, SpheresView(spheres)) == 0, "lazy kd-tree");
+		checkCounts("lazy kd-tree counts", scene, rays, SpheresView(spheres));
+		check(scene.getAccelerator().getLeaves() > 0, "lazy kd-tree counts its built leaves");
+	}
+
+	/**
+	 * A few frames of moves, removals and insertions, then the structure is compared
+	 * against the spheres left. Removed spheres keep their radius.
+	 * */
+	void testUpdate(const char* name, AcceleratorType type, ThreadPool& pool)
+	{
+		Spheres spheres = generateSpheres(SCENE_UNIFORM, 5000, 13, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 500, 17, pool);
+		SphereScene scene(SpheresView(spheres), pool, type);
+
+		std::mt19937 random(19);
+		std::uniform_int_distribution<int> anySphere(0, spheres.count - 1);
+		std::uniform_real_distribution<float> jitter(-1.f, 1.f);
+		std::uniform_real_distribution<float> anywhere(0.f, sceneSize);
+		vector<char> removed(spheres.count, 0);
+		vector<int> removedSpheres;
+		for(int frame = 0; frame < 4; ++frame)
+		{
+			SphereUpdate changes;
+			for(int sphereIdx : removedSpheres)
+			{
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					spheres.centerCoords[axis][sphereIdx] = anywhere(random);
+				}
+				removed[sphereIdx] = 0;
+				changes.inserted.push_back(sphereIdx);
+			}
+			removedSpheres.clear();
+			for(int i = 0; i < 100; ++i)
+			{
+				int sphereIdx = anySphere(random);
+				if(!removed[sphereIdx])
+				{
+					for(int axis = 0; axis < 3; ++axis)
+					{
+						spheres.centerCoords[axis][sphereIdx] += jitter(random);
+					}
+					changes.moved.push_back(sphereIdx);
+				}
+			}
+			for(int i = 0; i < 50; ++i)
+			{
+				int sphereIdx = anySphere(random);
+				if(!removed[sphereIdx])
+				{
+					removed[sphereIdx] = 1;
+					removedSpheres.push_back(sphereIdx);
+					changes.removed.push_back(sphereIdx);
+				}
+			}
+			scene.update(SpheresView(spheres), changes);
+
+			vector<IntersectionData> intersections;
+			scene.intersectRays(rays, intersections);
+			check(countMismatches(rays, intersections, SpheresView(liveSpheres(spheres, removed))) == 0, name);
+		}
+	}
+
+	void testInstances(ThreadPool& pool)
+	{
+		vector<Spheres> assemblies;
+		for(int i = 0; i < 2; ++i)
+		{
+			assemblies.push_back(generateSpheres(SCENE_UNIFORM, 500, 23 + i, pool));
+		}
+		vector<Instance> instances = generateInstances(20, 2, 29);
+		Spheres expanded;
+		InstanceTree::expandSpheres(assemblies, instances, expanded, pool);
+		Rays rays = generateRays(RAYS_RANDOM, 500, 31, pool);
+
+		InstanceTree tree;
+		check(tree.build(std::move(assemblies), instances, pool), "instance tree build");
+		SphereScene scene(std::move(tree), pool);
+		vector<IntersectionData> intersections;
+		scene.intersectRays(rays, intersections);
+		check(countMismatches(rays, intersections, SpheresView(expanded)) == 0, "instance tree");
+		checkCounts("instance tree counts", scene, rays, SpheresView(expanded));
+	}
+
+	void testSaveLoad(ThreadPool& pool)
+	{
+		const char* path = "tree-round-trip.bin";
+		Spheres spheres = generateSpheres(SCENE_MIXED_RADIUSES, 3000, 37, pool);
+		Rays rays = generateRays(RAYS_CAMERA, 500, 41, pool);
+		KDTree tree;
+		tree.build(SpheresView(spheres), pool);
+		check(tree.save(path), "kd-tree save");
+
+		{
+			// the scene maps the file until it goes out of scope
+			KDTree loaded;
+			check(loaded.load(path, pool), "kd-tree load");
+			SphereScene scene(std::move(loaded), pool);
+			vector<IntersectionData> intersections;
+			scene.intersectRays(rays, intersections);
+			check(countMismatches(rays, intersections, SpheresView(spheres)) == 0, "kd-tree save and load");
+		}
+
+		{
+			// a sphere removed before the save stays removed when the loaded tree is updated
+			Spheres moving = spheres;
+			SphereScene scene(SpheresView(moving), pool, ACCELERATOR_KDTREE);
+			int hitRay = 0;
+			while(hitRay < static_cast<int>(rays.rays.size()) - 1 && !scene.intersectRay(rays.rays[hitRay]).intersection)
+			{
+				++hitRay;
+			}
+			int hitSphere = scene.intersectRay(rays.rays[hitRay]).sphereIndex;
+			check(hitSphere >= 0, "kd-tree update before save hits");
+			vector<char> removed(moving.count, 0);
+			if(hitSphere >= 0)
+			{
+				removed[hitSphere] = 1;
+				SphereUpdate changes;
+				changes.removed.push_back(hitSphere);
+				scene.update(SpheresView(moving), changes);
+			}
+			check(scene.getKDTree()->save(path), "kd-tree save after update");
+
+			KDTree loaded;
+			check(loaded.load(path, pool), "kd-tree load after update");
+			SphereScene loadedScene(std::move(loaded), pool);
+			vector<IntersectionData> intersections;
+			loadedScene.intersectRays(rays, intersections);
+			check(countMismatches(rays, intersections, SpheresView(liveSpheres(moving, removed))) == 0,
+					"kd-tree load after update");
+
+			int movedSphere = hitSphere == 0 ? 1 : 0;
+			moving.centerCoords[0][movedSphere] += 1.f;
+			SphereUpdate changes;
+			changes.moved.push_back(movedSphere);
+			loadedScene.update(SpheresView(moving), changes);
+			loadedScene.intersectRays(rays, intersections);
+			check(countMismatches(rays, intersections, SpheresView(liveSpheres(moving, removed))) == 0,
+					"kd-tree update after load keeps removed spheres out");
+		}
+
+		// a file cut short is refused
+		check(truncateFile(path), "kd-tree file truncate");
+		KDTree truncated;
+		check(!truncated.load(path, pool), "truncated kd-tree file is refused");
+		remove(path);
+	}
+
+	void testSphereFiles(ThreadPool& pool)
+	{
+		const char* path = "spheres-round-trip.bin";
+		Spheres spheres = generateSpheres(SCENE_MIXED_RADIUSES, 1001, 43, pool);
+		check(SceneIO::saveSpheres(path, SpheresView(spheres)), "spheres save");
+
+		{
+			SceneIO::MappedSpheres mapped;
+			bool loaded = SceneIO::loadSpheres(path, mapped);
+			check(loaded && mapped.spheres.count == spheres.count, "spheres load");
+			for(int i = 0; loaded && i < spheres.count; ++i)
+			{
+				bool same = sameBits(mapped.spheres.radiuses[i], spheres.radiuses[i]);
+				for(int axis = 0; axis < 3; ++axis)
+				{
+					same = same && sameBits(mapped.spheres.centerCoords[axis][i], spheres.centerCoords[axis][i]);
+				}
+				check(same, "spheres save and load");
+			}
+		}
+
+		SceneIO::MappedSpheres bad;
+		check(corruptHeader(path) && !SceneIO::loadSpheres(path, bad), "spheres file with a bad header is refused");
+		check(SceneIO::saveSpheres(path, SpheresView(spheres)) && truncateFile(path) &&
+				!SceneIO::loadSpheres(path, bad), "truncated spheres file is refused");
+		remove(path);
+	}
+
+	void testRayFiles(ThreadPool& pool)
+	{
+		const char* path = "rays-round-trip.bin";
+		Rays rays = generateRays(RAYS_SHADOW, 1001, 47, pool);
+		check(SceneIO::saveRays(path, rays), "rays save");
+
+		Rays loaded;
+		check(SceneIO::loadRays(path, loaded, pool) && loaded.rays.size() == rays.rays.size(), "rays load");
+		for(size_t i = 0; i < loaded.rays.size() && i < rays.rays.size(); ++i)
+		{
+			check(sameRayBits(loaded.rays[i], rays.rays[i]), "rays save and load");
+		}
+
+		// chunks that do not divide the rays count
+		SceneIO::RayFileReader reader;
+		check(reader.open(path) && reader.size() == rays.rays.size(), "ray file reader open");
+		vector<Ray> chunk(37);
+		size_t readCount = 0;
+		for(int count; (count = reader.read(chunk.data(), chunk.size())) > 0; readCount += count)
+		{
+			for(int i = 0; i < count && readCount + i < rays.rays.size(); ++i)
+			{
+				check(sameRayBits(chunk[i], rays.rays[readCount + i]), "ray file reader chunks");
+			}
+		}
+		check(readCount == rays.rays.size() && !reader.hasFailed(), "ray file reader reads every ray");
+		reader.close();
+
+		check(corruptHeader(path), "rays file corrupt");
+		check(!SceneIO::loadRays(path, loaded, pool), "rays file with a bad header is refused");
+		check(!reader.open(path), "ray file reader refuses a bad header");
+		check(SceneIO::saveRays(path, rays) && truncateFile(path), "rays file truncate");
+		check(!SceneIO::loadRays(path, loaded, pool), "truncated rays file is refused");
+		check(!reader.open(path), "ray file reader refuses a truncated file");
+		remove(path);
+	}
+
+	bool nearlyEqual(float value, float reference)
+	{
+		return std::fabs(value - reference) <= 1e-6f * std::fabs(reference);
+	}
+
+	void testTextImport(ThreadPool& pool)
+	{
+		const char* path = "spheres.csv";
+		Spheres spheres = generateSpheres(SCENE_MIXED_RADIUSES, 1001, 53, pool);
+		FILE* file = fopen(path, "w");
+		check(file != nullptr, "csv file open");
+		if(file)
+		{
+			// a header, comments, empty lines and every separator
+			fputs("x,y,z,radius\n# spheres\n\n", file);
+			const char* separators[] = { ",", ";", " ", "\t" };
+			for(int i = 0; i < spheres.count; ++i)
+			{
+				const char* separator = separators[i % 4];
+				fprintf(file, "%.9g%s%.9g%s%.9g%s%.9g\n", spheres.centerCoords[0][i], separator,
+						spheres.centerCoords[1][i], separator, spheres.centerCoords[2][i], separator, spheres.radiuses[i]);
+			}
+			fclose(file);
+		}
+		Spheres imported;
+		check(SceneIO::importSpheresText(path, imported, pool) && imported.count == spheres.count, "csv spheres import");
+		for(int i = 0; i < imported.count && i < spheres.count; ++i)
+		{
+			bool same = nearlyEqual(imported.radiuses[i], spheres.radiuses[i]);
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				same = same && nearlyEqual(imported.centerCoords[axis][i], spheres.centerCoords[axis][i]);
+			}
+			check(same, "csv spheres import");
+		}
+
+		// rays without tmin and tmax take the defaults
+		Rays rays = generateRays(RAYS_SHADOW, 1001, 59, pool);
+		for(size_t i = 0; i < rays.rays.size(); i += 2)
+		{
+			rays.rays[i].tmin = 0.f;
+			rays.rays[i].tmax = std::numeric_limits<float>::max();
+		}
+		file = fopen(path, "w");
+		check(file != nullptr, "csv file open");
+		if(file)
+		{
+			for(size_t i = 0; i < rays.rays.size(); ++i)
+			{
+				const Ray& ray = rays.rays[i];
+				fprintf(file, "%.9g %.9g %.9g %.9g %.9g %.9g", ray.origin.x, ray.origin.y, ray.origin.z,
+						ray.direction.x, ray.direction.y, ray.direction.z);
+				if(i % 2)
+				{
+					fprintf(file, " %.9g %.9g", ray.tmin, ray.tmax);
+				}
+				fputs("\n", file);
+			}
+			fclose(file);
+		}
+		Rays importedRays;
+		check(SceneIO::importRaysText(path, importedRays, pool) && importedRays.rays.size() == rays.rays.size(),
+				"csv rays import");
+		for(size_t i = 0; i < importedRays.rays.size() && i < rays.rays.size(); ++i)
+		{
+			const Ray& ray = importedRays.rays[i];
+			const Ray& reference = rays.rays[i];
+			bool same = nearlyEqual(ray.tmin, reference.tmin) && nearlyEqual(ray.tmax, reference.tmax);
+			for(int axis = 0; axis < 3; ++axis)
+			{
+				same = same && nearlyEqual(ray.origin[axis], reference.origin[axis]) &&
+						nearlyEqual(ray.direction[axis], reference.direction[axis]);
+			}
+			check(same, "csv rays import");
+		}
+
+		file = fopen(path, "w");
+		check(file != nullptr, "csv file open");
+		if(file)
+		{
+			fputs("x,y,z,radius\n1,2,3,0.5\n4,5,six,0.5\n", file);
+			fclose(file);
+		}
+		Spheres malformed;
+		check(!SceneIO::importSpheresText(path, malformed, pool), "malformed csv is refused");
+		remove(path);
+	}
+}
+
+int main()
+{
+	ThreadPool pool(4);
+
+	testScene("kd-tree uniform camera", SCENE_UNIFORM, RAYS_CAMERA, ACCELERATOR_KDTREE, pool);
+	testScene("kd-tree clustered random", SCENE_CLUSTERED, RAYS_RANDOM, ACCELERATOR_KDTREE, pool);
+	testScene("kd-tree mixed shadow", SCENE_MIXED_RADIUSES, RAYS_SHADOW, ACCELERATOR_KDTREE, pool);
+	testScene("bvh4 uniform camera", SCENE_UNIFORM, RAYS_CAMERA, ACCELERATOR_BVH4, pool);
+	testScene("bvh4 clustered random", SCENE_CLUSTERED, RAYS_RANDOM, ACCELERATOR_BVH4, pool);
+	testScene("bvh4 mixed shadow", SCENE_MIXED_RADIUSES, RAYS_SHADOW, ACCELERATOR_BVH4, pool);
+	testOcclusionDistances("kd-tree occlusion distances", ACCELERATOR_KDTREE, pool);
+	testOcclusionDistances("bvh4 occlusion distances", ACCELERATOR_BVH4, pool);
+	testHitRecords("kd-tree hit records", ACCELERATOR_KDTREE, pool);
+	testHitRecords("bvh4 hit records", ACCELERATOR_BVH4, pool);
+	testStream(pool);
+	testChooseAccelerator(pool);
+	testLazy(pool);
+	testUpdate("kd-tree update", ACCELERATOR_KDTREE, pool);
+	testUpdate("bvh4 update", ACCELERATOR_BVH4, pool);
+	testInstances(pool);
+	testSaveLoad(pool);
+	testSphereFiles(pool);
+	testRayFiles(pool);
+	testTextImport(pool);
+
+	if(failures)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}